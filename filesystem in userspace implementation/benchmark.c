@@ -0,0 +1,424 @@
+/*
+
+  MyFS benchmark: drives the __myfs_*_implem functions of
+  implementation.c directly on an anonymous mapping, without FUSE and
+  without a mount, so it runs anywhere the code compiles.
+
+  gcc -O2 -Wall benchmark.c implementation.c -lpthread -o myfs-bench
+
+  ./myfs-bench [--size=<bytes>] [--files=<count>] [--depth=<levels>]
+               [--file-size=<bytes>] [--block=<bytes>] [--seed=<n>]
+               [--atime=<0 strict, 1 relatime, 2 noatime>]
+
+  Every workload is timed per operation; for each one the number of
+  operations, operations per second and the 50th, 90th, 99th and 99.9th
+  percentile and maximum latency are printed, one line per workload.
+
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/mman.h>
+
+size_t __myfs_locks_size_implem();
+int __myfs_mount_implem(void *, size_t, void *, int *, int);
+void __myfs_unmount_implem(void *, size_t, void *);
+int __myfs_getattr_implem(void *, size_t, void *, int *, uid_t, gid_t, const char *, struct stat *);
+int __myfs_readdir_implem(void *, size_t, void *, int *, const char *, void *,
+                          int (*)(void *, const char *, const struct stat *, off_t), off_t, off_t);
+int __myfs_mknod_implem(void *, size_t, void *, int *, const char *);
+int __myfs_unlink_implem(void *, size_t, void *, int *, const char *);
+int __myfs_mkdir_implem(void *, size_t, void *, int *, const char *);
+int __myfs_rename_implem(void *, size_t, void *, int *, const char *, const char*);
+int __myfs_truncate_implem(void *, size_t, void *, int *, const char *, off_t);
+int __myfs_read_implem(void *, size_t, void *, int *, const char *, char *, size_t, off_t);
+int __myfs_write_implem(void *, size_t, void *, int *, const char *, const char *, size_t, off_t);
+
+struct bench_options {
+  size_t size;
+  size_t files;
+  size_t depth;
+  size_t file_size;
+  size_t block;
+  size_t atime;
+  unsigned int seed;
+};
+
+/* The latencies of one workload, in nanoseconds */
+struct bench_stat {
+  const char *name;
+  uint64_t *samples;
+  size_t count;
+  size_t cap;
+  uint64_t total;
+};
+
+static void *memory;
+static size_t memory_size;
+static void *locks;
+static int bench_errno;
+
+static uint64_t bench_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec) * ((uint64_t) 1000000000) + ((uint64_t) ts.tv_nsec);
+}
+
+static void bench_start(struct bench_stat *stat, const char *name, size_t expected) {
+  stat->name = name;
+  stat->count = (size_t) 0;
+  stat->total = (uint64_t) 0;
+  stat->cap = (expected > ((size_t) 0)) ? expected : ((size_t) 1);
+  stat->samples = malloc(stat->cap * sizeof(uint64_t));
+  if (stat->samples == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+}
+
+static void bench_record(struct bench_stat *stat, uint64_t start) {
+  uint64_t ns;
+  uint64_t *samples;
+
+  ns = bench_now() - start;
+  if (stat->count == stat->cap) {
+    samples = realloc(stat->samples, 2 * stat->cap * sizeof(uint64_t));
+    if (samples == NULL) {
+      perror("realloc");
+      exit(1);
+    }
+    stat->samples = samples;
+    stat->cap *= 2;
+  }
+  stat->samples[stat->count++] = ns;
+  stat->total += ns;
+}
+
+/* A failed operation ends the run: the numbers would mean nothing */
+static void bench_check(int res, const char *op, const char *path) {
+  if (res < 0) {
+    fprintf(stderr, "%s %s: %s\n", op, path, strerror(bench_errno));
+    exit(1);
+  }
+}
+
+/* Takes what readdir hands out like FUSE's filler into a buffer of
+   bench_dir_room names would */
+static const size_t bench_dir_room = (size_t) 4096 / ((size_t) 32);
+
+static int bench_filler(void *buf, const char *name, const struct stat *st, off_t next) {
+  size_t *count = (size_t *) buf;
+
+  (void) name;
+  (void) st;
+  (void) next;
+  if (*count == bench_dir_room) return 1;
+  (*count)++;
+  return 0;
+}
+
+static int bench_compare(const void *a, const void *b) {
+  uint64_t x = *((const uint64_t *) a);
+  uint64_t y = *((const uint64_t *) b);
+
+  return (x > y) - (x < y);
+}
+
+static double bench_percentile(struct bench_stat *stat, double p) {
+  size_t i;
+
+  i = (size_t) (p * ((double) (stat->count - ((size_t) 1))) + 0.5);
+  return ((double) stat->samples[i]) / 1000.0;
+}
+
+static void bench_report(struct bench_stat *stat) {
+  double secs;
+
+  if (stat->count == ((size_t) 0)) {
+    free(stat->samples);
+    return;
+  }
+  qsort(stat->samples, stat->count, sizeof(uint64_t), bench_compare);
+  secs = ((double) stat->total) / 1e9;
+  printf("%-16s %10zu %12.0f %9.2f %9.2f %9.2f %9.2f %10.2f\n",
+         stat->name, stat->count,
+         (secs > 0.0) ? (((double) stat->count) / secs) : 0.0,
+         bench_percentile(stat, 0.5),
+         bench_percentile(stat, 0.9),
+         bench_percentile(stat, 0.99),
+         bench_percentile(stat, 0.999),
+         ((double) stat->samples[stat->count - ((size_t) 1)]) / 1000.0);
+  free(stat->samples);
+}
+
+/* Creates opts->files empty files in one directory, stats them all,
+   lists the directory, renames every file and removes them again
+*/
+static void bench_namespace(struct bench_options *opts) {
+  struct bench_stat stat;
+  struct stat st;
+  char path[64], to[64];
+  size_t i, rounds, count;
+  off_t offset;
+  uint64_t start;
+  int res;
+
+  bench_check(__myfs_mkdir_implem(memory, memory_size, locks, &bench_errno, "/create"), "mkdir", "/create");
+
+  bench_start(&stat, "create", opts->files);
+  for (i=0;i<opts->files;i++) {
+    snprintf(path, sizeof(path), "/create/f%zu", i);
+    start = bench_now();
+    res = __myfs_mknod_implem(memory, memory_size, locks, &bench_errno, path);
+    bench_record(&stat, start);
+    bench_check(res, "mknod", path);
+  }
+  bench_report(&stat);
+
+  bench_start(&stat, "stat", opts->files);
+  for (i=0;i<opts->files;i++) {
+    snprintf(path, sizeof(path), "/create/f%zu", ((size_t) rand()) % opts->files);
+    start = bench_now();
+    res = __myfs_getattr_implem(memory, memory_size, locks, &bench_errno, getuid(), getgid(), path, &st);
+    bench_record(&stat, start);
+    bench_check(res, "getattr", path);
+  }
+  bench_report(&stat);
+
+  /* One call per buffer full of names, as FUSE lists a directory */
+  rounds = (size_t) 16;
+  bench_start(&stat, "readdir", rounds * (opts->files / bench_dir_room + ((size_t) 1)));
+  for (i=0;i<rounds;i++) {
+    offset = (off_t) 0;
+    do {
+      count = (size_t) 0;
+      start = bench_now();
+      res = __myfs_readdir_implem(memory, memory_size, locks, &bench_errno, "/create",
+                                  &count, bench_filler, (off_t) 0, offset);
+      bench_record(&stat, start);
+      bench_check(res, "readdir", "/create");
+      offset += (off_t) res;
+    } while (res > 0);
+  }
+  bench_report(&stat);
+
+  bench_start(&stat, "rename", opts->files);
+  for (i=0;i<opts->files;i++) {
+    snprintf(path, sizeof(path), "/create/f%zu", i);
+    snprintf(to, sizeof(to), "/create/r%zu", i);
+    start = bench_now();
+    res = __myfs_rename_implem(memory, memory_size, locks, &bench_errno, path, to);
+    bench_record(&stat, start);
+    bench_check(res, "rename", path);
+  }
+  bench_report(&stat);
+
+  bench_start(&stat, "unlink", opts->files);
+  for (i=0;i<opts->files;i++) {
+    snprintf(path, sizeof(path), "/create/r%zu", i);
+    start = bench_now();
+    res = __myfs_unlink_implem(memory, memory_size, locks, &bench_errno, path);
+    bench_record(&stat, start);
+    bench_check(res, "unlink", path);
+  }
+  bench_report(&stat);
+}
+
+/* Looks up a file at the bottom of opts->depth nested directories */
+static void bench_deep_lookup(struct bench_options *opts) {
+  struct bench_stat stat;
+  struct stat st;
+  char *path;
+  size_t i, len, lookups;
+  uint64_t start;
+  int res;
+
+  path = malloc(opts->depth * ((size_t) 4) + ((size_t) 8));
+  if (path == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  len = (size_t) 0;
+  for (i=0;i<opts->depth;i++) {
+    len += (size_t) sprintf(path + len, "/d%zu", i % ((size_t) 10));
+    bench_check(__myfs_mkdir_implem(memory, memory_size, locks, &bench_errno, path), "mkdir", path);
+  }
+  strcpy(path + len, "/f");
+  bench_check(__myfs_mknod_implem(memory, memory_size, locks, &bench_errno, path), "mknod", path);
+
+  lookups = opts->files;
+  bench_start(&stat, "deep-lookup", lookups);
+  for (i=0;i<lookups;i++) {
+    start = bench_now();
+    res = __myfs_getattr_implem(memory, memory_size, locks, &bench_errno, getuid(), getgid(), path, &st);
+    bench_record(&stat, start);
+    bench_check(res, "getattr", path);
+  }
+  bench_report(&stat);
+  free(path);
+}
+
+/* Writes a file of opts->file_size bytes sequentially in opts->block
+   pieces and reads it back, then does as many reads and writes of
+   opts->block bytes at random block-aligned offsets, then truncates
+   it to random sizes
+*/
+static void bench_data(struct bench_options *opts) {
+  struct bench_stat stat;
+  const char *path = "/data";
+  char *buf;
+  size_t i, blocks;
+  off_t off;
+  uint64_t start;
+  int res;
+
+  buf = malloc(opts->block);
+  if (buf == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  for (i=0;i<opts->block;i++) buf[i] = (char) (i * 31 + 7);
+  blocks = opts->file_size / opts->block;
+  if (blocks == ((size_t) 0)) blocks = (size_t) 1;
+  bench_check(__myfs_mknod_implem(memory, memory_size, locks, &bench_errno, path), "mknod", path);
+
+  bench_start(&stat, "seq-write", blocks);
+  for (i=0;i<blocks;i++) {
+    start = bench_now();
+    res = __myfs_write_implem(memory, memory_size, locks, &bench_errno, path, buf, opts->block, (off_t) (i * opts->block));
+    bench_record(&stat, start);
+    bench_check(res, "write", path);
+  }
+  bench_report(&stat);
+
+  bench_start(&stat, "seq-read", blocks);
+  for (i=0;i<blocks;i++) {
+    start = bench_now();
+    res = __myfs_read_implem(memory, memory_size, locks, &bench_errno, path, buf, opts->block, (off_t) (i * opts->block));
+    bench_record(&stat, start);
+    bench_check(res, "read", path);
+  }
+  bench_report(&stat);
+
+  bench_start(&stat, "rand-write", blocks);
+  for (i=0;i<blocks;i++) {
+    off = (off_t) ((((size_t) rand()) % blocks) * opts->block);
+    start = bench_now();
+    res = __myfs_write_implem(memory, memory_size, locks, &bench_errno, path, buf, opts->block, off);
+    bench_record(&stat, start);
+    bench_check(res, "write", path);
+  }
+  bench_report(&stat);
+
+  bench_start(&stat, "rand-read", blocks);
+  for (i=0;i<blocks;i++) {
+    off = (off_t) ((((size_t) rand()) % blocks) * opts->block);
+    start = bench_now();
+    res = __myfs_read_implem(memory, memory_size, locks, &bench_errno, path, buf, opts->block, off);
+    bench_record(&stat, start);
+    bench_check(res, "read", path);
+  }
+  bench_report(&stat);
+
+  /* Shrinking and growing again moves data in and out of the file */
+  bench_start(&stat, "truncate", blocks);
+  for (i=0;i<blocks;i++) {
+    off = (off_t) (((size_t) rand()) % (blocks * opts->block + ((size_t) 1)));
+    start = bench_now();
+    res = __myfs_truncate_implem(memory, memory_size, locks, &bench_errno, path, off);
+    bench_record(&stat, start);
+    bench_check(res, "truncate", path);
+  }
+  bench_report(&stat);
+
+  bench_check(__myfs_unlink_implem(memory, memory_size, locks, &bench_errno, path), "unlink", path);
+  free(buf);
+}
+
+static int bench_parse(const char *arg, const char *name, size_t *value) {
+  size_t len;
+  char *end;
+  unsigned long long v;
+
+  len = strlen(name);
+  if (strncmp(arg, name, len) != 0) return 0;
+  errno = 0;
+  v = strtoull(arg + len, &end, 10);
+  if ((errno != 0) || (end == (arg + len)) || (*end != '\0') || (v == 0ull)) {
+    fprintf(stderr, "Invalid value in %s\n", arg);
+    exit(1);
+  }
+  *value = (size_t) v;
+  return 1;
+}
+
+int main(int argc, char **argv) {
+  struct bench_options opts;
+  size_t seed;
+  int i;
+
+  opts.size = ((size_t) 512) << 20;
+  opts.files = (size_t) 20000;
+  opts.depth = (size_t) 64;
+  opts.file_size = ((size_t) 64) << 20;
+  opts.block = (size_t) 4096;
+  opts.atime = (size_t) 1;
+  seed = (size_t) 1;
+  for (i=1;i<argc;i++) {
+    if (bench_parse(argv[i], "--size=", &opts.size)) continue;
+    if (bench_parse(argv[i], "--files=", &opts.files)) continue;
+    if (bench_parse(argv[i], "--depth=", &opts.depth)) continue;
+    if (bench_parse(argv[i], "--file-size=", &opts.file_size)) continue;
+    if (bench_parse(argv[i], "--block=", &opts.block)) continue;
+    if (bench_parse(argv[i], "--seed=", &seed)) continue;
+    if (bench_parse(argv[i], "--atime=", &opts.atime)) continue;
+    fprintf(stderr,
+            "usage: %s [--size=<bytes>] [--files=<count>] [--depth=<levels>]\n"
+            "          [--file-size=<bytes>] [--block=<bytes>] [--seed=<n>]\n"
+            "          [--atime=<0 strict, 1 relatime, 2 noatime>]\n",
+            argv[0]);
+    return 1;
+  }
+  opts.seed = (unsigned int) seed;
+  srand(opts.seed);
+
+  memory_size = opts.size;
+  memory = mmap(NULL, memory_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (memory == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  locks = malloc(__myfs_locks_size_implem());
+  if (locks == NULL) {
+    perror("malloc");
+    return 1;
+  }
+  if (__myfs_mount_implem(memory, memory_size, locks, &bench_errno, (int) opts.atime) != 0) {
+    fprintf(stderr, "mount: %s\n", strerror(bench_errno));
+    return 1;
+  }
+
+  printf("%-16s %10s %12s %9s %9s %9s %9s %10s\n",
+         "workload", "ops", "ops/s", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)", "max(us)");
+  bench_namespace(&opts);
+  bench_deep_lookup(&opts);
+  bench_data(&opts);
+
+  __myfs_unmount_implem(memory, memory_size, locks);
+  free(locks);
+  munmap(memory, memory_size);
+  return 0;
+}
@@ -62,6 +62,8 @@ https://engineering.facile.it/blog/eng/write-filesystem-fuse/
 
 */
 
+#define _GNU_SOURCE // for SEEK_DATA and SEEK_HOLE
+
 #include <stddef.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
@@ -75,6 +77,8 @@ https://engineering.facile.it/blog/eng/write-filesystem-fuse/
 #include <errno.h>
 #include <stdio.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 
 /* The filesystem you implement must support all the 13 operations
@@ -293,6 +297,17 @@ https://engineering.facile.it/blog/eng/write-filesystem-fuse/
 #define MAGIC_NUM ((size_t) 17103563)
 // the 7th prime number cat the 17th prime number cat the 103rd prime number
 
+// the layout of the image, bumped whenever it changes
+// every reference inside the image is an offset from its start, so an
+// image read back or mapped from the backup-file at whatever address is
+// served as it is, there is nothing to fix up when mounting it
+// an image of another version, or one written by a build whose handle
+// or units differ in size, is refused instead of misread or formatted over
+// 1: the first one with a version
+// 2: the extents of a file may leave holes between them and at its end
+#define FORMAT_VERSION ((uint32_t) 2)
+#define FORMAT_OLDEST ((uint32_t) 1) // the oldest version still served, and upgraded when mounted
+
 #define MAX_NAME ((int) 256+1) // +1 just for safety
 // 256 = MAX_NAME-1, 255 = MAX_NAME-2, etc
 
@@ -305,42 +320,183 @@ https://engineering.facile.it/blog/eng/write-filesystem-fuse/
 
 typedef size_t off_type;
 
+#define INODE_LOCKS ((int) 64) // blocks are spread over this many locks
+
+// memory is handed out in units of ALLOC_UNIT bytes
+// a bitmap keeps one bit per unit, set while the unit is in use,
+// and a summary tree over the words of the bitmap keeps, for every range
+// of words, how many free units the range starts with, ends with and
+// the longest run of free units inside it
+// finding the first run of free units that is long enough then only
+// takes one walk down the tree, and marking units used or free only
+// walks back up from the words that changed
+#define ALLOC_UNIT ((size_t) 64)
+#define UNIT_BITS ((size_t) 64) // units per word of the bitmap
+
+// every change to the memory marks the DIRTY_PAGE sized pages it lands
+// on in a bitmap, so that syncing the memory with the backup-file only
+// has to write back those pages, see __myfs_dirty_ranges_implem
+#define DIRTY_PAGE ((size_t) 4096)
+
+// the journal myfs.c writes its transactions to before they reach
+// their home in the backup-file is an area of the memory set aside at
+// format time, a 16th of the memory but no more than JOURNAL_MAX
+// nothing in here ever writes to it, and it is never marked dirty
+#define JOURNAL_MAX ((size_t) 64 << 20)
+
+// the tree's nodes count how many units are missing from a fully free
+// range, so memory that reads as all zeros is all free
+// the leaves are not stored, they are worked out of the bitmap words
+typedef struct {
+    uint32_t used_pre; // units in the range minus the free units it starts with
+    uint32_t used_suf; // same for the free units it ends with
+    uint32_t used_max; // same for the longest run of free units
+} summary_node;
+
 typedef struct {
     off_type root_dir; // offset to root dir
     uint32_t magic;
-    off_type begining_of_free_mem; // offset to the zone of contiguous memory
-    int free_blocks; // how many non contiguous blocks are in the list
-    size_t free_contig_mem_size;
-    off_type offset_to_first_freed_block; // first free non contiguous block in the list
-    size_t llist_mem_size_total; // total size of free non contiguous blocks
+    uint32_t version; // FORMAT_VERSION
+    uint32_t header_size; // sizeof(handle_header) of the build that formatted the image
+    uint32_t unit_size; // ALLOC_UNIT of that build
+    size_t num_units; // the memory is made of this many ALLOC_UNIT sized units
+    size_t free_units; // how many of them are not in use
+    off_type bitmap; // offset to the bitmap of units in use
+    off_type summary; // offset to the summary tree over the words of the bitmap
+    size_t summary_leaves; // words of the bitmap under the tree, a power of two
+    off_type dirty; // offset to the bitmap of pages changed since the last sync
+    size_t dirty_words; // words of that bitmap
+    size_t dirty_pages; // bits set in it
+    off_type journal; // offset to the journal area, 0 if the memory is too small for one
+    size_t journal_size;
+    uint64_t journal_id; // picked at format time, tells this image's transactions from stale ones
+    // where the compactor left off: the directory it is going through
+    // (0 to start over at the root) and the next entry to look at
+    off_type defrag_dir;
+    int defrag_index;
+    size_t defrag_moved; // blocks moved since the pass started at the root
+    // the inode of that next entry if a step ran out in the middle of its
+    // extents, and the file offset of the first extent not looked at yet
+    off_type defrag_file;
+    size_t defrag_file_off;
+    int atime_mode; // ATIME_*, as given to __myfs_mount_implem
+    // room for fields to come, a fixed number of bytes so the handle is
+    // the same size whatever the build; it covers what the locks took up
+    // before they moved out to fs_locks, so images formatted since fit
+    char reserved[3608];
 } handle_header;
 
+// the locks only mean something while the filesystem is mounted, so they
+// live with the process rather than in the image: the image gets copied
+// to the backup-file and moved around when it grows, and a lock must
+// neither be saved nor moved while in use
+// myfs.c keeps one of these per mount, __myfs_locks_size_implem bytes
+// of it, and hands it to every call that takes locks
+// it holds its namespace lock around every call: exclusively for
+// mknod, mkdir, unlink, rmdir and rename, shared for everything else,
+// so these only have to keep the shared callers apart
 typedef struct {
-    size_t mem_size; // size of the block for data not including the block header
-    size_t* file_size; // same
-    size_t total_size; // size + sizeof(mem_block)
-    //off_type next_off;
-    struct mem_block* next; // next block in the list of freed non contiguous blocks
-    struct mem_block* previous;
-    char* name[MAX_NAME-1];
-    //char type[1]; // 'd' or 'f'
+    pthread_mutex_t alloc_lock; // guards the free memory bookkeeping in the handle
+    pthread_rwlock_t inode_locks[INODE_LOCKS]; // guard a block's data and times
+} fs_locks;
+
+// the inode of a file or directory
+// its name only lives in the entry of its parent's child table
+// and its contents in memory of their own, so an inode is one
+// ALLOC_UNIT, one cache line, and walking a directory's inodes
+// touches one line each
+typedef struct {
+    off_type parent; // offset to the parent directory, 0 for the root
+    int64_t atime; // last access, in nanoseconds since the epoch
+    int64_t mtime; // last modification, same
+    size_t file_size; // bytes of file data, spread over the extents
+    union {
+        struct { // a file
+            off_type extents; // offset to the root of the file's extent tree
+            int num_extents; // extents in the tree
+            int extent_depth; // levels of the tree above its leaves
+        };
+        struct { // a directory
+            off_type children; // offset to the sorted child table
+            int num_children; // entries in use
+            int children_cap; // how many entries fit in the table
+        };
+    };
     int type; // 0 for file, 1 for dir
-    struct timespec st_size;
-    struct timespec st_atim;
-    struct timespec st_mtim;
-    struct timespec *acc;
-    struct timespec *mod;
-    int num_children; // number of subdirectories of a directory
-    int* num_subdir; // same
-    struct mem_block* parent; // parent directory of a file or directory
-    char parent_name[MAX_NAME-1];
-    char path_name[MAX_NAME*10];
-    char parent_path_name[MAX_NAME*9];
-    int is_contiguous; // writing data to blocks is different if they are/not contiguous
-    size_t total_non_contig_size; // a total_size for non contiguous blocks
-    struct mem_block* next_non_contig_block; // to link non contiguous blocks
+    int num_subdir; // number of subdirectories, for st_nlink
+    uint32_t flags; // INODE_INLINE, INODE_ORPHAN
+    uint32_t inline_cap; // bytes of room for inline data right after the inode
 } mem_block;
 
+// a small file keeps its data right after its inode, in the same run of
+// units, instead of in extents: its extent tree stays empty and
+// file_size bytes of data follow the inode
+// the run grows in place up to INLINE_MAX bytes of data, past that or
+// when the units after it are taken the data moves out to an extent
+// and the file stays a file with extents from then on
+#define INODE_INLINE ((uint32_t) 1)
+#define INLINE_MAX ((size_t) 448) // so an inode and its data are 8 units at most
+
+// an inode taken out of its directory while a caller still holds its
+// inode number, see __myfs_forget_ino_implem
+#define INODE_ORPHAN ((uint32_t) 2)
+
+// one entry in a directory's child table
+// each directory keeps its entries sorted by name in memory of its own
+// so looking up or listing a directory only touches that directory's entries
+typedef struct {
+    off_type block_off; // offset to the child's inode
+    char name[MAX_NAME];
+} dir_entry;
+
+#define DIR_MIN_CAP ((int) 8) // entries in a freshly allocated child table
+
+// one piece of a file's data
+// the extents of a file are kept in order of file_off and never overlap
+// nor reach past file_size, and the bytes of the file no extent holds,
+// between them or after the last one, are a hole: they read as zeros
+// and take up no memory
+typedef struct {
+    size_t file_off; // where in the file the extent starts
+    size_t length; // bytes of the file stored in it
+    size_t capacity; // bytes there is room for, a multiple of ALLOC_UNIT
+    off_type block_off; // offset to the memory holding those bytes
+} extent;
+
+#define EXTENT_MIN_SIZE ((size_t) 4096) // smallest data block added to a file
+
+// the extents of a file hang off its inode as a B+tree keyed by file
+// offset, built of nodes of EXTENT_NODE bytes, so no file needs one long
+// run of memory for its extents, adding one never copies the others,
+// and finding the extent of an offset is one walk down the tree
+// the leaves hold the extents, the nodes above them an extent_index per
+// child, and every leaf is extent_depth levels below the root
+typedef struct {
+    uint32_t count; // entries in use
+    uint32_t level; // 0 for a leaf
+    uint64_t reserved;
+} extent_node;
+
+// a child of a node above the leaves: where its first extent starts in
+// the file (not looked at for the first child) and where the child is
+typedef struct {
+    size_t file_off;
+    off_type child;
+} extent_index;
+
+#define EXTENT_NODE ((size_t) 256)
+#define LEAF_EXTENTS ((int) ((EXTENT_NODE - sizeof(extent_node)) / sizeof(extent))) // 7
+#define NODE_CHILDREN ((int) ((EXTENT_NODE - sizeof(extent_node)) / sizeof(extent_index))) // 15
+#define EXTENT_DEPTH_MAX ((int) 16) // far more levels than memory for the extents
+
+// where a walk down an extent tree went: the node and the entry in it
+// at every level, from the root at 0 down to the leaf at depth
+typedef struct {
+    int depth;
+    extent_node* node[EXTENT_DEPTH_MAX + 1];
+    int index[EXTENT_DEPTH_MAX + 1];
+} extent_cursor;
+
 off_type trans_to_off(void* fsptr, void* ptr){
     if(ptr==NULL)
         return (off_type) 0;
@@ -355,12 +511,51 @@ void* trans_to_ptr(void* fsptr, off_type offset){
     return ptr;
 }
 
-static void set_time(mem_block *block, int if_mod) {
+static void mark_dirty(void*, void*, size_t);
+
+// how reading a file or listing a directory updates its access time
+#define ATIME_STRICT ((int) 0) // every time
+#define ATIME_RELATIME ((int) 1) // once it is older than the last modification or a day old
+#define ATIME_NOATIME ((int) 2) // never
+#define RELATIME_AGE ((int64_t) 86400 * 1000000000) // a day
+
+static int64_t ts_to_ns(const struct timespec* ts){
+    return (int64_t) ts->tv_sec * 1000000000 + (int64_t) ts->tv_nsec;
+}
+
+static struct timespec ns_to_ts(int64_t ns){
+    struct timespec ts;
+    ts.tv_sec = (time_t) (ns / 1000000000);
+    ts.tv_nsec = (long) (ns % 1000000000);
+    if(ts.tv_nsec < 0){
+        ts.tv_sec--;
+        ts.tv_nsec += 1000000000;
+    }
+    return ts;
+}
+
+// if_mod set: block changed, so both times are now
+// if_mod not set: block was only read, which leaves the inode alone
+// unless the atime mode asks for the access time to be updated, so
+// reads do not keep dirtying the pages of the inodes they touch
+// reads may hold the inode lock shared only, hence the atomics
+static void set_time(void* fsptr, mem_block *block, int if_mod) {
+    handle_header* handle = (handle_header*) fsptr;
     struct timespec ts;
+    if(!if_mod && handle->atime_mode == ATIME_NOATIME)
+        return;
     clock_gettime(CLOCK_REALTIME, &ts);
-    block->acc = &ts;
-    if(if_mod==1)
-        block->mod = &ts;
+    int64_t now = ts_to_ns(&ts);
+    if(!if_mod){
+        int64_t atime = __atomic_load_n(&block->atime, __ATOMIC_RELAXED);
+        if(handle->atime_mode == ATIME_RELATIME && atime > block->mtime && now - atime < RELATIME_AGE)
+            return;
+        __atomic_store_n(&block->atime, now, __ATOMIC_RELAXED);
+    }else{
+        block->atime = now;
+        block->mtime = now;
+    }
+    mark_dirty(fsptr, block, sizeof(mem_block));
 }
 
 /*
@@ -406,398 +601,2262 @@ static int check_name(char* name){
     return 1;
 }
 
-static int set_name(mem_block* block, char* name){
-    if(check_name(name) == 0)
+// inodes share a small table of locks, picked by their offset
+static pthread_rwlock_t* inode_lock(void* fsptr, fs_locks* locks, mem_block* block){
+    off_type off = trans_to_off(fsptr, block);
+    return &locks->inode_locks[((off >> 6) ^ (off >> 14)) % INODE_LOCKS];
+}
+
+// several threads may mark pages at once, so the bits are set atomically
+// a bit that is set already is not written again
+static void mark_dirty(void* fsptr, void* ptr, size_t len){
+    handle_header* handle = (handle_header*) fsptr;
+    if(len == (size_t) 0 || handle->dirty == (off_type) 0)
+        return;
+    uint64_t* dirty = (uint64_t*) trans_to_ptr(fsptr, handle->dirty);
+    size_t off = (size_t) ((char*) ptr - (char*) fsptr);
+    for(size_t page = off / DIRTY_PAGE; page <= (off + len - 1) / DIRTY_PAGE; page++){
+        uint64_t bit = (uint64_t) 1 << (page % 64);
+        if((__atomic_load_n(&dirty[page / 64], __ATOMIC_RELAXED) & bit) == 0 &&
+           (__atomic_fetch_or(&dirty[page / 64], bit, __ATOMIC_RELAXED) & bit) == 0)
+            __atomic_fetch_add(&handle->dirty_pages, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static uint64_t* unit_bitmap(handle_header* handle){
+    return (uint64_t*) trans_to_ptr(handle, handle->bitmap);
+}
+
+static summary_node* summary_tree(handle_header* handle){
+    return (summary_node*) trans_to_ptr(handle, handle->summary);
+}
+
+// the units covered by node i of the tree, cut off at the end of memory
+static size_t node_units(handle_header* handle, size_t i, size_t* first){
+    size_t level = (size_t) (63 - __builtin_clzl(i));
+    size_t words = handle->summary_leaves >> level;
+    size_t lo = (i - ((size_t) 1 << level)) * words * UNIT_BITS;
+    size_t hi = lo + words * UNIT_BITS;
+    if(lo > handle->num_units)
+        lo = handle->num_units;
+    if(hi > handle->num_units)
+        hi = handle->num_units;
+    *first = lo;
+    return hi - lo;
+}
+
+// free units a node's range starts with, ends with, and its longest run
+static size_t node_runs(handle_header* handle, size_t i, size_t* pre, size_t* suf){
+    size_t first;
+    size_t size = node_units(handle, i, &first);
+    if(i < handle->summary_leaves){
+        summary_node* node = &summary_tree(handle)[i];
+        *pre = size - node->used_pre;
+        *suf = size - node->used_suf;
+        return size - node->used_max;
+    }
+    if(size == (size_t) 0){
+        *pre = 0;
+        *suf = 0;
         return 0;
-    if(block->type == DIRECTORY_TYPE)
-        strcat(name, "/");
-    strcpy(*block->name, name);
-    return 1;
+    }
+    uint64_t mask = size == UNIT_BITS ? ~(uint64_t) 0 : (((uint64_t) 1 << size) - 1);
+    uint64_t free_bits = ~unit_bitmap(handle)[i - handle->summary_leaves] & mask;
+    if(free_bits == mask){
+        *pre = size;
+        *suf = size;
+        return size;
+    }
+    uint64_t used_bits = ~free_bits & mask;
+    *pre = (size_t) __builtin_ctzll(used_bits);
+    *suf = size - 1 - (size_t) (63 - __builtin_clzll(used_bits));
+    size_t max = 0;
+    while(free_bits != 0){
+        free_bits &= free_bits >> 1;
+        max++;
+    }
+    return max;
+}
+
+static void update_node(handle_header* handle, size_t i){
+    size_t lpre, lsuf, rpre, rsuf, first;
+    size_t lmax = node_runs(handle, 2*i, &lpre, &lsuf);
+    size_t rmax = node_runs(handle, 2*i + 1, &rpre, &rsuf);
+    size_t lsize = node_units(handle, 2*i, &first);
+    size_t rsize = node_units(handle, 2*i + 1, &first);
+    size_t size = lsize + rsize;
+    size_t pre = lpre == lsize ? lsize + rpre : lpre;
+    size_t suf = rsuf == rsize ? rsize + lsuf : rsuf;
+    size_t max = lsuf + rpre;
+    if(lmax > max)
+        max = lmax;
+    if(rmax > max)
+        max = rmax;
+    summary_node* node = &summary_tree(handle)[i];
+    node->used_pre = (uint32_t) (size - pre);
+    node->used_suf = (uint32_t) (size - suf);
+    node->used_max = (uint32_t) (size - max);
+    mark_dirty(handle, node, sizeof(summary_node));
+}
+
+// set or clear the bits of count units starting at first,
+// then fix the tree above the words that changed, level by level
+static void mark_units(handle_header* handle, size_t first, size_t count, int used){
+    uint64_t* bitmap = unit_bitmap(handle);
+    size_t unit = first;
+    size_t left = count;
+    while(left > (size_t) 0){
+        size_t bit = unit % UNIT_BITS;
+        size_t len = UNIT_BITS - bit;
+        if(len > left)
+            len = left;
+        uint64_t bits = len == UNIT_BITS ? ~(uint64_t) 0 : ((((uint64_t) 1 << len) - 1) << bit);
+        if(used)
+            bitmap[unit / UNIT_BITS] |= bits;
+        else
+            bitmap[unit / UNIT_BITS] &= ~bits;
+        unit += len;
+        left -= len;
+    }
+    mark_dirty(handle, &bitmap[first / UNIT_BITS], ((first + count - 1) / UNIT_BITS - first / UNIT_BITS + 1) * sizeof(uint64_t));
+    size_t lo = handle->summary_leaves + first / UNIT_BITS;
+    size_t hi = handle->summary_leaves + (first + count - 1) / UNIT_BITS;
+    while(lo > 1){
+        lo /= 2;
+        hi /= 2;
+        for(size_t i=lo; i<=hi; i++)
+            update_node(handle, i);
+    }
+    if(used)
+        handle->free_units -= count;
+    else
+        handle->free_units += count;
+    mark_dirty(handle, &handle->free_units, sizeof(size_t));
+}
+
+// the first free run of count units, lowest address first
+// returns num_units if there is none
+static size_t find_units(handle_header* handle, size_t count){
+    size_t pre, suf, first;
+    if(count == (size_t) 0 || node_runs(handle, 1, &pre, &suf) < count)
+        return handle->num_units;
+    size_t i = 1;
+    while(i < handle->summary_leaves){
+        size_t lpre, lsuf, rpre, rsuf;
+        if(node_runs(handle, 2*i, &lpre, &lsuf) >= count){
+            i = 2*i;
+            continue;
+        }
+        node_runs(handle, 2*i + 1, &rpre, &rsuf);
+        if(lsuf + rpre >= count){
+            node_units(handle, 2*i + 1, &first);
+            return first - lsuf;
+        }
+        i = 2*i + 1;
+    }
+    // the run lies inside this one word of the bitmap
+    // keep the bits that start count free units in a row
+    size_t size = node_units(handle, i, &first);
+    uint64_t mask = size == UNIT_BITS ? ~(uint64_t) 0 : (((uint64_t) 1 << size) - 1);
+    uint64_t free_bits = ~unit_bitmap(handle)[i - handle->summary_leaves] & mask;
+    uint64_t starts = free_bits;
+    size_t len = 1;
+    while(len < count){
+        size_t step = count - len < len ? count - len : len;
+        starts &= starts >> step;
+        len += step;
+    }
+    return first + (size_t) __builtin_ctzll(starts);
+}
+
+// how many free units follow unit, looking at no more than want of them
+static size_t free_units_after(handle_header* handle, size_t unit, size_t want){
+    uint64_t* bitmap = unit_bitmap(handle);
+    size_t found = 0;
+    while(found < want && unit < handle->num_units){
+        size_t bit = unit % UNIT_BITS;
+        uint64_t word = bitmap[unit / UNIT_BITS] >> bit;
+        size_t avail = UNIT_BITS - bit;
+        size_t run = word == 0 ? avail : (size_t) __builtin_ctzll(word);
+        if(run > avail)
+            run = avail;
+        if(unit + run > handle->num_units)
+            run = handle->num_units - unit;
+        found += run;
+        unit += run;
+        if(run < avail)
+            break;
+    }
+    return found < want ? found : want;
+}
+
+// how many free units come right before unit, looking at no more than want of them
+static size_t free_units_before(handle_header* handle, size_t unit, size_t want){
+    uint64_t* bitmap = unit_bitmap(handle);
+    size_t found = 0;
+    while(found < want && unit > (size_t) 0){
+        size_t bit = (unit - 1) % UNIT_BITS;
+        uint64_t word = bitmap[(unit - 1) / UNIT_BITS] << (UNIT_BITS - 1 - bit);
+        size_t avail = bit + 1;
+        size_t run = word == 0 ? avail : (size_t) __builtin_clzll(word);
+        if(run > avail)
+            run = avail;
+        found += run;
+        unit -= run;
+        if(run < avail)
+            break;
+    }
+    return found < want ? found : want;
+}
+
+// memory comes in whole units, size bytes take up this much of it
+static size_t unit_size(size_t size){
+    return (size + ALLOC_UNIT - 1) / ALLOC_UNIT * ALLOC_UNIT;
 }
 
-static mem_block* get_block(void*, size_t, size_t);
-static mem_block* switch_to_llist_alloc(void*, size_t);
-static mem_block* defrag_fs(void*, size_t, mem_block*);
+// memory handed out carries no header, whoever holds it
+// knows its size and has to give that back to free_block
+static void* alloc_block(void* fsptr, size_t size){
+    if(fsptr==NULL || size == (size_t) 0)
+        return NULL;
+    handle_header* handle = (handle_header*) fsptr;
+
+    // take the first run of units that is long enough
+    // the free units may just be too scattered for a run that long,
+    // then the compactor has to merge them first, see __myfs_defrag_step_implem
+    size_t units = unit_size(size) / ALLOC_UNIT;
+    size_t first = find_units(handle, units);
+    if(first == handle->num_units)
+        return NULL;
+    mark_units(handle, first, units, 1);
+    return trans_to_ptr(fsptr, (off_type) (first * ALLOC_UNIT));
+}
 
-static handle_header* init_fs(void* fsptr, size_t fssize){
+// lays out a new filesystem, see init_fs
+// only the metadata in front gets written: the memory given to files is
+// never assumed to be zero, so a fresh image costs no more than its
+// bitmaps whatever its size, and pages fresh from ftruncate or an
+// anonymous mmap stay untouched until used
+static __attribute__((noinline, cold)) handle_header* format_fs(void* fsptr, size_t fssize){
     if(fssize<2048)
         return NULL;
     handle_header* handle = (handle_header*) fsptr;
-    if(handle->magic == MAGIC_NUM)
-        return handle;
 
-    size_t size = fssize - sizeof(handle_header); // total size of mem
-    if(size<sizeof(handle_header))
+    // lay out the bitmap and the summary tree right after the handle
+    size_t num_units = fssize / ALLOC_UNIT;
+    size_t words = (num_units + UNIT_BITS - 1) / UNIT_BITS;
+    size_t leaves = 1;
+    while(leaves < words)
+        leaves *= 2;
+    off_type bitmap = (off_type) ((sizeof(handle_header) + ALLOC_UNIT - 1) / ALLOC_UNIT * ALLOC_UNIT);
+    off_type summary = bitmap + (off_type) ((words * sizeof(uint64_t) + ALLOC_UNIT - 1) / ALLOC_UNIT * ALLOC_UNIT);
+    size_t dirty_words = ((fssize + DIRTY_PAGE - 1) / DIRTY_PAGE + 63) / 64;
+    off_type dirty = summary + (off_type) ((leaves * sizeof(summary_node) + ALLOC_UNIT - 1) / ALLOC_UNIT * ALLOC_UNIT);
+    // the journal starts on a page of its own, so none of its pages is ever marked dirty
+    off_type journal = (off_type) ((dirty + dirty_words * sizeof(uint64_t) + DIRTY_PAGE - 1) / DIRTY_PAGE * DIRTY_PAGE);
+    size_t journal_size = fssize / 16 / DIRTY_PAGE * DIRTY_PAGE;
+    if(journal_size > JOURNAL_MAX)
+        journal_size = JOURNAL_MAX;
+    // a header page, a page of page offsets and at least one page image
+    if(journal_size < 3 * DIRTY_PAGE)
+        journal_size = 0;
+    off_type meta_end = journal + (off_type) journal_size;
+    if(journal_size == (size_t) 0)
+        meta_end = dirty + (off_type) ((dirty_words * sizeof(uint64_t) + ALLOC_UNIT - 1) / ALLOC_UNIT * ALLOC_UNIT);
+    if(meta_end + sizeof(mem_block) > fssize)
         return NULL;
 
-    // initialize the memory zone
-    //memset(fsptr + sizeof(handle_header), 0, size); // not sure which of these is better
-    memset(fsptr, 0, fssize); // not sure which of these is right
-    handle->free_contig_mem_size = size;
-    // maintain offset to beginning of free memory zone
-    handle->begining_of_free_mem = trans_to_off(fsptr, handle);
-    handle->begining_of_free_mem += (off_type) sizeof(handle_header);
+    // initialize the metadata
+    // all zeros means every unit is free and no page is dirty
+    // the journal is left as it is, nothing in it carries this image's id
+    memset(fsptr, 0, (size_t) (journal_size > (size_t) 0 ? journal : meta_end));
+    handle->num_units = num_units;
+    handle->free_units = num_units;
+    handle->bitmap = bitmap;
+    handle->summary = summary;
+    handle->summary_leaves = leaves;
+    // the metadata was just written, the rest goes out once files use it
+    handle->dirty = dirty;
+    handle->dirty_words = dirty_words;
+    mark_dirty(fsptr, fsptr, (size_t) (journal_size > (size_t) 0 ? journal : meta_end));
+    if(journal_size > (size_t) 0){
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        handle->journal = journal;
+        handle->journal_size = journal_size;
+        handle->journal_id = ((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec) ^ (uint64_t) getpid();
+    }
+    mark_units(handle, 0, (size_t) meta_end / ALLOC_UNIT, 1);
 
     // set up other handle metadata
+    handle->version = FORMAT_VERSION;
+    handle->header_size = (uint32_t) sizeof(handle_header);
+    handle->unit_size = (uint32_t) ALLOC_UNIT;
     handle->magic = MAGIC_NUM;
-    handle->free_blocks = (off_type) 0;
 
     // make the root directory
-    mem_block* root_block = get_block(fsptr, 0, fssize);
-    strcpy(*root_block->name, "/");
-    strcpy(root_block->path_name, "/");
+    // its child table is allocated on first insert
+    mem_block* root_block = alloc_block(fsptr, sizeof(mem_block));
+    if(root_block==NULL)
+        return NULL;
     root_block->type = DIRECTORY_TYPE;
-    *(int*) (&root_block->num_subdir) = 0;
-    root_block->num_children = 0;
-    root_block->parent = NULL;
+    set_time(fsptr, root_block, 1);
+    handle->root_dir = trans_to_off(fsptr, root_block);
 
     return handle;
 }
 
-// the linked list of freed blocks was going to be used like the last homework
-// but instead it will be used for non contiguous allocation
-static mem_block* look_for_free_block(size_t size){
-    //P$EUD0
-    // iterate thru list
-        // if size >= size
-            // do not split
-            // reset block->mem_size
-            // calling function sets parent
-            // reconnect linked list previous and next
-            // free blocks -= 1
-    return NULL;
-}
-
-static mem_block* get_block(void* fsptr, size_t size, size_t fssize){
-    if(fsptr==NULL)
-        return NULL;
-
+// the handle of the filesystem in the memory, formatting it first if there is none
+// every operation comes through here, so once the image is mounted this is one
+// compare against the header the operation reads anyway
+static inline handle_header* init_fs(void* fsptr, size_t fssize){
     handle_header* handle = (handle_header*) fsptr;
-    mem_block* block = look_for_free_block(size);
-    if(block!=NULL){
-        return block + sizeof(mem_block);
-
-    // check that contiguous allocation is still possible
-    // and get a block from the zone of contiguous memory
-    }else if(size < handle->free_contig_mem_size){
-        block = (mem_block*) trans_to_ptr(handle, handle->begining_of_free_mem);
-        block->mem_size = size;
-        block->total_size = size + sizeof(mem_block);
-        block->file_size = (size_t*) size;
-
-        set_time(block, 1);
-
-        // split off this block from the zone of free contiguous memory
-        handle->free_contig_mem_size -= block->total_size;
-        handle->begining_of_free_mem += (off_type) block->total_size;
+    if(__builtin_expect(fssize >= sizeof(handle_header) && handle->magic == MAGIC_NUM, 1))
+        return handle;
+    return format_fs(fsptr, fssize);
+}
 
-        block->is_contiguous = 1;
-        return block + sizeof(mem_block);
+// checks the handle of an image found in the memory before it is mounted
+// returns 0 if it can be served as it is, or the errno to refuse it with
+// the image may cover less than the memory: the memory grows before the
+// handle that says so gets written out, see __myfs_mount_implem
+static int check_fs(void* fsptr, size_t fssize){
+    handle_header* handle = (handle_header*) fsptr;
+    if(handle->version < FORMAT_OLDEST || handle->version > FORMAT_VERSION
+       || handle->header_size != (uint32_t) sizeof(handle_header)
+       || handle->unit_size != (uint32_t) ALLOC_UNIT)
+        return EINVAL;
+    if(handle->num_units > fssize / ALLOC_UNIT)
+        return EUCLEAN;
+    // the bookkeeping has to lie inside the memory it covers
+    size_t size = handle->num_units * ALLOC_UNIT;
+    size_t words = (handle->num_units + UNIT_BITS - 1) / UNIT_BITS;
+    size_t dirty_words = ((size + DIRTY_PAGE - 1) / DIRTY_PAGE + 63) / 64;
+    if(handle->free_units > handle->num_units
+       || handle->summary_leaves < words
+       || handle->bitmap < (off_type) sizeof(handle_header)
+       || handle->bitmap + words * sizeof(uint64_t) > size
+       || handle->summary + handle->summary_leaves * sizeof(summary_node) > size
+       || handle->dirty_words < dirty_words
+       || handle->dirty + handle->dirty_words * sizeof(uint64_t) > size
+       || handle->journal + handle->journal_size > size
+       || handle->root_dir % ALLOC_UNIT != 0
+       || handle->root_dir + sizeof(mem_block) > size)
+        return EUCLEAN;
+    return 0;
+}
 
-    // else filesystem is possibly fragmented
-    // switch to non contiguous allocation
-    }else{
-        block->is_contiguous = 0;
-        block = switch_to_llist_alloc(fsptr, size);
-        if(block!=NULL){
-            set_time(block, 1);
-            return block + sizeof(mem_block);
+static void* get_block(void* fsptr, fs_locks* locks, size_t size, size_t fssize){
+    pthread_mutex_lock(&locks->alloc_lock);
+    void* block = alloc_block(fsptr, size);
+    pthread_mutex_unlock(&locks->alloc_lock);
+    return block;
+}
 
-        // else still too fragmented, try defragmentaion
-        }else{
-            block = defrag_fs(fsptr, fssize, block);
-            if(block!=NULL){
-                set_time(block, 1);
-                return block + sizeof(mem_block);
+// give the units of size bytes of memory back to the bitmap
+static void release_block(void* fsptr, void* block, size_t size){
+    handle_header* handle = (handle_header*) fsptr;
+    size_t first = (size_t) trans_to_off(fsptr, block) / ALLOC_UNIT;
+    mark_units(handle, first, unit_size(size) / ALLOC_UNIT, 0);
+}
 
-            // else just memory is full
-            }else{
-                return NULL;
-            }
-        }
-    }
+static void free_block(void* fsptr, fs_locks* locks, void* block, size_t size){
+    pthread_mutex_lock(&locks->alloc_lock);
+    release_block(fsptr, block, size);
+    pthread_mutex_unlock(&locks->alloc_lock);
 }
 
-// add freed blocks to a linked list to recycle them for non contiguous allocation
-static void free_block(void* fsptr, mem_block* block){
-    handle_header* handle = (handle_header*) fsptr;
-    // this becomes the first in a list of free blocks
-    if(handle->free_blocks == 0){
-        handle->free_blocks = trans_to_off(fsptr, block);
-        handle->offset_to_first_freed_block = trans_to_off(fsptr, block);
-    // or add it to the end of the list of free blocks
-    }else{
-        mem_block* current = trans_to_ptr(fsptr, handle->free_blocks);
-        while(current->next != NULL){
-            current = (mem_block*) current->next;
-        }
-        current->next = (void*) block;
-    }
-    handle->free_blocks++;
-    handle->llist_mem_size_total += block->total_size;
-    // don't overwrite header, blocks in the list still need to know their size
-    memset(block+sizeof(mem_block), 0, block->mem_size);
-    block->is_contiguous = 0;
-    set_name(block, "\0");
+// a fresh inode, all zeros but for its type and times
+static mem_block* new_inode(void* fsptr, fs_locks* locks, size_t fssize, int type){
+    mem_block* block = get_block(fsptr, locks, sizeof(mem_block), fssize);
+    if(block==NULL)
+        return NULL;
+    memset(block, 0, sizeof(mem_block));
+    block->type = type;
+    // a file starts out inline, with no room yet
+    if(type == FILE_TYPE)
+        block->flags = INODE_INLINE;
+    set_time(fsptr, block, 1);
+    return block;
 }
 
 /*NOT-U$ED
 // changed my mind about how truncate works
-static mem_block* reallocate(void* fsptr, size_t size, size_t fssize, mem_block* old_block){
+static void* reallocate(void* fsptr, fs_locks* locks, size_t size, size_t fssize, void* old_block, size_t old_size){
     //P$EUD0
     // whether new size is bigger or smaller
         // get_block of new bigger or smaller size
         // free the old block
-    mem_block* block = get_block(fsptr, size, fssize);
-    free_block(fsptr, old_block);
+    void* block = get_block(fsptr, locks, size, fssize);
+    free_block(fsptr, locks, old_block, old_size);
     return block;
 }
 */
 
-static mem_block* follow_path(void* fsptr, const char* path){
-    handle_header* handle = (handle_header*) fsptr;
-
-    mem_block* root_dir = trans_to_ptr(fsptr, handle->root_dir);
-    if(strcmp(path, *root_dir->name) == 0)
-        return trans_to_ptr(fsptr, handle->root_dir);
+static dir_entry* dir_entries(void* fsptr, mem_block* dir){
+    if(dir->children == (off_type) 0)
+        return NULL;
+    return (dir_entry*) trans_to_ptr(fsptr, dir->children);
+}
 
-    // start iterating from root directory
-    off_type block_off = handle->root_dir;
-    while(block_off < handle->begining_of_free_mem){
-        // iterate to every block linearly
-        mem_block* block = (mem_block*) trans_to_ptr(fsptr, block_off);
-        // check if this block's saved path name is the given path
-        if(strcmp(block->path_name, path)==0){
-            return block;
+// binary search a directory's sorted child table for name
+// returns 1 and the index of the entry if found
+// returns 0 and the index where it would have to be inserted if not
+static int dir_find(void* fsptr, mem_block* dir, const char* name, int* pos){
+    dir_entry* entries = dir_entries(fsptr, dir);
+    int lo = 0;
+    int hi = dir->num_children;
+    while(lo < hi){
+        int mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(name, entries[mid].name);
+        if(cmp == 0){
+            *pos = mid;
+            return 1;
+        }else if(cmp < 0){
+            hi = mid;
         }else{
-            // increment by the size of this block to get to the next header
-            block_off += (off_type) block->total_size;
+            lo = mid + 1;
         }
     }
-    return NULL; // did not find a basename that had the same path
+    *pos = lo;
+    return 0;
 }
 
-// if fs is fragmented and there is not enough free
-// contiguous memory to satisfy a request
-// switch to a linked list allocation
-static mem_block* switch_to_llist_alloc(void* fsptr, size_t size){
-    handle_header* handle = (handle_header*) fsptr;
-    // the handle knows how many free blocks are in the list, check it
-    if(handle->free_blocks == 0)
+static mem_block* dir_lookup(void* fsptr, mem_block* dir, const char* name){
+    int pos;
+    if(dir->type != DIRECTORY_TYPE)
         return NULL;
-    // the handle knows the total size of all non contiguous blocks
-    // check if there is enough space in all the blocks
-    if(handle->llist_mem_size_total < size+sizeof(mem_block))
+    if(dir_find(fsptr, dir, name, &pos) == 0)
         return NULL;
-    mem_block* block_itr = trans_to_ptr(fsptr, handle->offset_to_first_freed_block);
-    // first just look for a single block that fits
-    // replaces the look_for_free_block function (like last hw)
-    int i=0;
-    while(i < handle->free_blocks){
-        // if found a block
-        if(block_itr->total_size > size+sizeof(mem_block)){
-            handle->free_blocks--;
-            handle->llist_mem_size_total -= block_itr->total_size;
-            block_itr->mem_size = size;
-            // if this was the first block then update the offset to first block
-            if(i==0){ 
-                // but only if it wasn't the only block in the list
-                if(handle->free_blocks > 1){
-                    mem_block* new_head = (void*) block_itr->next;
-                    handle->offset_to_first_freed_block = trans_to_off(fsptr, new_head);
-                }
-            // if it was in the middle of the list, reconnect the list
-            }else{
-                mem_block* prev = (void*) block_itr->previous;
-                mem_block* nxt = (void*) block_itr->next;
-                prev->next = (void*) nxt;
-            }
-            set_time(block_itr, 1);
-            return block_itr + sizeof(mem_block);
-        }else{
-            if(block_itr->next == NULL)
-                break;
-            mem_block* next_block = (void*) block_itr->next;
-            next_block->previous = (void*) block_itr;
-            block_itr = (void*) block_itr->next;
-            i++;
-            continue;
-        }
-    }
-    // or need to use non contiguous blocks to fit up to size
-
-    //P$EUD0
-    // iterate to each block
-        // if first block allocated, save the total size in its header
-            // block->total_non_contig_size = size
-        // size -= block->mem_size
-        // non_contig_size -= block->total_size
-        // free_blocks -= 1
-        // if size <= 0
-            // break
-        // reset head of list
-
-    block_itr = trans_to_ptr(fsptr, handle->offset_to_first_freed_block);
-    mem_block* first_block = block_itr;
-    while(size>(size_t)0 || block_itr->next != NULL || handle->free_blocks > 0){
-        size -= block_itr->mem_size;
-        handle->llist_mem_size_total -= block_itr->total_size;
-        handle->free_blocks--;
-    }
-    if(block_itr->next != NULL){
-        mem_block* next_free_block = (void*) block_itr->next;
-        handle->offset_to_first_freed_block = trans_to_off(fsptr, next_free_block->next);
-        next_free_block->previous = NULL;
-    }
-    first_block->total_non_contig_size = size;
-    set_time(first_block, 1);
-    return first_block;
+    return trans_to_ptr(fsptr, dir_entries(fsptr, dir)[pos].block_off);
 }
 
-// if linked list allocation does not work for some reason,
-// try to defrag the system, or just to see if this can be done
-// by copying the fs to a new fs and restoring all used blocks contiguously
-static mem_block* defrag_fs(void* fsptr, size_t fssize, mem_block* block){
-
-    // i'm thinking of initializing a new fs
-    // copy everything over
-    // then re copy all blocks contiguously back to the first fs
+// add an entry for child to the table of dir, keeping it sorted
+// the table doubles in size when it is full
+// returns 0 if there is not enough memory for a bigger table
+static int dir_insert(void* fsptr, fs_locks* locks, size_t fssize, mem_block* dir, const char* name, mem_block* child){
+    int pos;
+    if(dir_find(fsptr, dir, name, &pos) == 1)
+        return 0;
+    if(dir->num_children == dir->children_cap){
+        int new_cap = dir->children_cap == 0 ? DIR_MIN_CAP : dir->children_cap * 2;
+        dir_entry* table = get_block(fsptr, locks, (size_t) new_cap * sizeof(dir_entry), fssize);
+        if(table==NULL)
+            return 0;
+        if(dir->children != (off_type) 0){
+            dir_entry* old_table = dir_entries(fsptr, dir);
+            memcpy(table, old_table, (size_t) dir->num_children * sizeof(dir_entry));
+            free_block(fsptr, locks, old_table, (size_t) dir->children_cap * sizeof(dir_entry));
+        }
+        dir->children = trans_to_off(fsptr, table);
+        dir->children_cap = new_cap;
+        mark_dirty(fsptr, table, (size_t) dir->num_children * sizeof(dir_entry));
+    }
+    dir_entry* entries = dir_entries(fsptr, dir);
+    memmove(&entries[pos+1], &entries[pos], (size_t) (dir->num_children - pos) * sizeof(dir_entry));
+    memset(&entries[pos], 0, sizeof(dir_entry));
+    strcpy(entries[pos].name, name);
+    entries[pos].block_off = trans_to_off(fsptr, child);
+    mark_dirty(fsptr, &entries[pos], (size_t) (dir->num_children - pos + 1) * sizeof(dir_entry));
+    dir->num_children += 1;
+    if(child->type == DIRECTORY_TYPE)
+        dir->num_subdir += 1;
+    mark_dirty(fsptr, dir, sizeof(mem_block));
+    return 1;
+}
 
-    // also, the noncontiguous list of freed blocks may be fragmented.
-    // need to split off fragmented space from the last freed block
-    // that has been recycled, and add that to the new zone of free contiguous memory
+// take the entry called name out of the table of dir
+static void dir_remove(void* fsptr, mem_block* dir, const char* name){
+    int pos;
+    if(dir_find(fsptr, dir, name, &pos) == 0)
+        return;
+    dir_entry* entries = dir_entries(fsptr, dir);
+    mem_block* child = trans_to_ptr(fsptr, entries[pos].block_off);
+    if(child->type == DIRECTORY_TYPE)
+        dir->num_subdir -= 1;
+    memmove(&entries[pos], &entries[pos+1], (size_t) (dir->num_children - pos - 1) * sizeof(dir_entry));
+    mark_dirty(fsptr, &entries[pos], (size_t) (dir->num_children - pos - 1) * sizeof(dir_entry));
+    dir->num_children -= 1;
+    mark_dirty(fsptr, dir, sizeof(mem_block));
+}
 
-    // old buggy code was deleted
+// walk the path one name at a time, looking each name up
+// in the child table of the directory before it
+static mem_block* follow_path(void* fsptr, const char* path){
+    handle_header* handle = (handle_header*) fsptr;
+    mem_block* block = trans_to_ptr(fsptr, handle->root_dir);
+    if(*path != '/')
+        return NULL;
 
-    return NULL;
+    char name[MAX_NAME];
+    const char* itr = path;
+    while(*itr != '\0'){
+        while(*itr == '/')
+            itr++;
+        if(*itr == '\0')
+            break;
+        const char* end = strchr(itr, '/');
+        size_t len = end == NULL ? strlen(itr) : (size_t) (end - itr);
+        if(len >= MAX_NAME)
+            return NULL;
+        memcpy(name, itr, len);
+        name[len] = '\0';
+        block = dir_lookup(fsptr, block, name);
+        if(block==NULL)
+            return NULL;
+        itr += len;
+    }
+    return block;
 }
 
+// follow the path up to its last name, which is copied into name
+// returns the directory that would hold that last name
+static mem_block* follow_parent(void* fsptr, const char* path, char* name){
+    const char* last = strrchr(path, '/');
+    if(last==NULL || strlen(last+1) >= MAX_NAME)
+        return NULL;
+    strcpy(name, last+1);
+    size_t len = (size_t) (last - path);
+    char* dir_path = malloc(len + 2);
+    if(dir_path==NULL)
+        return NULL;
+    memcpy(dir_path, path, len);
+    if(len == 0)
+        dir_path[len++] = '/';
+    dir_path[len] = '\0';
+    mem_block* dir = follow_path(fsptr, dir_path);
+    free(dir_path);
+    if(dir==NULL || dir->type != DIRECTORY_TYPE)
+        return NULL;
+    return dir;
+}
 
+static extent_node* extent_root(void* fsptr, mem_block* file){
+    if(file->extents == (off_type) 0)
+        return NULL;
+    return (extent_node*) trans_to_ptr(fsptr, file->extents);
+}
 
+static extent* leaf_extents(extent_node* node){
+    return (extent*) (node + 1);
+}
 
+static extent_index* node_children(extent_node* node){
+    return (extent_index*) (node + 1);
+}
 
+static extent_node* child_node(void* fsptr, extent_node* node, int i){
+    return (extent_node*) trans_to_ptr(fsptr, node_children(node)[i].child);
+}
 
+static char* extent_data(void* fsptr, extent* ext){
+    return (char*) trans_to_ptr(fsptr, ext->block_off);
+}
 
+static char* inline_data(mem_block* file){
+    return (char*) (file + 1);
+}
 
+// how much memory an inode takes up, its inline data included
+static size_t inode_size(mem_block* block){
+    return sizeof(mem_block) + (size_t) block->inline_cap;
+}
 
+// let the inline data of a file grow in place over the free units
+// that follow it until there is room for size bytes
+// returns 1 if there is, 0 if the units are taken
+static int grow_inline(void* fsptr, fs_locks* locks, mem_block* file, size_t size){
+    handle_header* handle = (handle_header*) fsptr;
+    size_t have = unit_size(inode_size(file)) / ALLOC_UNIT;
+    size_t want = unit_size(sizeof(mem_block) + size) / ALLOC_UNIT;
+    pthread_mutex_lock(&locks->alloc_lock);
+    size_t end = (size_t) trans_to_off(fsptr, file) / ALLOC_UNIT + have;
+    int grown = free_units_after(handle, end, want - have) == want - have;
+    if(grown){
+        mark_units(handle, end, want - have, 1);
+        file->inline_cap = (uint32_t) (want * ALLOC_UNIT - sizeof(mem_block));
+        mark_dirty(fsptr, file, sizeof(mem_block));
+    }
+    pthread_mutex_unlock(&locks->alloc_lock);
+    return grown;
+}
 
+// where entry i of a node starts in the file
+static size_t entry_off(extent_node* node, int i){
+    if(node->level == 0)
+        return leaf_extents(node)[i].file_off;
+    return node_children(node)[i].file_off;
+}
 
+// walk down to the extent holding byte offset of the file, or the last
+// one starting before it, the first one if none does
+// the file has to have extents
+static extent* seek_extent(void* fsptr, mem_block* file, size_t offset, extent_cursor* cur){
+    extent_node* node = extent_root(fsptr, file);
+    cur->depth = file->extent_depth;
+    for(int d=0; ; d++){
+        int lo = 0;
+        int hi = (int) node->count - 1;
+        while(lo < hi){
+            int mid = lo + (hi - lo + 1) / 2;
+            if(entry_off(node, mid) <= offset)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        cur->node[d] = node;
+        cur->index[d] = lo;
+        if(node->level == 0)
+            return &leaf_extents(node)[lo];
+        node = child_node(fsptr, node, lo);
+    }
+}
 
+static extent* last_extent(void* fsptr, mem_block* file, extent_cursor* cur){
+    return seek_extent(fsptr, file, SIZE_MAX, cur);
+}
 
+// step the cursor on to the next extent, NULL past the last one
+static extent* next_extent(void* fsptr, extent_cursor* cur){
+    int d = cur->depth;
+    while(d >= 0 && cur->index[d] + 1 >= (int) cur->node[d]->count)
+        d--;
+    if(d < 0)
+        return NULL;
+    cur->index[d]++;
+    for(; d < cur->depth; d++){
+        cur->node[d+1] = child_node(fsptr, cur->node[d], cur->index[d]);
+        cur->index[d+1] = 0;
+    }
+    return &leaf_extents(cur->node[cur->depth])[cur->index[cur->depth]];
+}
 
+// put ext into the tree right after the extent the cursor is at, or
+// before it if ext starts first (only ever the case for an extent before
+// the first one of the file), or as the only extent of an empty tree
+// full nodes split on the way up; one split at its end keeps all it has,
+// so a file that only grows at its end ends up with full leaves
+// the nodes needed are all taken before anything changes
+// returns 1 on success, 0 if there is not enough memory
+static int insert_extent(void* fsptr, fs_locks* locks, size_t fssize, mem_block* file, extent_cursor* cur, const extent* ext){
+    if(file->extents == (off_type) 0){
+        extent_node* root = get_block(fsptr, locks, EXTENT_NODE, fssize);
+        if(root==NULL)
+            return 0;
+        root->count = 1;
+        root->level = 0;
+        root->reserved = 0;
+        leaf_extents(root)[0] = *ext;
+        mark_dirty(fsptr, root, EXTENT_NODE);
+        file->extents = trans_to_off(fsptr, root);
+        file->num_extents = 1;
+        file->extent_depth = 0;
+        mark_dirty(fsptr, file, sizeof(mem_block));
+        return 1;
+    }
+
+    // one new node per full node from the leaf up, one more for a new root
+    int needed = 0;
+    int d = cur->depth;
+    while(d >= 0 && (int) cur->node[d]->count == (d == cur->depth ? LEAF_EXTENTS : NODE_CHILDREN)){
+        needed++;
+        d--;
+    }
+    if(d < 0){
+        if(file->extent_depth == EXTENT_DEPTH_MAX)
+            return 0;
+        needed++;
+    }
+    extent_node* spare[EXTENT_DEPTH_MAX + 2];
+    for(int i=0; i<needed; i++){
+        spare[i] = get_block(fsptr, locks, EXTENT_NODE, fssize);
+        if(spare[i]==NULL){
+            while(i-- > 0)
+                free_block(fsptr, locks, spare[i], EXTENT_NODE);
+            return 0;
+        }
+    }
 
+    extent new_ext = *ext;
+    extent* at = &leaf_extents(cur->node[cur->depth])[cur->index[cur->depth]];
+    if(ext->file_off < at->file_off){
+        new_ext = *at;
+        *at = *ext;
+        mark_dirty(fsptr, at, sizeof(extent));
+    }
+    extent_index new_child;
+    int used = 0;
+    for(d = cur->depth; d >= 0; d--){
+        extent_node* node = cur->node[d];
+        int leaf = node->level == 0;
+        int cap = leaf ? LEAF_EXTENTS : NODE_CHILDREN;
+        size_t esize = leaf ? sizeof(extent) : sizeof(extent_index);
+        const void* entry = leaf ? (const void*) &new_ext : (const void*) &new_child;
+        int pos = cur->index[d] + 1;
+        extent_node* target = node;
+        extent_node* right = NULL;
+        if((int) node->count == cap){
+            // split, the entries from split on go to a new node on the right
+            right = spare[used++];
+            int split = pos == cap ? cap : (cap + 1) / 2;
+            right->count = (uint32_t) (cap - split);
+            right->level = node->level;
+            right->reserved = 0;
+            memcpy(right + 1, (char*) (node + 1) + (size_t) split * esize, (size_t) (cap - split) * esize);
+            node->count = (uint32_t) split;
+            if(pos == cap || pos > split){
+                target = right;
+                pos -= split;
+            }
+        }
+        char* entries = (char*) (target + 1);
+        memmove(entries + (size_t) (pos + 1) * esize, entries + (size_t) pos * esize, (size_t) ((int) target->count - pos) * esize);
+        memcpy(entries + (size_t) pos * esize, entry, esize);
+        target->count++;
+        mark_dirty(fsptr, node, EXTENT_NODE);
+        if(right == NULL)
+            break;
+        mark_dirty(fsptr, right, EXTENT_NODE);
+
+        // the parent takes in the new node, or a new root both halves
+        new_child.file_off = entry_off(right, 0);
+        new_child.child = trans_to_off(fsptr, right);
+        if(d == 0){
+            extent_node* root = spare[used++];
+            root->count = 2;
+            root->level = node->level + 1;
+            root->reserved = 0;
+            node_children(root)[0].file_off = entry_off(node, 0);
+            node_children(root)[0].child = trans_to_off(fsptr, node);
+            node_children(root)[1] = new_child;
+            mark_dirty(fsptr, root, EXTENT_NODE);
+            file->extents = trans_to_off(fsptr, root);
+            file->extent_depth += 1;
+        }
+    }
+    file->num_extents += 1;
+    mark_dirty(fsptr, file, sizeof(mem_block));
+    return 1;
+}
 
+// take the last extent out of the tree, freeing the nodes it leaves
+// empty and roots with a single child
+// freeing the extent's data is up to the caller
+static void remove_last_extent(void* fsptr, fs_locks* locks, mem_block* file){
+    extent_cursor cur;
+    last_extent(fsptr, file, &cur);
+    for(int d = cur.depth; d >= 0; d--){
+        extent_node* node = cur.node[d];
+        node->count -= 1;
+        mark_dirty(fsptr, node, sizeof(extent_node));
+        if(node->count > 0)
+            break;
+        free_block(fsptr, locks, node, EXTENT_NODE);
+        if(d == 0){
+            file->extents = (off_type) 0;
+            file->extent_depth = 0;
+        }
+    }
+    file->num_extents -= 1;
+    while(file->extent_depth > 0 && extent_root(fsptr, file)->count == 1){
+        extent_node* root = extent_root(fsptr, file);
+        file->extents = node_children(root)[0].child;
+        file->extent_depth -= 1;
+        free_block(fsptr, locks, root, EXTENT_NODE);
+    }
+    mark_dirty(fsptr, file, sizeof(mem_block));
+}
 
-/* End of helper functions */
-
-/* Implements an emulation of the stat system call on the filesystem 
-   of size fssize pointed to by fsptr.
+// the walk over the pieces of a file from offset on: extents and the holes
+// between them, see file_piece
+// the file must not be inline
+static extent* first_piece(void* fsptr, mem_block* file, size_t offset, extent_cursor* cur){
+    if(file->num_extents == 0)
+        return NULL;
+    return seek_extent(fsptr, file, offset, cur);
+}
 
-   If path can be followed and describes a file or directory 
-   that exists and is accessable, the access information is 
-   put into stbuf
+// the piece of the file at offset, the extent holding it or the hole it
+// is in, which goes up to the next extent or the end of the file
+// *extptr is where the walk is in the extents, NULL past the last one,
+// and moves on past those that end before offset
+// returns where the piece's data at offset is, NULL for a hole, and
+// how many bytes of the piece are left from offset on in *lenptr
+static char* file_piece(void* fsptr, mem_block* file, extent_cursor* cur, extent** extptr,
+                        size_t offset, size_t* lenptr){
+    extent* ext = *extptr;
+    while(ext != NULL && ext->file_off + ext->length <= offset)
+        ext = next_extent(fsptr, cur);
+    *extptr = ext;
+    if(ext == NULL || ext->file_off > offset){
+        *lenptr = (ext == NULL ? file->file_size : ext->file_off) - offset;
+        return NULL;
+    }
+    *lenptr = ext->file_off + ext->length - offset;
+    return extent_data(fsptr, ext) + (offset - ext->file_off);
+}
 
-   On success, 0 is returned. On failure, -1 is returned and 
-   the appropriate error code is put into *errnoptr.
+// copy size bytes starting at offset between the file and buf
+// the range has to lie within file_size, and when copying to the file
+// it must not touch a hole, see fill_holes
+static void copy_extents(void* fsptr, mem_block* file, size_t offset, char* buf, size_t size, int to_file){
+    if(size == (size_t) 0)
+        return;
+    if(file->flags & INODE_INLINE){
+        char* data = inline_data(file) + offset;
+        if(to_file){
+            memcpy(data, buf, size);
+            mark_dirty(fsptr, data, size);
+        }else
+            memcpy(buf, data, size);
+        return;
+    }
+    extent_cursor cur;
+    extent* ext = first_piece(fsptr, file, offset, &cur);
+    while(size > (size_t) 0){
+        size_t len;
+        char* data = file_piece(fsptr, file, &cur, &ext, offset, &len);
+        if(len > size)
+            len = size;
+        if(data == NULL){
+            if(!to_file)
+                memset(buf, 0, len);
+        }else if(to_file){
+            memcpy(data, buf, len);
+            mark_dirty(fsptr, data, len);
+        }else
+            memcpy(buf, data, len);
+        buf += len;
+        offset += len;
+        size -= len;
+    }
+}
 
-   man 2 stat documents all possible error codes and gives more detail
-   on what fields of stbuf need to be filled in. Essentially, only the
-   following fields need to be supported:
+// an extent can grow in place over the free units that follow it
+// returns how many bytes it grew by
+static size_t grow_in_place(void* fsptr, fs_locks* locks, extent* ext, size_t size){
+    handle_header* handle = (handle_header*) fsptr;
+    pthread_mutex_lock(&locks->alloc_lock);
+    size_t end = ((size_t) ext->block_off + ext->capacity) / ALLOC_UNIT;
+    size_t units = free_units_after(handle, end, unit_size(size) / ALLOC_UNIT);
+    if(units > (size_t) 0)
+        mark_units(handle, end, units, 1);
+    ext->capacity += units * ALLOC_UNIT;
+    mark_dirty(fsptr, ext, sizeof(extent));
+    pthread_mutex_unlock(&locks->alloc_lock);
+    return units * ALLOC_UNIT;
+}
 
-   st_uid      the value passed in argument
-   st_gid      the value passed in argument
-   st_mode     (as fixed values S_IFDIR | 0755 for directories,
-                                S_IFREG | 0755 for files)
-   st_nlink    (as many as there are subdirectories (not files) for directories
-                (including . and ..),
-                1 for files)
-   st_size     (supported only for files, where it is the real file size)
-   st_atim
-   st_mtim
+// add an empty extent for data at the end of the file
+static int add_extent(void* fsptr, fs_locks* locks, size_t fssize, mem_block* file, char* data, size_t capacity){
+    extent ext;
+    ext.file_off = file->file_size;
+    ext.length = 0;
+    ext.capacity = capacity;
+    ext.block_off = trans_to_off(fsptr, data);
+    extent_cursor cur;
+    if(file->extents != (off_type) 0)
+        last_extent(fsptr, file, &cur);
+    return insert_extent(fsptr, locks, fssize, file, &cur, &ext);
+}
 
-*/
+// move the inline data of a file out to an extent, with room for size
+// more bytes, and give back the units it took up after the inode
+// returns 1 on success, 0 if there is not enough memory
+static int spill_inline(void* fsptr, fs_locks* locks, size_t fssize, mem_block* file, size_t size){
+    size_t length = file->file_size;
+    size_t want = length + size;
+    if(want < EXTENT_MIN_SIZE)
+        want = EXTENT_MIN_SIZE;
+    char* data = get_block(fsptr, locks, want, fssize);
+    if(data==NULL && want > length + size){
+        want = length + size;
+        data = get_block(fsptr, locks, want, fssize);
+    }
+    if(data==NULL)
+        return 0;
+    memcpy(data, inline_data(file), length);
+    mark_dirty(fsptr, data, length);
+    file->flags &= ~INODE_INLINE;
+    file->file_size = 0;
+    if(add_extent(fsptr, locks, fssize, file, data, unit_size(want)) != 1){
+        file->flags |= INODE_INLINE;
+        file->file_size = length;
+        free_block(fsptr, locks, data, want);
+        return 0;
+    }
+    extent_cursor cur;
+    extent* ext = last_extent(fsptr, file, &cur);
+    ext->length = length;
+    mark_dirty(fsptr, ext, sizeof(extent));
+    file->file_size = length;
+    if(file->inline_cap > 0)
+        free_block(fsptr, locks, inline_data(file), file->inline_cap);
+    file->inline_cap = 0;
+    mark_dirty(fsptr, file, sizeof(mem_block));
+    return 1;
+}
 
-int __myfs_getattr_implem(void* fsptr, size_t fssize, int *errnoptr,
-                          uid_t uid, gid_t gid,
-                          const char *path, struct stat *stbuf) {
-    if(path==NULL){
-        *errnoptr = EBADF;
-        return -1;
+// add size bytes to the end of the file, zeros if buf is NULL
+// or whatever the extents hold if fill is 0 (the caller writes them)
+// first fill up the last extent, then let it grow in place over
+// free units that follow it, and only then add a new extent
+// after a hole at the end of the file it takes a new extent right away
+// returns how many bytes could be added before memory ran out
+static size_t append_extents(void* fsptr, fs_locks* locks, size_t fssize, mem_block* file, const char* buf, size_t size, int fill){
+    if(file->flags & INODE_INLINE){
+        size_t end = file->file_size + size;
+        if(end <= file->inline_cap || (end <= INLINE_MAX && grow_inline(fsptr, locks, file, end))){
+            char* dest = inline_data(file) + file->file_size;
+            if(buf != NULL)
+                memcpy(dest, buf, size);
+            else if(fill)
+                memset(dest, 0, size);
+            if(buf != NULL || fill)
+                mark_dirty(fsptr, dest, size);
+            file->file_size = end;
+            mark_dirty(fsptr, file, sizeof(mem_block));
+            return size;
+        }
+        if(spill_inline(fsptr, locks, fssize, file, size) != 1)
+            return 0;
     }
-    handle_header* handle = init_fs(fsptr, fssize);
-    if(handle==NULL){
-       *errnoptr = EFAULT;
-        return -1;
+    size_t done = 0;
+    while(done < size){
+        extent_cursor cur;
+        extent* last = file->num_extents > 0 ? last_extent(fsptr, file, &cur) : NULL;
+        if(last != NULL && last->file_off + last->length != file->file_size)
+            last = NULL;
+        size_t room = last != NULL ? last->capacity - last->length : 0;
+        if(room == (size_t) 0 && last != NULL)
+            room = grow_in_place(fsptr, locks, last, size - done);
+        if(room == (size_t) 0){
+            // the new extent is at least as big as the last one
+            // so a file made of many small writes has few extents
+            size_t want = size - done;
+            if(last != NULL && want < last->capacity)
+                want = last->capacity;
+            if(want < EXTENT_MIN_SIZE)
+                want = EXTENT_MIN_SIZE;
+            char* data = get_block(fsptr, locks, want, fssize);
+            if(data==NULL && want > size - done){
+                want = size - done;
+                data = get_block(fsptr, locks, want, fssize);
+            }
+            if(data==NULL)
+                break;
+            if(add_extent(fsptr, locks, fssize, file, data, unit_size(want)) != 1){
+                free_block(fsptr, locks, data, want);
+                break;
+            }
+            continue;
+        }
+        size_t len = size - done;
+        if(len > room)
+            len = room;
+        char* dest = extent_data(fsptr, last) + last->length;
+        if(buf != NULL)
+            memcpy(dest, buf + done, len);
+        else if(fill)
+            memset(dest, 0, len);
+        if(buf != NULL || fill)
+            mark_dirty(fsptr, dest, len);
+        last->length += len;
+        file->file_size += len;
+        mark_dirty(fsptr, last, sizeof(extent));
+        done += len;
+    }
+    mark_dirty(fsptr, file, sizeof(mem_block));
+    return done;
+}
+
+// cut the file down to size bytes, freeing the extents past that point
+static void shrink_extents(void* fsptr, fs_locks* locks, mem_block* file, size_t size){
+    if(file->flags & INODE_INLINE){
+        file->file_size = size;
+        mark_dirty(fsptr, file, sizeof(mem_block));
+        return;
+    }
+    extent_cursor cur;
+    while(file->num_extents > 0){
+        extent* last = last_extent(fsptr, file, &cur);
+        if(last->file_off < size)
+            break;
+        free_block(fsptr, locks, extent_data(fsptr, last), last->capacity);
+        remove_last_extent(fsptr, locks, file);
+    }
+    if(file->num_extents > 0){
+        extent* last = last_extent(fsptr, file, &cur);
+        if(last->file_off + last->length > size){
+            last->length = size - last->file_off;
+            mark_dirty(fsptr, last, sizeof(extent));
+        }
     }
-    mem_block* block = follow_path(fsptr, path);
-    if(block==NULL){
-        *errnoptr = ENOENT;
-        return -1;
+    file->file_size = size;
+    mark_dirty(fsptr, file, sizeof(mem_block));
+}
+
+// make the file size bytes long, the bytes added being a hole, so that
+// no memory is taken for them nor written to
+// an inline file small enough to stay inline gets zeros instead, one
+// too big for that moves its data out to an extent first, if it has any
+// returns 1 on success, 0 if there is not enough memory
+static int extend_file(void* fsptr, fs_locks* locks, size_t fssize, mem_block* file, size_t size){
+    if(file->flags & INODE_INLINE){
+        size_t zeros = size - file->file_size;
+        if(size <= INLINE_MAX)
+            return append_extents(fsptr, locks, fssize, file, NULL, zeros, 1) == zeros;
+        if(file->file_size > (size_t) 0 && spill_inline(fsptr, locks, fssize, file, 0) != 1)
+            return 0;
+        if(file->inline_cap > 0)
+            free_block(fsptr, locks, inline_data(file), file->inline_cap);
+        file->inline_cap = 0;
+        file->flags &= ~INODE_INLINE;
     }
-    memset(stbuf, 0, sizeof(struct stat));
-    stbuf->st_uid = uid;
-    stbuf->st_gid = gid;
+    file->file_size = size;
+    mark_dirty(fsptr, file, sizeof(mem_block));
+    return 1;
+}
 
-    // not sure which will work better
-    //stbuf->st_atim = block->st_atim;
-    //stbuf->st_mtim = block->st_mtim;
+// give the holes in size bytes of the file starting at offset memory of
+// their own, filled with zeros, so that the range can be written in place
+// the range has to lie within file_size
+// a hole gets memory from the EXTENT_MIN_SIZE boundary at or before the
+// range to the one at or after it, as far as the hole goes, so that
+// small writes next to each other land in one extent
+// returns 1 on success, 0 if there is not enough memory, in which case
+// some of the holes may have memory already
+static int fill_holes(void* fsptr, fs_locks* locks, size_t fssize, mem_block* file, size_t offset, size_t size){
+    if(file->flags & INODE_INLINE)
+        return 1;
+    size_t end = offset + size;
+    while(offset < end){
+        extent_cursor cur;
+        extent* ext = first_piece(fsptr, file, offset, &cur);
+        // the hole offset is in goes from hole to hole_end
+        size_t hole = 0;
+        size_t hole_end = file->file_size;
+        if(ext != NULL && ext->file_off <= offset){
+            if(offset < ext->file_off + ext->length){
+                offset = ext->file_off + ext->length;
+                continue;
+            }
+            hole = ext->file_off + ext->length;
+            extent_cursor peek = cur;
+            extent* next = next_extent(fsptr, &peek);
+            if(next != NULL)
+                hole_end = next->file_off;
+        }else if(ext != NULL)
+            hole_end = ext->file_off;
+
+        size_t from = offset / EXTENT_MIN_SIZE * EXTENT_MIN_SIZE;
+        if(from < hole)
+            from = hole;
+        size_t to = (end + EXTENT_MIN_SIZE - 1) / EXTENT_MIN_SIZE * EXTENT_MIN_SIZE;
+        if(to > hole_end)
+            to = hole_end;
+        // take less at a time if the free memory is too scattered for all of it
+        char* data;
+        while((data = get_block(fsptr, locks, to - from, fssize)) == NULL && to - from > EXTENT_MIN_SIZE)
+            to = from + (to - from) / 2;
+        if(data==NULL)
+            return 0;
+        memset(data, 0, to - from);
+        mark_dirty(fsptr, data, to - from);
+        extent new_ext;
+        new_ext.file_off = from;
+        new_ext.length = to - from;
+        new_ext.capacity = unit_size(to - from);
+        new_ext.block_off = trans_to_off(fsptr, data);
+        if(insert_extent(fsptr, locks, fssize, file, &cur, &new_ext) != 1){
+            free_block(fsptr, locks, data, to - from);
+            return 0;
+        }
+        offset = to;
+    }
+    return 1;
+}
 
-    stbuf->st_atim = *(struct timespec*) (&block->acc); 
-    stbuf->st_mtim = *(struct timespec*) (&block->mod);
+// describe size bytes of the file starting at offset as pieces of memory
+// in a calloc'ed array, one per extent or hole, the range has to lie within
+// file_size
+// the pieces of holes have an iov_base of NULL
+// returns the number of pieces or -1 if the allocation fails
+static int file_segments(void* fsptr, mem_block* file, size_t offset, size_t size, struct iovec** iovptr){
+    if(file->flags & INODE_INLINE){
+        struct iovec* iov = calloc(1, sizeof(struct iovec));
+        if(iov==NULL)
+            return -1;
+        iov[0].iov_base = inline_data(file) + offset;
+        iov[0].iov_len = size;
+        *iovptr = iov;
+        return 1;
+    }
+    // count the pieces, then walk the same ones again to fill them in
+    extent_cursor cur;
+    extent* ext = first_piece(fsptr, file, offset, &cur);
+    int count = 0;
+    for(size_t at = offset, len; at < offset + size; at += len){
+        file_piece(fsptr, file, &cur, &ext, at, &len);
+        count++;
+    }
+    struct iovec* iov = calloc((size_t) count, sizeof(struct iovec));
+    if(iov==NULL)
+        return -1;
+    ext = first_piece(fsptr, file, offset, &cur);
+    for(int i=0; i<count; i++){
+        size_t len;
+        char* data = file_piece(fsptr, file, &cur, &ext, offset, &len);
+        if(len > size)
+            len = size;
+        iov[i].iov_base = data;
+        iov[i].iov_len = len;
+        offset += len;
+        size -= len;
+    }
+    *iovptr = iov;
+    return count;
+}
 
-    if(block->type == DIRECTORY_TYPE){
-        stbuf->st_mode = S_IFDIR | 0755;
-        //stbuf->st_nlink = block->num_children;
-        stbuf->st_nlink = *(int*) (&block->num_subdir);
-    }else{
-        stbuf->st_mode = S_IFREG | 0755;
-        //stbuf->st_size = block->mem_size;
-        stbuf->st_size = *(int*) (&block->file_size);
+// give back a node of an extent tree, what is below it and the data
+static void free_extent_node(void* fsptr, fs_locks* locks, extent_node* node){
+    for(int i=0; i<(int) node->count; i++){
+        if(node->level == 0)
+            free_block(fsptr, locks, extent_data(fsptr, &leaf_extents(node)[i]), leaf_extents(node)[i].capacity);
+        else
+            free_extent_node(fsptr, locks, child_node(fsptr, node, i));
     }
+    free_block(fsptr, locks, node, EXTENT_NODE);
+}
 
-    set_time(block, 0);
-    return 0;
+// give back every block a file holds
+// the inode itself is left, without any inline data
+static void free_extents(void* fsptr, fs_locks* locks, mem_block* file){
+    if(file->inline_cap > 0)
+        free_block(fsptr, locks, inline_data(file), file->inline_cap);
+    file->inline_cap = 0;
+    if(file->extents != (off_type) 0)
+        free_extent_node(fsptr, locks, extent_root(fsptr, file));
+    file->extents = (off_type) 0;
+    file->num_extents = 0;
+    file->extent_depth = 0;
+    file->file_size = 0;
+    mark_dirty(fsptr, file, sizeof(mem_block));
+}
+
+// move size bytes of memory at off to the lowest free units that hold
+// them, or if there are none below, slide them down over the free units
+// right before them
+// whoever refers to the memory has to be pointed to where it is now
+// returns that new offset, or off itself if the memory stays put
+static off_type move_block(void* fsptr, fs_locks* locks, off_type off, size_t size){
+    handle_header* handle = (handle_header*) fsptr;
+    size_t first = (size_t) off / ALLOC_UNIT;
+    size_t units = unit_size(size) / ALLOC_UNIT;
+    pthread_mutex_lock(&locks->alloc_lock);
+    size_t to = find_units(handle, units);
+    if(to > first){
+        to = first - free_units_before(handle, first, first);
+        if(to == first){
+            pthread_mutex_unlock(&locks->alloc_lock);
+            return off;
+        }
+    }
+    memmove(trans_to_ptr(fsptr, (off_type) (to * ALLOC_UNIT)), trans_to_ptr(fsptr, off), units * ALLOC_UNIT);
+    mark_dirty(fsptr, trans_to_ptr(fsptr, (off_type) (to * ALLOC_UNIT)), units * ALLOC_UNIT);
+    if(to + units <= first){
+        mark_units(handle, to, units, 1);
+        mark_units(handle, first, units, 0);
+    }else{
+        // the old and new place overlap, only the ends change hands
+        mark_units(handle, to, first - to, 1);
+        mark_units(handle, to + units, first - to, 0);
+    }
+    pthread_mutex_unlock(&locks->alloc_lock);
+    return (off_type) (to * ALLOC_UNIT);
+}
+
+// how much one compaction step may still do
+// a block bigger than the whole budget stays where it is, and one that
+// does not fit in what is left waits for the next step, unless the step
+// has got nothing done yet, so no step copies more than budget bytes
+// and every step gets somewhere
+typedef struct {
+    size_t budget; // bytes one step may move
+    size_t left; // bytes this step may still move
+    int progress; // set once a block moved or an entry or extent is done
+    int stopped; // set once a block did not fit in what is left
+} defrag_budget;
+
+static void defrag_charge(defrag_budget* b, size_t bytes){
+    b->left = bytes < b->left ? b->left - bytes : (size_t) 0;
+}
+
+// move_block, if the step can afford cost bytes for it
+// looking at a block that stays put costs a unit, so that a step
+// walking over memory that is compact already ends too
+// returns the new offset, or off itself if the memory stays put
+static off_type defrag_block(void* fsptr, fs_locks* locks, defrag_budget* b, off_type off, size_t size, size_t cost){
+    if(cost > b->budget){
+        defrag_charge(b, ALLOC_UNIT);
+        return off;
+    }
+    if(cost > b->left && b->progress){
+        b->stopped = 1;
+        return off;
+    }
+    off_type to = move_block(fsptr, locks, off, size);
+    if(to == off){
+        defrag_charge(b, ALLOC_UNIT);
+        return off;
+    }
+    defrag_charge(b, cost);
+    b->progress = 1;
+    ((handle_header*) fsptr)->defrag_moved++;
+    return to;
+}
+
+// move the extent tree node at *off, whoever refers to it holding *off,
+// and all below it down to the data, skipping the extents that start
+// before *pos
+// *pos is moved past every extent looked at, so if the step runs out
+// it tells where to go on from
+static void move_extent_node(void* fsptr, fs_locks* locks, defrag_budget* b, off_type* off, size_t* pos){
+    off_type to = defrag_block(fsptr, locks, b, *off, EXTENT_NODE, EXTENT_NODE);
+    if(b->stopped)
+        return;
+    if(to != *off){
+        *off = to;
+        mark_dirty(fsptr, off, sizeof(off_type));
+    }
+    extent_node* node = trans_to_ptr(fsptr, to);
+    for(int i=0; i<(int) node->count; i++){
+        if(node->level > 0){
+            // a child whose extents all start before *pos is done
+            if(i + 1 < (int) node->count && node_children(node)[i+1].file_off <= *pos)
+                continue;
+            move_extent_node(fsptr, locks, b, &node_children(node)[i].child, pos);
+            if(b->stopped)
+                return;
+            continue;
+        }
+        extent* ext = &leaf_extents(node)[i];
+        if(ext->file_off < *pos)
+            continue;
+        off_type data = defrag_block(fsptr, locks, b, ext->block_off, ext->capacity, ext->capacity);
+        if(b->stopped)
+            return;
+        if(data != ext->block_off){
+            ext->block_off = data;
+            mark_dirty(fsptr, ext, sizeof(extent));
+        }
+        *pos = ext->file_off + 1;
+        b->progress = 1;
+    }
+}
+
+// move what hangs off an inode: a directory's child table,
+// or a file's extent tree and data from file offset *pos on
+// inline data moves along with the inode
+static void move_contents(void* fsptr, fs_locks* locks, defrag_budget* b, mem_block* block, size_t* pos){
+    if(block->type == DIRECTORY_TYPE){
+        if(block->children != (off_type) 0){
+            size_t size = (size_t) block->children_cap * sizeof(dir_entry);
+            off_type table = defrag_block(fsptr, locks, b, block->children, size, size);
+            if(table != block->children){
+                block->children = table;
+                mark_dirty(fsptr, block, sizeof(mem_block));
+            }
+        }
+        return;
+    }
+    if(block->extents != (off_type) 0)
+        move_extent_node(fsptr, locks, b, &block->extents, pos);
+}
+
+// move an inode itself, its children have to follow it
+// through their parent offsets, which the step pays for as well
+static mem_block* move_inode(void* fsptr, fs_locks* locks, defrag_budget* b, mem_block* block){
+    off_type off = trans_to_off(fsptr, block);
+    size_t cost = inode_size(block);
+    if(block->type == DIRECTORY_TYPE)
+        cost += (size_t) block->num_children * sizeof(mem_block);
+    off_type moved_off = defrag_block(fsptr, locks, b, off, inode_size(block), cost);
+    mem_block* moved = trans_to_ptr(fsptr, moved_off);
+    if(moved_off != off && moved->type == DIRECTORY_TYPE){
+        dir_entry* entries = dir_entries(fsptr, moved);
+        for(int i=0; i<moved->num_children; i++){
+            mem_block* child = trans_to_ptr(fsptr, entries[i].block_off);
+            child->parent = moved_off;
+            mark_dirty(fsptr, child, sizeof(mem_block));
+        }
+    }
+    return moved;
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+// inode numbers, for callers that keep hold of inodes instead of paths:
+// the root is ROOT_INO, as FUSE wants it, and any other inode is
+// numbered by its offset, which stays put as long as the caller has
+// the compactor leave inodes where they are
+#define ROOT_INO ((uint64_t) 1)
+
+static mem_block* ino_block(void* fsptr, size_t fssize, uint64_t ino){
+    handle_header* handle = (handle_header*) fsptr;
+    if(ino == ROOT_INO)
+        return trans_to_ptr(fsptr, handle->root_dir);
+    if(ino % ALLOC_UNIT != 0 || ino < (uint64_t) sizeof(handle_header) ||
+       ino > (uint64_t) (fssize - sizeof(mem_block)))
+        return NULL;
+    return trans_to_ptr(fsptr, (off_type) ino);
+}
+
+static uint64_t block_ino(void* fsptr, mem_block* block){
+    if(block->parent == (off_type) 0)
+        return ROOT_INO;
+    return (uint64_t) trans_to_off(fsptr, block);
+}
+
+// give back an inode and all it holds
+static void free_inode(void* fsptr, fs_locks* locks, mem_block* block){
+    if(block->type == DIRECTORY_TYPE){
+        if(block->children != (off_type) 0)
+            free_block(fsptr, locks, dir_entries(fsptr, block), (size_t) block->children_cap * sizeof(dir_entry));
+    }else{
+        free_extents(fsptr, locks, block);
+    }
+    free_block(fsptr, locks, block, sizeof(mem_block));
+}
+
+// what the flavors of stat report about a block
+static void stat_block(void* fsptr, fs_locks* locks, mem_block* block, uid_t uid, gid_t gid, struct stat* stbuf){
+    pthread_rwlock_rdlock(inode_lock(fsptr, locks, block));
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = (ino_t) block_ino(fsptr, block);
+    stbuf->st_uid = uid;
+    stbuf->st_gid = gid;
+
+    stbuf->st_atim = ns_to_ts(__atomic_load_n(&block->atime, __ATOMIC_RELAXED));
+    stbuf->st_mtim = ns_to_ts(block->mtime);
+    // no separate change time is kept
+    stbuf->st_ctim = stbuf->st_mtim;
+
+    if(block->type == DIRECTORY_TYPE){
+        stbuf->st_mode = S_IFDIR | 0755;
+        // subdirectories plus . and ..
+        stbuf->st_nlink = block->num_subdir + 2;
+    }else{
+        stbuf->st_mode = S_IFREG | 0755;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = (off_t) block->file_size;
+    }
+    // no name refers to an orphan anymore
+    if(block->flags & INODE_ORPHAN)
+        stbuf->st_nlink = 0;
+    pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+}
+
+// hand the names in the child table of block to filler, see
+// __myfs_readdir_implem
+static int list_dir(void* fsptr, fs_locks* locks, int* errnoptr, mem_block* block, void* buf,
+                    int (*filler)(void *, const char *, const struct stat *, off_t),
+                    off_t first, off_t offset){
+    if(block->type != DIRECTORY_TYPE){
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(inode_lock(fsptr, locks, block));
+    set_time(fsptr, block, 0);
+    pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+
+    // the child table only changes while names are added or removed,
+    // which callers keep out, so it can be walked without the inode lock
+    int start = 0;
+    if(offset > first)
+        start = offset - first < (off_t) block->num_children ? (int) (offset - first) : block->num_children;
+    dir_entry* entries = dir_entries(fsptr, block);
+    int reported = 0;
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+    for(int i=start; i<block->num_children; i++){
+        // inode number and type, for callers that pass them on
+        mem_block* child = trans_to_ptr(fsptr, entries[i].block_off);
+        st.st_ino = (ino_t) entries[i].block_off;
+        st.st_mode = child->type == DIRECTORY_TYPE ? S_IFDIR : S_IFREG;
+        if(filler(buf, entries[i].name, &st, first + (off_t) i + 1) != 0)
+            break;
+        reported++;
+    }
+    return reported;
+}
+
+// make a new, empty inode of type called name in the directory parent
+static mem_block* create_at(void* fsptr, fs_locks* locks, size_t fssize, int* errnoptr, mem_block* parent, const char* name, int type){
+    if(parent->type != DIRECTORY_TYPE){
+        *errnoptr = ENOTDIR;
+        return NULL;
+    }
+    // nothing new goes into a directory that is gone
+    if(parent->flags & INODE_ORPHAN){
+        *errnoptr = ENOENT;
+        return NULL;
+    }
+    if(strlen(name) >= MAX_NAME){
+        *errnoptr = ENAMETOOLONG;
+        return NULL;
+    }
+    // check if it already exists
+    mem_block* block = dir_lookup(fsptr, parent, name);
+    if(block!=NULL){
+        *errnoptr = EEXIST;
+        return NULL;
+    }
+    char checked[MAX_NAME];
+    strcpy(checked, name);
+    if(check_name(checked) != 1){
+        *errnoptr = EINVAL;
+        return NULL;
+    }
+    // a new empty inode
+    mem_block* new_block = new_inode(fsptr, locks, fssize, type);
+    // if not enough memory
+    if(new_block==NULL){
+        *errnoptr = EDQUOT;
+        return NULL;
+    }
+    new_block->parent = trans_to_off(fsptr, parent);
+
+    // the name only lives in the parent's child table
+    if(dir_insert(fsptr, locks, fssize, parent, name, new_block) != 1){
+        free_block(fsptr, locks, new_block, sizeof(mem_block));
+        *errnoptr = EDQUOT;
+        return NULL;
+    }
+    set_time(fsptr, parent, 1);
+    return new_block;
+}
+
+// take name out of the directory parent and free its inode, a
+// directory if dir is set and a file if not
+// with keep set, the inode stays an orphan instead, which nothing
+// refers to anymore but whoever still holds its inode number, until
+// __myfs_forget_ino_implem lets go of it
+static mem_block* remove_at(void* fsptr, fs_locks* locks, int* errnoptr, mem_block* parent, const char* name, int dir, int keep){
+    handle_header* handle = (handle_header*) fsptr;
+    mem_block* block = dir_lookup(fsptr, parent, name);
+    if(block==NULL){
+        *errnoptr = ENOENT;
+        return NULL;
+    }
+    if(dir && block->type != DIRECTORY_TYPE){
+        *errnoptr = ENOTDIR;
+        return NULL;
+    }
+    if(!dir && block->type == DIRECTORY_TYPE){
+        *errnoptr = EISDIR;
+        return NULL;
+    }
+    // if not empty
+    if(dir && block->num_children != 0){
+        *errnoptr = ENOTEMPTY;
+        return NULL;
+    }
+    dir_remove(fsptr, parent, name);
+    set_time(fsptr, parent, 1);
+    // the compactor cannot go on from inside a directory that is gone
+    if(dir && handle->defrag_dir == trans_to_off(fsptr, block))
+        handle->defrag_dir = (off_type) 0;
+    if(keep){
+        block->flags |= INODE_ORPHAN;
+        mark_dirty(fsptr, block, sizeof(mem_block));
+        return block;
+    }
+    // now that block can be recycled
+    free_inode(fsptr, locks, block);
+    return block;
+}
+
+// move the entry called from_name in from_parent over to to_name in
+// to_parent, see __myfs_rename_implem
+static int rename_at(void* fsptr, fs_locks* locks, size_t fssize, int* errnoptr,
+                     mem_block* from_parent, const char* from_name,
+                     mem_block* to_parent, const char* to_name){
+    if(from_parent == to_parent && strcmp(from_name, to_name) == 0)
+        return 0;
+    if(to_parent->type != DIRECTORY_TYPE){
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+    mem_block* block = dir_lookup(fsptr, from_parent, from_name);
+    if(block==NULL || (to_parent->flags & INODE_ORPHAN)){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    // check that already exists
+    if(dir_lookup(fsptr, to_parent, to_name) != NULL){
+        *errnoptr = EEXIST;
+        return -1;
+    }
+    if(strlen(to_name) >= MAX_NAME){
+        *errnoptr = ENAMETOOLONG;
+        return -1;
+    }
+    char checked[MAX_NAME];
+    strcpy(checked, to_name);
+    if(check_name(checked) != 1){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    // a directory moved below itself would be cut off from the root
+    if(block->type == DIRECTORY_TYPE){
+        for(mem_block* dir = to_parent; ; dir = trans_to_ptr(fsptr, dir->parent)){
+            if(dir == block){
+                *errnoptr = EINVAL;
+                return -1;
+            }
+            if(dir->parent == (off_type) 0)
+                break;
+        }
+    }
+
+    // moving the block is only a matter of moving its entry
+    // from one child table to the other, nothing below it changes
+    if(dir_insert(fsptr, locks, fssize, to_parent, to_name, block) != 1){
+        *errnoptr = EDQUOT;
+        return -1;
+    }
+    dir_remove(fsptr, from_parent, from_name);
+    block->parent = trans_to_off(fsptr, to_parent);
+    mark_dirty(fsptr, block, sizeof(mem_block));
+
+    set_time(fsptr, to_parent, 1);
+    set_time(fsptr, from_parent, 1);
+    set_time(fsptr, block, 1);
+    return 0;
+}
+
+static int truncate_block(void* fsptr, fs_locks* locks, size_t fssize, int* errnoptr, mem_block* block, off_t offset){
+    if(block->type == DIRECTORY_TYPE){
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    if(offset < (off_t) 0){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    pthread_rwlock_wrlock(inode_lock(fsptr, locks, block));
+    // if new size is less, drop the extents past it
+    // else the new bytes are a hole, nothing but the size changes
+    if((size_t) offset <= block->file_size){
+        shrink_extents(fsptr, locks, block, (size_t) offset);
+    }else if(extend_file(fsptr, locks, fssize, block, (size_t) offset) != 1){
+        pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+        *errnoptr = EDQUOT;
+        return -1;
+    }
+    set_time(fsptr, block, 1);
+    pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+    return 0;
+}
+
+static int read_block(void* fsptr, fs_locks* locks, int* errnoptr, mem_block* block, char* buf, size_t size, off_t offset){
+    if(block->type == DIRECTORY_TYPE){
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    if(offset < (off_t) 0){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    // reading at or past the end of the file is an end-of-file condition
+    // and close to the end, less bytes than requested are returned
+    pthread_rwlock_rdlock(inode_lock(fsptr, locks, block));
+    if((size_t) offset >= block->file_size){
+        set_time(fsptr, block, 0);
+        pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+        return 0;
+    }
+    if(size > block->file_size - (size_t) offset)
+        size = block->file_size - (size_t) offset;
+
+    copy_extents(fsptr, block, (size_t) offset, buf, size, 0);
+
+    set_time(fsptr, block, 0);
+    pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+    return (int) size;
+}
+
+static int write_block(void* fsptr, fs_locks* locks, size_t fssize, int* errnoptr, mem_block* block, const char* buf, size_t size, off_t offset){
+
+    //P$EUD0
+    // overwrite in place whatever part of the range is inside the file,
+    // giving the holes it touches memory first
+    // append the rest to the last extent, or to a new one
+    // a gap between the end of the file and offset is left a hole
+
+    if(block->type == DIRECTORY_TYPE){
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    if(offset < (off_t) 0){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    if(size == (size_t) 0)
+        return 0;
+    pthread_rwlock_wrlock(inode_lock(fsptr, locks, block));
+
+    // if offset is beyond end of file
+    size_t old_size = block->file_size;
+    if((size_t) offset > block->file_size && extend_file(fsptr, locks, fssize, block, (size_t) offset) != 1){
+        shrink_extents(fsptr, locks, block, old_size);
+        pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+        *errnoptr = EDQUOT;
+        return -1;
+    }
+
+    // the part that lands inside the file goes in place
+    size_t in_place = block->file_size - (size_t) offset;
+    if(in_place > size)
+        in_place = size;
+    if(fill_holes(fsptr, locks, fssize, block, (size_t) offset, in_place) != 1){
+        shrink_extents(fsptr, locks, block, old_size);
+        pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+        *errnoptr = EDQUOT;
+        return -1;
+    }
+    copy_extents(fsptr, block, (size_t) offset, (char*) buf, in_place, 1);
+
+    // and the rest is appended
+    size_t appended = append_extents(fsptr, locks, fssize, block, buf + in_place, size - in_place, 1);
+    if(in_place + appended == (size_t) 0){
+        shrink_extents(fsptr, locks, block, old_size);
+        pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+        *errnoptr = EDQUOT;
+        return -1;
+    }
+    set_time(fsptr, block, 1);
+    pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+    return (int) (in_place + appended);
+}
+
+static void utimens_block(void* fsptr, fs_locks* locks, mem_block* block, const struct timespec ts[2]){
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_rwlock_wrlock(inode_lock(fsptr, locks, block));
+    if(ts[0].tv_nsec != UTIME_OMIT)
+        block->atime = ts_to_ns(ts[0].tv_nsec == UTIME_NOW ? &now : &ts[0]);
+    if(ts[1].tv_nsec != UTIME_OMIT)
+        block->mtime = ts_to_ns(ts[1].tv_nsec == UTIME_NOW ? &now : &ts[1]);
+    mark_dirty(fsptr, block, sizeof(mem_block));
+    pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+}
+
+// the file stays locked for reading from a successful return with
+// pieces in *iovptr until read_end_block, so that nothing frees or
+// reuses the memory they point to before the caller is done with it
+static int read_begin_block(void* fsptr, fs_locks* locks, int* errnoptr, mem_block* block,
+                            struct iovec** iovptr, size_t size, off_t offset){
+    if(block->type == DIRECTORY_TYPE){
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    if(offset < (off_t) 0){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(inode_lock(fsptr, locks, block));
+    if(size == (size_t) 0 || (size_t) offset >= block->file_size){
+        set_time(fsptr, block, 0);
+        pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+        return 0;
+    }
+    if(size > block->file_size - (size_t) offset)
+        size = block->file_size - (size_t) offset;
+
+    int segments = file_segments(fsptr, block, (size_t) offset, size, iovptr);
+    if(segments < 0){
+        pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+        *errnoptr = EINVAL;
+        return -1;
+    }
+
+    set_time(fsptr, block, 0);
+    return segments;
+}
+
+static void read_end_block(void* fsptr, fs_locks* locks, mem_block* block){
+    pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+}
+
+static int write_begin_block(void* fsptr, fs_locks* locks, size_t fssize, int* errnoptr, mem_block* block,
+                             struct iovec** iovptr, size_t size, off_t offset, size_t* old_sizeptr){
+    if(block->type == DIRECTORY_TYPE){
+        *errnoptr = EISDIR;
+        return -1;
+    }
+    if(offset < (off_t) 0){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    if(size == (size_t) 0)
+        return 0;
+    pthread_rwlock_wrlock(inode_lock(fsptr, locks, block));
+
+    // a hole up to offset, memory for the holes inside the file, then
+    // room for the bytes to come past its end, which is left alone since
+    // the caller is going to write it
+    // the holes get zeros, so a write cut short leaves none of the old
+    // contents of their memory behind
+    size_t old_size = block->file_size;
+    *old_sizeptr = old_size;
+    size_t end = (size_t) offset + size;
+    size_t in_place = 0;
+    if((size_t) offset < old_size)
+        in_place = (end < old_size ? end : old_size) - (size_t) offset;
+    int room = (size_t) offset <= old_size || extend_file(fsptr, locks, fssize, block, (size_t) offset) == 1;
+    room = room && fill_holes(fsptr, locks, fssize, block, (size_t) offset, in_place) == 1;
+    if(room && end > block->file_size){
+        size_t more = end - block->file_size;
+        room = append_extents(fsptr, locks, fssize, block, NULL, more, 0) == more;
+    }
+    if(!room){
+        shrink_extents(fsptr, locks, block, old_size);
+        pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+        *errnoptr = EDQUOT;
+        return -1;
+    }
+
+    int segments = file_segments(fsptr, block, (size_t) offset, size, iovptr);
+    if(segments < 0){
+        shrink_extents(fsptr, locks, block, old_size);
+        pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    for(int i=0; i<segments; i++)
+        mark_dirty(fsptr, (*iovptr)[i].iov_base, (*iovptr)[i].iov_len);
+    return segments;
+}
+
+static int write_end_block(void* fsptr, fs_locks* locks, mem_block* block, size_t size, off_t offset,
+                           size_t old_size, size_t written){
+    size_t end = (size_t) offset + written;
+    if(written == (size_t) 0 || end < old_size)
+        end = old_size;
+    if(written < size && block->file_size > end)
+        shrink_extents(fsptr, locks, block, end);
+    set_time(fsptr, block, 1);
+    pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+    return (int) written;
+}
+
+// where the data at or after offset starts (SEEK_DATA) or the hole
+// (SEEK_HOLE), the end of the file counting as a hole
+static off_t seek_block(void* fsptr, fs_locks* locks, int* errnoptr, mem_block* block, off_t offset, int whence){
+    if(block->type == DIRECTORY_TYPE){
+        *errnoptr = EISDIR;
+        return (off_t) -1;
+    }
+    if(offset < (off_t) 0 || (whence != SEEK_DATA && whence != SEEK_HOLE)){
+        *errnoptr = EINVAL;
+        return (off_t) -1;
+    }
+    pthread_rwlock_rdlock(inode_lock(fsptr, locks, block));
+    size_t at = (size_t) offset;
+    if(at >= block->file_size){
+        pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+        *errnoptr = ENXIO;
+        return (off_t) -1;
+    }
+    if(block->flags & INODE_INLINE){
+        if(whence == SEEK_HOLE)
+            at = block->file_size;
+    }else{
+        // skip the pieces of the other kind
+        extent_cursor cur;
+        extent* ext = first_piece(fsptr, block, at, &cur);
+        size_t len;
+        while(at < block->file_size && (file_piece(fsptr, block, &cur, &ext, at, &len) == NULL) == (whence == SEEK_DATA))
+            at += len;
+    }
+    pthread_rwlock_unlock(inode_lock(fsptr, locks, block));
+    if(at >= block->file_size && whence == SEEK_DATA){
+        *errnoptr = ENXIO;
+        return (off_t) -1;
+    }
+    return (off_t) at;
+}
+
+/* End of helper functions */
+
+/* Implements an emulation of the stat system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   If path can be followed and describes a file or directory 
+   that exists and is accessable, the access information is 
+   put into stbuf
+
+   On success, 0 is returned. On failure, -1 is returned and 
+   the appropriate error code is put into *errnoptr.
+
+   man 2 stat documents all possible error codes and gives more detail
+   on what fields of stbuf need to be filled in. Essentially, only the
+   following fields need to be supported:
+
+   st_uid      the value passed in argument
+   st_gid      the value passed in argument
+   st_mode     (as fixed values S_IFDIR | 0755 for directories,
+                                S_IFREG | 0755 for files)
+   st_nlink    (as many as there are subdirectories (not files) for directories
+                (including . and ..),
+                1 for files)
+   st_size     (supported only for files, where it is the real file size)
+   st_atim
+   st_mtim
+
+*/
+
+int __myfs_getattr_implem(void* fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                          uid_t uid, gid_t gid,
+                          const char *path, struct stat *stbuf) {
+    if(path==NULL){
+        *errnoptr = EBADF;
+        return -1;
+    }
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* block = follow_path(fsptr, path);
+    if(block==NULL){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    stat_block(fsptr, lockptr, block, uid, gid, stbuf);
+    return 0;
 }
 
 /* Implements an emulation of the readdir system call on the filesystem 
    of size fssize pointed to by fsptr. 
 
-   If path can be followed and describes a directory that exists and
-   is accessable, the names of the subdirectories and files
-   contained in that directory are output into *namesptr. The . and ..
-   directories must not be included in that listing.
+   If path can be followed and describes a directory that exists and
+   is accessable, the names of the subdirectories and files
+   contained in that directory are handed to filler, one call per
+   name, straight from the directory's child table. The . and ..
+   directories must not be included in that listing.
+
+   The names are numbered from first on, in the order of the child
+   table; filler gets buf, the name, a stat with only the inode number
+   (as in __myfs_lookup_ino_implem) and the type in st_mode set, and
+   the number of the name after it, which is where a later call can
+   pick up again.
+   Names before offset are skipped, so the listing resumes right
+   after a name whose number was handed out as offset. filler is
+   FUSE's fuse_fill_dir_t and can be passed as is: once it returns
+   nonzero the buffer is full and the listing stops.
+
+   Names added or removed between two calls may shift the ones after
+   them by one, so one of those may be skipped or reported twice; as
+   with any readdir, the names changed meanwhile may or may not show.
+
+   Nothing is allocated. The function returns the number of names
+   that have been handed to filler, 0 if none are left after offset.
+
+   On failure, -1 is returned and the *errnoptr is set to 
+   the appropriate error code. 
+
+   The error codes are documented in man 2 readdir.
+
+*/
+
+int __myfs_readdir_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                          const char *path, void *buf,
+                          int (*filler)(void *, const char *, const struct stat *, off_t),
+                          off_t first, off_t offset) {
+    if(path==NULL || filler==NULL){
+        *errnoptr = EBADF;
+        return -1;
+    }
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* block = follow_path(fsptr, path);
+    if(block==NULL){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    return list_dir(fsptr, lockptr, errnoptr, block, buf, filler, first, offset);
+}
+
+/* Implements an emulation of the mknod system call for regular files
+   on the filesystem of size fssize pointed to by fsptr.
+
+   This function is called only for the creation of regular files.
+
+   If a file gets created, it is of size zero and has default
+   ownership and mode bits.
+
+   The call creates the file indicated by path.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 mknod.
+
+*/
+int __myfs_mknod_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                        const char *path) {
+    if(path==NULL){
+        *errnoptr = EBADF;
+        return -1;
+    }
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    // the parent directory has to exist
+    char name[MAX_NAME];
+    mem_block* parent_dir = follow_parent(fsptr, path, name);
+    if(parent_dir==NULL){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    if(create_at(fsptr, lockptr, fssize, errnoptr, parent_dir, name, FILE_TYPE) == NULL)
+        return -1;
+    return 0;
+}
+
+/* Implements an emulation of the unlink system call for regular files
+   on the filesystem of size fssize pointed to by fsptr.
+
+   This function is called only for the deletion of regular files.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 unlink.
+
+*/
+int __myfs_unlink_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                        const char *path) {
+    if(path==NULL){
+        *errnoptr = EBADF;
+        return -1;
+    }
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    char name[MAX_NAME];
+    mem_block* parent_dir = follow_parent(fsptr, path, name);
+    if(parent_dir==NULL){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    // unlinking a file means taking it out of its parent's table
+    // and freeing the block
+    if(remove_at(fsptr, lockptr, errnoptr, parent_dir, name, 0, 0) == NULL)
+        return -1;
+    return 0;
+}
+
+/* Implements an emulation of the rmdir system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   The call deletes the directory indicated by path.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The function call must fail when the directory indicated by path is
+   not empty (if there are files or subdirectories other than . and ..).
+
+   The error codes are documented in man 2 rmdir.
+
+*/
+int __myfs_rmdir_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                        const char *path) {
+    if(path==NULL){
+        *errnoptr = EBADF;
+        return -1;
+    }
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* block = follow_path(fsptr, path);
+    if(block==NULL){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    // if root
+    if(block->parent == (off_type) 0){
+        *errnoptr = EBUSY;
+        return -1;
+    }
+    // take it out of the parent dir and free the block
+    // along with its (empty) child table
+    char name[MAX_NAME];
+    mem_block* parent_dir = follow_parent(fsptr, path, name);
+    if(remove_at(fsptr, lockptr, errnoptr, parent_dir, name, 1, 0) == NULL)
+        return -1;
+    return 0;
+}
+
+/* Implements an emulation of the mkdir system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   The call creates the directory indicated by path.
 
-   If it needs to output file and subdirectory names, the function
-   starts by allocating (with calloc) an array of pointers to
-   characters of the right size (n entries for n names). Sets
-   *namesptr to that pointer. It then goes over all entries
-   in that array and allocates, for each of them an array of
-   characters of the right size (to hold the i-th name, together
-   with the appropriate '\0' terminator). It puts the pointer
-   into that i-th array entry and fills the allocated array
-   of characters with the appropriate name. The calling function
-   will call free on each of the entries of *namesptr and 
-   on *namesptr.
-
-   The function returns the number of names that have been 
-   put into namesptr.
-
-   If no name needs to be reported because the directory does
-   not contain any file or subdirectory besides . and .., 0 is
-   returned and no allocation takes place.
+   On success, 0 is returned.
 
-   On failure, -1 is returned and the *errnoptr is set to 
-   the appropriate error code. 
+   On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The error codes are documented in man 2 readdir.
+   The error codes are documented in man 2 mkdir.
+
+*/
+int __myfs_mkdir_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                        const char *path) {
+    if(path==NULL){
+        *errnoptr = EBADF;
+        return -1;
+    }
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    // the parent directory has to exist
+    char name[MAX_NAME];
+    mem_block* parent_dir = follow_parent(fsptr, path, name);
+    if(parent_dir==NULL){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    if(create_at(fsptr, lockptr, fssize, errnoptr, parent_dir, name, DIRECTORY_TYPE) == NULL)
+        return -1;
+    return 0;
+}
+
+/* Implements an emulation of the rename system call on the filesystem 
+   of size fssize pointed to by fsptr. 
+
+   The call moves the file or directory indicated by from to to.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   Caution: the function does more than what is hinted to by its name.
+   In cases the from and to paths differ, the file is moved out of 
+   the from path and added to the to path.
+
+   No block stores its path, only its name in its parent's child table
+   and a reference to that parent, so moving a directory takes the
+   same two entry changes however much lies below it. A directory
+   cannot be moved into itself or below it, which is checked by
+   walking up from the new parent, as deep as that one lies.
+
+   The error codes are documented in man 2 rename.
+
+*/
+int __myfs_rename_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                         const char *from, const char *to) {
+
+    if(strcmp(from, to) == 0)
+        return 0;
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* block = follow_path(fsptr, from);
+    if(block==NULL){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    // the root stays where it is
+    if(block->parent == (off_type) 0){
+        *errnoptr = EBUSY;
+        return -1;
+    }
+
+    // find both parent directories
+    char from_name[MAX_NAME];
+    char to_name[MAX_NAME];
+    mem_block* from_parent_block = follow_parent(fsptr, from, from_name);
+    mem_block* to_parent_block = follow_parent(fsptr, to, to_name);
+    if(to_parent_block==NULL){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    return rename_at(fsptr, lockptr, fssize, errnoptr, from_parent_block, from_name, to_parent_block, to_name);
+}
+
+/* Implements an emulation of the truncate system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   The call changes the size of the file indicated by path to offset
+   bytes.
+
+   When the file becomes smaller due to the call, the extending bytes are
+   removed. When it becomes larger, the bytes added are a hole: they
+   read as zeros, but only the size of the file changes.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 truncate.
+
+*/
+int __myfs_truncate_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                           const char *path, off_t offset) {
+    if(path==NULL){
+        *errnoptr = EBADF;
+        return -1;
+    }
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* block = follow_path(fsptr, path);
+    if(block==NULL){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    return truncate_block(fsptr, lockptr, fssize, errnoptr, block, offset);
+}
+
+/* Implements an emulation of the open system call on the filesystem 
+   of size fssize pointed to by fsptr, without actually performing the opening
+   of the file (no file descriptor is returned).
+
+   The call just checks if the file (or directory) indicated by path
+   can be accessed, i.e. if the path can be followed to an existing
+   object for which the access rights are granted.
+
+   On success, 0 is returned.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The two only interesting error codes are 
+
+   * EFAULT: the filesystem is in a bad state, we can't do anything
+
+   * ENOENT: the file that we are supposed to open doesn't exist (or a
+             subpath).
+
+   It is possible to restrict ourselves to only these two error
+   conditions. It is also possible to implement more detailed error
+   condition answers.
+
+   The error codes are documented in man 2 open.
+
+*/
+int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr,
+                       const char *path) {
+    if(path==NULL){
+        *errnoptr = EBADF;
+        return -1;
+    }
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* block = follow_path(fsptr, path);
+    if(block==NULL){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    return 0;
+}
+
+/* Implements an emulation of the read system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   The call copies up to size bytes from the file indicated by 
+   path into the buffer, starting to read at offset. See the man page
+   for read for the details when offset is beyond the end of the file etc.
+
+   On success, the appropriate number of bytes read into the buffer is
+   returned. The value zero is returned on an end-of-file condition.
+
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 read.
+
+*/
+int __myfs_read_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                       const char *path, char *buf, size_t size, off_t offset) {
+    if(size==(size_t)0){
+        return 0;
+    }
+    if(path==NULL){
+        *errnoptr = EBADF;
+        return -1;
+    }
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* block = follow_path(fsptr, path);
+    if(block==NULL){
+        *errnoptr = ENOENT;
+        return -1;
+    }
+    return read_block(fsptr, lockptr, errnoptr, block, buf, size, offset);
+}
+
+/* Implements an emulation of the write system call on the filesystem 
+   of size fssize pointed to by fsptr.
+
+   The call copies up to size bytes to the file indicated by 
+   path into the buffer, starting to write at offset. See the man page
+   for write for the details when offset is beyond the end of the file etc.
+
+   On success, the appropriate number of bytes written into the file is
+   returned. The value zero is returned on an end-of-file condition.
 
-   In the case memory allocation with malloc/calloc fails, failure is
-   indicated by returning -1 and setting *errnoptr to EINVAL.
+   On failure, -1 is returned and *errnoptr is set appropriately.
+
+   The error codes are documented in man 2 write.
 
 */
+int __myfs_write_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                        const char *path, const char *buf, size_t size, off_t offset) {
 
-int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
-                          const char *path, char ***namesptr) {
     if(path==NULL){
         *errnoptr = EBADF;
         return -1;
@@ -812,132 +2871,63 @@ int __myfs_readdir_implem(void *fsptr, size_t fssize, int *errnoptr,
         *errnoptr = ENOENT;
         return -1;
     }
-    if(block->type != DIRECTORY_TYPE){
-        set_time(block, 0);
-        *errnoptr = ENOTDIR;
-        return -1;
-    }
+    return write_block(fsptr, lockptr, fssize, errnoptr, block, buf, size, offset);
+}
 
-    // iterate to every block linearly
-    // check if its parent is the directory we are reading
-    // if equal then add this file or dir to the buffer
-    // this first for() loop just counts up how many names
-    // don't see any other way to follow the instructions
-    int names = 0;
-    off_type block_off = handle->root_dir + (off_type) sizeof(mem_block);
-    while(block_off < handle->begining_of_free_mem){
-        mem_block* ch_block = (mem_block*) trans_to_ptr(handle, block_off);
-        mem_block* parent = (mem_block*) ch_block->parent;
-        set_time(ch_block, 0);
-        set_time(parent, 0);
-        if(parent->path_name == path){
-            if(strcmp(".", *ch_block->name) == 0 || strcmp("..", *ch_block->name) == 0)
-                continue;
-            else{
-                //namesptr[names] = (void*) ch_block->name;
-                names++;
-            }
-        }
-        block_off += (off_type) block->total_size;
-    }
+/* Implements an emulation of lseek with SEEK_DATA or SEEK_HOLE on the
+   filesystem of size fssize pointed to by fsptr.
 
-    set_time(block, 0);
+   The bytes of a file that were never written, past what truncate or a
+   write beyond the end added, are a hole: they read as zeros without
+   taking up any memory. The call tells where the next data or the next
+   hole at or after offset in the file indicated by path starts, so
+   that a copy can skip the holes. The end of the file counts as a hole.
+   FUSE 2 does not pass lseek on, so only direct callers get to see
+   the holes this way.
 
-    //If no name needs to be reported because the directory does
-    //not contain any file or subdirectory besides . and .., 0 is
-    //returned and no allocation takes place.
-    if(names==0)
-        return 0;
+   On success, that offset is returned.
 
-    //If it needs to output file and subdirectory names, the function
-    //starts by allocating (with calloc) an array of pointers to
-    //characters of the right size (n entries for n names).
-    char** ptr_arr = calloc(names, sizeof(char*)*MAX_NAME);
-    if(ptr_arr==NULL){
-        *errnoptr = EINVAL;
-        return -1;
-    }
+   On failure, -1 is returned and *errnoptr is set appropriately, ENXIO
+   if offset is at or past the end of the file, or there is no data
+   after it.
 
-    //Sets *namesptr to that pointer.
-    *namesptr = (void*) ptr_arr;
-    //it then goes over all entries in that array
-    names = 0;
-    block_off = handle->root_dir + (off_type) sizeof(mem_block);
-    while(block_off < handle->begining_of_free_mem){
-        mem_block* child = (mem_block*) trans_to_ptr(handle, block_off);
-        mem_block* parent = (mem_block*) child->parent;
-        if(parent->path_name == path){
-            if(strcmp(".", *child->name) == 0 || strcmp("..", *child->name) == 0){
-                continue;
-            }else{
-                //and allocates, for each of them an array of
-                //characters of the right size to hold the i-th name
-                char** itr_arr = malloc(sizeof(char)*MAX_NAME);
-                if(itr_arr==NULL){
-                    *errnoptr = EINVAL;
-                    return -1;
-                }
-                //It puts the pointer into that i-th array entry
-                namesptr[names] = itr_arr;
-                //and fills the allocated array of characters with the name
-                //itr_arr = (void*) child->name;
-                strcpy((void*) child->name, *namesptr[names]);
-
-                names++;
-            }
-        }
-        block_off += block->total_size;
+*/
+off_t __myfs_lseek_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                          const char *path, off_t offset, int whence) {
+    if(path==NULL){
+        *errnoptr = EBADF;
+        return (off_t) -1;
     }
-    return names;
-
-    //P$EUD0
-    // if not directory return -1
-    // access directory
-    // iterate through subdirectories and files
-        // output to namesptr
-        // int names++
-    // namesptr = calloc(names, size of names?);
-        // if namesptr == NULL set errnoptr return 0
-    // iterate thru namesptr array
-    // while(namesptr != NULL)
-        // char* ptr = malloc(size of this name +1)
-        // if ptr == NULL set errnoptr return -1
-        // iterate through length of this name
-        // ptr = name[i]
-        // ptr ++
-        // if last i
-            // ptr = '/0'
-            // break
-        // namesptr++
-    // return names
-
-    // follow_path returns the mem_block* of this dir
-    // check if it is a dir
-    // iterate through every mem_block starting from root
-        // if block->parent == dir
-            // add it to namesptr
-            // names++
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return (off_t) -1;
+    }
+    mem_block* block = follow_path(fsptr, path);
+    if(block==NULL){
+        *errnoptr = ENOENT;
+        return (off_t) -1;
+    }
+    return seek_block(fsptr, lockptr, errnoptr, block, offset, whence);
 }
 
-/* Implements an emulation of the mknod system call for regular files
-   on the filesystem of size fssize pointed to by fsptr.
-
-   This function is called only for the creation of regular files.
-
-   If a file gets created, it is of size zero and has default
-   ownership and mode bits.
+/* Implements an emulation of the utimensat system call on the filesystem 
+   of size fssize pointed to by fsptr.
 
-   The call creates the file indicated by path.
+   The call changes the access and modification times of the file
+   or directory indicated by path to the values in ts. A tv_nsec of
+   UTIME_NOW stands for the current time, one of UTIME_OMIT leaves
+   that time as it is.
 
    On success, 0 is returned.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The error codes are documented in man 2 mknod.
+   The error codes are documented in man 2 utimensat.
 
 */
-int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path) {
+int __myfs_utimens_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                          const char *path, const struct timespec ts[2]) {
     if(path==NULL){
         *errnoptr = EBADF;
         return -1;
@@ -947,107 +2937,70 @@ int __myfs_mknod_implem(void *fsptr, size_t fssize, int *errnoptr,
        *errnoptr = EFAULT;
         return -1;
     }
-    // check if file already exists
     mem_block* block = follow_path(fsptr, path);
-    if(block!=NULL){
-        set_time(block, 0);
-        *errnoptr = EEXIST;
-        return -1;
-    }
-    // make the file, a new block of size zero
-    mem_block* new_block = get_block(fsptr, (size_t) 0, fssize);
-    // if not enough memory
     if(block==NULL){
-        *errnoptr = EDQUOT;
-        return -1;
-    }
-
-    // set path, name, parent name
-    char* base_c = strdup(path);
-    char* base_name = basename(base_c);
-    char* dir_c = strdup(path);
-    char* dir_name = dirname(dir_c);
-    char* parent_c = strdup(path);
-    char* parent_name = basename(parent_c);
-    char* parentp_c = strdup(path);
-    char* parent_path_name = basename(parentp_c);
-    if(dir_name==NULL){
         *errnoptr = ENOENT;
         return -1;
     }
-    int x = set_name(new_block, base_name);
-    if(x!=1){
-        *errnoptr = EAGAIN;
-        return -1;
-    }
-    // assuming these have already been checked, or they wouldn't already be dir names
-    //strcpy(new_block->name, base_name);
-    strcpy(new_block->parent_name, parent_name);
-    strcpy(new_block->path_name, path);
-    strcpy(new_block->parent_path_name, parent_path_name);
 
-    mem_block* parent_dir = follow_path(fsptr, parent_path_name);
-    block->parent = (void*) parent_dir;
-
-    new_block->type = FILE_TYPE;
+    utimens_block(fsptr, lockptr, block, ts);
     return 0;
 }
 
-/* Implements an emulation of the unlink system call for regular files
-   on the filesystem of size fssize pointed to by fsptr.
+/* The calls below are the flavors of the ones above for callers that
+   name files and directories by inode number instead of by path, as
+   FUSE's low-level API does. The root directory is inode 1, any other
+   inode is numbered by its offset in the memory, so going from an
+   inode number to the inode takes no lookup at all.
 
-   This function is called only for the deletion of regular files.
+   The numbers only stay valid while inodes do not move, so a caller
+   using them must pass keep_inodes to __myfs_defrag_step_implem.
 
-   On success, 0 is returned.
+   Names in a directory are given as a single name, without any /.
+   Return values and error codes are those of the path flavors.
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+*/
 
-   The error codes are documented in man 2 unlink.
+/* Looks up name in the directory with inode number parent, puts the
+   inode number of what it names into *inoptr and its attributes, as
+   __myfs_getattr_implem reports them, into stbuf.
 
 */
-int __myfs_unlink_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path) {
-    if(path==NULL){
-        *errnoptr = EBADF;
-        return -1;
-    }
+int __myfs_lookup_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                             uid_t uid, gid_t gid, uint64_t parent,
+                             const char *name, uint64_t *inoptr, struct stat *stbuf) {
     handle_header* handle = init_fs(fsptr, fssize);
     if(handle==NULL){
        *errnoptr = EFAULT;
         return -1;
     }
-    mem_block* block = follow_path(fsptr, path);
+    mem_block* dir = ino_block(fsptr, fssize, parent);
+    if(dir==NULL || name==NULL){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    if(dir->type != DIRECTORY_TYPE){
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+    mem_block* block = dir_lookup(fsptr, dir, name);
     if(block==NULL){
         *errnoptr = ENOENT;
         return -1;
     }
-    // unlinking a file just means freeing the block
-    // there is nothing else that regular files have that needs to go away
-    // update the directory's time modified though?
-    mem_block* parent_dir = (void*) block->parent;
-    set_time(parent_dir, 1);
-    free_block(block, block);
-    // now that block can be recycled
+    *inoptr = block_ino(fsptr, block);
+    stat_block(fsptr, lockptr, block, uid, gid, stbuf);
     return 0;
 }
 
-/* Implements an emulation of the rmdir system call on the filesystem 
-   of size fssize pointed to by fsptr.
-
-   The call deletes the directory indicated by path.
-
-   On success, 0 is returned.
-
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The function call must fail when the directory indicated by path is
-   not empty (if there are files or subdirectories other than . and ..).
-
-   The error codes are documented in man 2 rmdir.
+/* Does what __myfs_open_implem does for the file or directory at path
+   and puts its inode number into *inoptr, so that a caller that keeps
+   the number, as an open file handle for instance, does not need to
+   follow path again for what it does with it afterwards.
 
 */
-int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path) {
+int __myfs_open_ino_implem(void *fsptr, size_t fssize, int *errnoptr,
+                           const char *path, uint64_t *inoptr) {
     if(path==NULL){
         *errnoptr = EBADF;
         return -1;
@@ -1062,558 +3015,832 @@ int __myfs_rmdir_implem(void *fsptr, size_t fssize, int *errnoptr,
         *errnoptr = ENOENT;
         return -1;
     }
-    // if not directory
-    if(block->type != DIRECTORY_TYPE){
-        *errnoptr = ENOTDIR;
+    *inoptr = block_ino(fsptr, block);
+    return 0;
+}
+
+/* Lets go of the inode with number ino once its caller holds the
+   number no more. An inode that was removed from its directory with
+   keep set is freed now, any other is left alone.
+
+*/
+int __myfs_forget_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr, uint64_t ino) {
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
         return -1;
     }
-    // if root
-    if(block->parent == NULL || strcmp(*block->name, "/")){
-        *errnoptr = EACCES;
+    mem_block* block = ino_block(fsptr, fssize, ino);
+    if(block==NULL){
+        *errnoptr = EINVAL;
         return -1;
     }
-    // if not empty
-    if(block->num_children != 0){
-        *errnoptr = EBUSY;
+    if(block->flags & INODE_ORPHAN){
+        // no new reader can come, but one may still be at the contents
+        pthread_rwlock_wrlock(inode_lock(fsptr, lockptr, block));
+        pthread_rwlock_unlock(inode_lock(fsptr, lockptr, block));
+        free_inode(fsptr, lockptr, block);
+    }
+    return 0;
+}
+
+int __myfs_getattr_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                              uid_t uid, gid_t gid, uint64_t ino, struct stat *stbuf) {
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
         return -1;
     }
-    if((int*) (&block->num_subdir) != 0){
-        *errnoptr = EBUSY;
+    mem_block* block = ino_block(fsptr, fssize, ino);
+    if(block==NULL){
+        *errnoptr = EINVAL;
         return -1;
-    }else{
-        // free the block just like unlink()
-        // and update the parent dir
-        mem_block* parent_dir = (mem_block*) block->parent;
-        parent_dir->num_children -= 1;
-        free_block(fsptr, block);
-        set_time(parent_dir, 1);
-        return 0;
     }
+    stat_block(fsptr, lockptr, block, uid, gid, stbuf);
+    return 0;
 }
 
-/* Implements an emulation of the mkdir system call on the filesystem 
-   of size fssize pointed to by fsptr. 
-
-   The call creates the directory indicated by path.
+int __myfs_readdir_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                              uint64_t ino, void *buf,
+                              int (*filler)(void *, const char *, const struct stat *, off_t),
+                              off_t first, off_t offset) {
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* block = ino_block(fsptr, fssize, ino);
+    if(block==NULL || filler==NULL){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    return list_dir(fsptr, lockptr, errnoptr, block, buf, filler, first, offset);
+}
 
-   On success, 0 is returned.
+/* Creates a file (mknod) or directory (mkdir) called name in the
+   directory with inode number parent and puts its inode number into
+   *inoptr.
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+*/
+int __myfs_mknod_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                            uint64_t parent, const char *name, int dir, uint64_t *inoptr) {
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* parent_dir = ino_block(fsptr, fssize, parent);
+    if(parent_dir==NULL || name==NULL){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    mem_block* block = create_at(fsptr, lockptr, fssize, errnoptr, parent_dir, name, dir ? DIRECTORY_TYPE : FILE_TYPE);
+    if(block==NULL)
+        return -1;
+    *inoptr = block_ino(fsptr, block);
+    return 0;
+}
 
-   The error codes are documented in man 2 mkdir.
+/* Removes the file (unlink) or empty directory (rmdir) called name
+   from the directory with inode number parent and puts its inode
+   number into *inoptr. With keep set, the inode stays around, only
+   reachable by its number, until __myfs_forget_ino_implem is called
+   for it, so the caller can go on using it.
 
 */
-int __myfs_mkdir_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path) {
-    if(path==NULL){
-        *errnoptr = EBADF;
+int __myfs_unlink_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                             uint64_t parent, const char *name, int dir, int keep,
+                             uint64_t *inoptr) {
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* parent_dir = ino_block(fsptr, fssize, parent);
+    if(parent_dir==NULL || name==NULL){
+        *errnoptr = EINVAL;
         return -1;
     }
+    if(parent_dir->type != DIRECTORY_TYPE){
+        *errnoptr = ENOTDIR;
+        return -1;
+    }
+    mem_block* block = remove_at(fsptr, lockptr, errnoptr, parent_dir, name, dir, keep);
+    if(block==NULL)
+        return -1;
+    *inoptr = (uint64_t) trans_to_off(fsptr, block);
+    return 0;
+}
+
+int __myfs_rename_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                             uint64_t from_parent, const char *from,
+                             uint64_t to_parent, const char *to) {
     handle_header* handle = init_fs(fsptr, fssize);
     if(handle==NULL){
        *errnoptr = EFAULT;
         return -1;
     }
-    // check if dir already exists
-    mem_block* block = follow_path(fsptr, path);
-    if(block!=NULL){
-        set_time(block, 0);
-        *errnoptr = EEXIST;
+    mem_block* from_dir = ino_block(fsptr, fssize, from_parent);
+    mem_block* to_dir = ino_block(fsptr, fssize, to_parent);
+    if(from_dir==NULL || to_dir==NULL || from==NULL || to==NULL){
+        *errnoptr = EINVAL;
         return -1;
     }
-    // make the dir, a new block of size zero
-    mem_block* new_block = get_block(fsptr, (size_t) 0, fssize);
-    // if not enough memory
-    if(block==NULL){
-        *errnoptr = EDQUOT;
+    if(from_dir->type != DIRECTORY_TYPE){
+        *errnoptr = ENOTDIR;
         return -1;
     }
+    return rename_at(fsptr, lockptr, fssize, errnoptr, from_dir, from, to_dir, to);
+}
 
-    // set path, name, parent name
-    char* base_c = strdup(path);
-    char* base_name = basename(base_c); // should look like "file"
-    char* dir_c = strdup(path);
-    char* dir_name = dirname(dir_c); // should be "/root/sub1/sub2/parent"
-    char* parent_c = strdup(dir_name);
-    char* parent_name = basename(parent_c); // should be "parent"
-    if(dir_name==NULL){
-        *errnoptr = ENOENT;
+int __myfs_truncate_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                               uint64_t ino, off_t offset) {
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
         return -1;
     }
-    int x = set_name(new_block, base_name);
-    if(x!=1){
-        *errnoptr = EAGAIN;
+    mem_block* block = ino_block(fsptr, fssize, ino);
+    if(block==NULL){
+        *errnoptr = EINVAL;
         return -1;
     }
-    //strcpy(new_block->name, base_name);
-    strcpy(new_block->parent_name, parent_name);
-    strcpy(new_block->path_name, path);
-    strcpy(new_block->parent_path_name, dir_name);
-
-    set_time(new_block, 1);
-
-    new_block->type = DIRECTORY_TYPE;
-    // do another follow path to get the parent block
-    mem_block* parent_block = follow_path(fsptr, dir_name);
-    parent_block->num_children += 1;
-    *(int*) (&parent_block->num_subdir) += 1;
-    new_block->parent = (void*) parent_block;
+    return truncate_block(fsptr, lockptr, fssize, errnoptr, block, offset);
+}
 
-    set_time(parent_block, 0);
+int __myfs_utimens_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                              uint64_t ino, const struct timespec ts[2]) {
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* block = ino_block(fsptr, fssize, ino);
+    if(block==NULL){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    utimens_block(fsptr, lockptr, block, ts);
     return 0;
 }
 
-/* Implements an emulation of the rename system call on the filesystem 
-   of size fssize pointed to by fsptr. 
-
-   The call moves the file or directory indicated by from to to.
-
-   On success, 0 is returned.
-
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   Caution: the function does more than what is hinted to by its name.
-   In cases the from and to paths differ, the file is moved out of 
-   the from path and added to the to path.
-
-   The error codes are documented in man 2 rename.
-
-*/
-int __myfs_rename_implem(void *fsptr, size_t fssize, int *errnoptr,
-                         const char *from, const char *to) {
-
-    //P$EUD0
-    // first check if the paths are the same
-    // follow path to get the file/dir indicated by *from
-    // same for *to
-    // check if it already exists in the *to path
-    // get the basenames and parent names
-    // replace block->path with the *to path
-    // update the new and old parents
-    // also check every dir in the paths
-        // if they are different then update each... parent?
-    // need to check if file or dir?
-
-    if(strcmp(from, to) == 0)
+int __myfs_read_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                           uint64_t ino, char *buf, size_t size, off_t offset) {
+    if(size==(size_t)0){
         return 0;
+    }
     handle_header* handle = init_fs(fsptr, fssize);
     if(handle==NULL){
        *errnoptr = EFAULT;
         return -1;
     }
-    mem_block* block = follow_path(fsptr, from);
+    mem_block* block = ino_block(fsptr, fssize, ino);
     if(block==NULL){
-        *errnoptr = ENOENT;
-        return -1;
-    }
-    // check that already exists
-    mem_block* to_block = follow_path(fsptr, to);
-    if(to_block!=NULL){
-        *errnoptr = EEXIST;
+        *errnoptr = EINVAL;
         return -1;
     }
-
-    // update base name
-    char* to_base_c = strdup(from);
-    char* to_base_name = basename(to_base_c);
-    memset(block->name, 0, MAX_NAME);
-    strcpy(*block->name, to_base_name);
-
-    // update block's path
-    memset(block->path_name, 0, MAX_NAME*10);
-    strcpy(block->path_name, to);
-
-    // update every parent dir in the path
-    // I'm not so sure about this
-    //mem_block* block_itr;
-    //while(strcmp(block_itr->name, "/") != 0){
-        //break;
-    //}
-
-    // instead just update the parents at least
-    // the new parent
-    char* dir_c = strdup(to);
-    char* dir_name = dirname(dir_c);
-    char* to_parent_c = strdup(dir_name);
-    char* to_parent_name = basename(to_parent_c);
-
-    mem_block* to_parent_block = follow_path(fsptr, to_parent_name);
-    to_parent_block->num_children += 1;
-    *(int*) (&to_parent_block->num_subdir) += 1;
-    block->parent = (void*) to_parent_block;
-
-    // the old parent
-    dir_c = strdup(from);
-    dir_name = dirname(dir_c);
-    char* from_parent_c = strdup(dir_name);
-    char* from_parent_name = basename(from_parent_c);
-
-    mem_block* from_parent_block = follow_path(fsptr, from_parent_name);
-    from_parent_block->num_children -= 1;
-    *(int*) (&from_parent_block->num_subdir) -= 1;
-
-    set_time(to_parent_block, 1);
-    set_time(from_parent_block, 1);
-    set_time(block, 1);
-
-    return 0;
+    return read_block(fsptr, lockptr, errnoptr, block, buf, size, offset);
 }
 
-/* Implements an emulation of the truncate system call on the filesystem 
-   of size fssize pointed to by fsptr.
-
-   The call changes the size of the file indicated by path to offset
-   bytes.
-
-   When the file becomes smaller due to the call, the extending bytes are
-   removed. When it becomes larger, zeros are appended.
-
-   On success, 0 is returned.
-
-   On failure, -1 is returned and *errnoptr is set appropriately.
-
-   The error codes are documented in man 2 truncate.
-
-*/
-int __myfs_truncate_implem(void *fsptr, size_t fssize, int *errnoptr,
-                           const char *path, off_t offset) {
-    if(path==NULL){
-        *errnoptr = EBADF;
+int __myfs_write_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                            uint64_t ino, const char *buf, size_t size, off_t offset) {
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* block = ino_block(fsptr, fssize, ino);
+    if(block==NULL){
+        *errnoptr = EINVAL;
         return -1;
     }
+    return write_block(fsptr, lockptr, fssize, errnoptr, block, buf, size, offset);
+}
+
+/* Starts the zero-copy flavor of the read system call: instead of
+   copying up to size bytes starting at offset out of the file with
+   inode number ino, the call describes where these bytes lie inside
+   the memory region. It allocates (with calloc) an array of struct
+   iovec, one per extent the range touches, whose iov_base points into
+   the memory region and iov_len says how many bytes of the range are
+   found there. A hole in the range (see __myfs_lseek_implem) gets an
+   entry of its own with an iov_base of NULL; its bytes read as zeros.
+   Sets *iovptr to that array. The calling function will call free on
+   it.
+
+   The file stays locked for reading until the caller is done with the
+   bytes and calls __myfs_read_end_ino_implem with the same ino: until
+   then, no truncate, write or unlink of it can free or reuse the
+   memory the entries point to. The caller must keep the calls that
+   move blocks or change names out meanwhile, as it does around any
+   other call.
+
+   Returns the number of entries put into *iovptr. At an end-of-file
+   condition, 0 is returned, no allocation takes place and
+   __myfs_read_end_ino_implem need not be called.
+
+   On failure, -1 is returned, *errnoptr is set appropriately, EINVAL
+   if the allocation fails, and __myfs_read_end_ino_implem must not be
+   called.
+
+*/
+int __myfs_read_begin_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                                 uint64_t ino, struct iovec **iovptr,
+                                 size_t size, off_t offset) {
     handle_header* handle = init_fs(fsptr, fssize);
     if(handle==NULL){
        *errnoptr = EFAULT;
         return -1;
     }
-    mem_block* block = follow_path(fsptr, path);
+    mem_block* block = ino_block(fsptr, fssize, ino);
     if(block==NULL){
-        *errnoptr = ENOENT;
+        *errnoptr = EINVAL;
         return -1;
     }
-    if(block->type == DIRECTORY_TYPE){
-        set_time(block, 0);
-        *errnoptr = EISDIR;
+    return read_begin_block(fsptr, lockptr, errnoptr, block, iovptr, size, offset);
+}
+
+/* Finishes a read started by __myfs_read_begin_ino_implem once the
+   caller is done with the memory it was given, letting the file change
+   again.
+
+   Returns 0.
+
+*/
+int __myfs_read_end_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                               uint64_t ino) {
+    mem_block* block = ino_block(fsptr, fssize, ino);
+    if(block==NULL){
+        *errnoptr = EFAULT;
         return -1;
     }
-    // if new size is less
-    // create a free block out of the extra space
-    if((size_t) offset < block->mem_size){
-        mem_block* new_block = block + (off_type) offset;
-        free(new_block);
-        block->mem_size = (size_t) offset;
-    }else{
-        // make a new block of increased size, copy over its header info
-        mem_block* new_block = get_block(fsptr, (size_t) offset, fssize);
-        if(block==NULL){
-            *errnoptr = EDQUOT;
-            return -1;
-        }
-        strcpy(*new_block->name, *block->name);
-        strcpy(new_block->parent_name, block->parent_name);
-        strcpy(new_block->path_name, block->path_name);
-        strcpy(new_block->parent_path_name, block->parent_path_name);
-        // copy the contents of the old block to the new block
-
-        // and append with zeros
-        size_t zeros = (size_t) offset - block->mem_size;
-        char* zeros_ar = malloc(zeros);
-        memset(zeros_ar, 0, zeros);
-        memcpy(new_block + block->mem_size, zeros_ar, strlen(zeros_ar));
-        new_block->type = FILE_TYPE;
-        free(zeros_ar);
-        free_block(fsptr, block);
-        new_block->type = FILE_TYPE;
-    }
+    read_end_block(fsptr, lockptr, block);
     return 0;
-
-    //P$EUD0
-    // if new size is smaller
-        // split off the extra space past the offset
-        // that extra space goes to the freed blocks list
-    // else get a new bigger block
-        // copy everything over to the new block
-        // free the old block
 }
 
-/* Implements an emulation of the open system call on the filesystem 
-   of size fssize pointed to by fsptr, without actually performing the opening
-   of the file (no file descriptor is returned).
-
-   The call just checks if the file (or directory) indicated by path
-   can be accessed, i.e. if the path can be followed to an existing
-   object for which the access rights are granted.
-
-   On success, 0 is returned.
+/* Starts the zero-copy flavor of the write system call. Together with
+   __myfs_write_end_ino_implem, it does what __myfs_write_ino_implem
+   does, but leaves the copying of the bytes to the caller.
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+   The call makes sure the file with inode number ino has room for size
+   bytes starting at offset (a gap between the end of the file and
+   offset is left a hole) and describes where that room lies inside
+   the memory region, the same way __myfs_read_begin_ino_implem does,
+   though without any holes.
+   The caller copies the bytes to write into the pieces of memory and
+   then must call __myfs_write_end_ino_implem with the same arguments
+   and the size the file had before, which is put into *old_sizeptr.
+   The file stays locked in between, so nobody can see it half-written.
 
-   The two only interesting error codes are 
+   Returns the number of entries put into *iovptr. If size is zero, 0
+   is returned, no allocation takes place and
+   __myfs_write_end_ino_implem need not be called.
 
-   * EFAULT: the filesystem is in a bad state, we can't do anything
+   On failure, -1 is returned, *errnoptr is set appropriately and
+   __myfs_write_end_ino_implem must not be called.
 
-   * ENOENT: the file that we are supposed to open doesn't exist (or a
-             subpath).
+*/
+int __myfs_write_begin_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                                  uint64_t ino, struct iovec **iovptr,
+                                  size_t size, off_t offset, size_t *old_sizeptr) {
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    mem_block* block = ino_block(fsptr, fssize, ino);
+    if(block==NULL){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    return write_begin_block(fsptr, lockptr, fssize, errnoptr, block, iovptr, size, offset, old_sizeptr);
+}
 
-   It is possible to restrict ourselves to only these two error
-   conditions. It is also possible to implement more detailed error
-   condition answers.
+/* Finishes a write started by __myfs_write_begin_ino_implem once the
+   caller has copied written bytes into the memory it was given. If
+   less than size bytes could be copied and the write was meant to make
+   the file longer, the file is cut back to what was actually written.
 
-   The error codes are documented in man 2 open.
+   Returns written.
 
 */
-int __myfs_open_implem(void *fsptr, size_t fssize, int *errnoptr,
-                       const char *path) {
-    if(path==NULL){
-        *errnoptr = EBADF;
+int __myfs_write_end_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                                uint64_t ino, size_t size, off_t offset,
+                                size_t old_size, size_t written) {
+    mem_block* block = ino_block(fsptr, fssize, ino);
+    if(block==NULL){
+        *errnoptr = EFAULT;
         return -1;
     }
+    return write_end_block(fsptr, lockptr, block, size, offset, old_size, written);
+}
+
+off_t __myfs_lseek_ino_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                              uint64_t ino, off_t offset, int whence) {
     handle_header* handle = init_fs(fsptr, fssize);
     if(handle==NULL){
        *errnoptr = EFAULT;
-        return -1;
+        return (off_t) -1;
     }
-    mem_block* block = follow_path(fsptr, path);
+    mem_block* block = ino_block(fsptr, fssize, ino);
     if(block==NULL){
-        *errnoptr = ENOENT;
-        return -1;
+        *errnoptr = EINVAL;
+        return (off_t) -1;
     }
-    set_time(block, 0);
-    return 0;
+    return seek_block(fsptr, lockptr, errnoptr, block, offset, whence);
 }
 
-/* Implements an emulation of the read system call on the filesystem 
+/* Implements an emulation of the statfs system call on the filesystem 
    of size fssize pointed to by fsptr.
 
-   The call copies up to size bytes from the file indicated by 
-   path into the buffer, starting to read at offset. See the man page
-   for read for the details when offset is beyond the end of the file etc.
+   The call gets information of the filesystem usage and puts in 
+   into stbuf.
 
-   On success, the appropriate number of bytes read into the buffer is
-   returned. The value zero is returned on an end-of-file condition.
+   On success, 0 is returned.
 
    On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The error codes are documented in man 2 read.
+   The error codes are documented in man 2 statfs.
+
+   Essentially, only the following fields of struct statvfs need to be
+   supported:
+
+   f_bsize   fill with what you call a block (typically 1024 bytes)
+   f_blocks  fill with the total number of blocks in the filesystem
+   f_bfree   fill with the free number of blocks in the filesystem
+   f_bavail  fill with same value as f_bfree
+   f_namemax fill with your maximum file/directory name, if your
+             filesystem has such a maximum
 
 */
-int __myfs_read_implem(void *fsptr, size_t fssize, int *errnoptr,
-                       const char *path, char *buf, size_t size, off_t offset) {
-    if(size==(size_t)0){
-        return 0;
-    }
-    if(path==NULL){
-        *errnoptr = EBADF;
-        return -1;
-    }
+int __myfs_statfs_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr,
+                         struct statvfs* stbuf) {
+    fs_locks* locks = (fs_locks*) lockptr;
     handle_header* handle = init_fs(fsptr, fssize);
     if(handle==NULL){
        *errnoptr = EFAULT;
         return -1;
     }
-    mem_block* block = follow_path(fsptr, path);
-    if(block==NULL){
-        *errnoptr = ENOENT;
-        return -1;
-    }
-    if(block->type == DIRECTORY_TYPE){
-        set_time(block, 0);
-        *errnoptr = EISDIR;
-        return -1;
-    }
+    pthread_mutex_lock(&locks->alloc_lock);
+    stbuf->f_bsize = ALLOC_UNIT;
+    stbuf->f_frsize = ALLOC_UNIT;
+    stbuf->f_blocks = handle->num_units;
+    stbuf->f_bfree = handle->free_units;
+    stbuf->f_bavail = handle->free_units;
+    stbuf->f_namemax = MAX_NAME - 1;
+    pthread_mutex_unlock(&locks->alloc_lock);
 
-    char* buff = malloc(*(int*)(&block->mem_size));
-    char *buff_cpy = buff;
+    return 0;
+}
 
-    // according to the man page, if offset is beyond eof, I'm not sure
-    // set the errnoptr and don't read any bytes
-    off_type eof = trans_to_off(handle, block) + (off_type) block->total_size;
-    if(offset > eof){
-        *errnoptr = EFBIG;
-        return 0;
-    }
-    // however it says if close to eof, then return less bytes than requested
-    if(offset + (off_type) size >= eof){
-        *errnoptr = EFBIG;
-        size -= (offset+(off_type)size - eof);
-    }
 
-    buff_cpy += offset;
-    int size_of_cpy = eof - offset;
-    memcpy(buff, buff_cpy, size_of_cpy);
-    free(buff);
 
-    set_time(block, 0);
-    return size_of_cpy;
-}
 
-/* Implements an emulation of the write system call on the filesystem 
-   of size fssize pointed to by fsptr.
 
-   The call copies up to size bytes to the file indicated by 
-   path into the buffer, starting to write at offset. See the man page
-   for write for the details when offset is beyond the end of the file etc.
 
-   On success, the appropriate number of bytes written into the file is
-   returned. The value zero is returned on an end-of-file condition.
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
 
-   The error codes are documented in man 2 write.
 
-*/
-int __myfs_write_implem(void *fsptr, size_t fssize, int *errnoptr,
-                        const char *path, const char *buf, size_t size, off_t offset) {
 
-    //P$EUD0
-    // iterate a pointer up to the offset
-    // everything after this offset will be overwritten
-    // malloc() the size of the region ... total_size minus offset
-    // if writing at the end of the file, this would be zero
-    // so possibly realloc() the additional size ... += size
-    // memcpy( starting at the offset, move all of the buffer, of size)
 
-    if(path==NULL){
-        *errnoptr = EBADF;
-        return -1;
-    }
+
+
+/* Tells which parts of the filesystem of size fssize pointed to by
+   fsptr changed since the last call, so that only these need to be
+   written back to the backup-file.
+
+   The call allocates (with calloc) an array of struct iovec, one per
+   run of changed pages, whose iov_base points into the memory region
+   and iov_len says how many bytes the run covers. The runs come in
+   order, start on DIRTY_PAGE boundaries and do not touch each other.
+   Sets *iovptr to that array. The calling function will call free on
+   it. The pages are taken as clean from then on.
+
+   Returns the number of entries put into *iovptr. If nothing changed,
+   0 is returned and no allocation takes place.
+
+   On failure, -1 is returned and *errnoptr is set appropriately, the
+   pages then stay marked.
+
+*/
+int __myfs_dirty_ranges_implem(void *fsptr, size_t fssize, int *errnoptr,
+                               struct iovec **iovptr) {
     handle_header* handle = init_fs(fsptr, fssize);
     if(handle==NULL){
        *errnoptr = EFAULT;
         return -1;
     }
-    mem_block* block = follow_path(fsptr, path);
-    if(block==NULL){
-        *errnoptr = ENOENT;
-    }
-    if(block->type == DIRECTORY_TYPE){
-        set_time(block, 0);
-        *errnoptr = EISDIR;
+    uint64_t* dirty = (uint64_t*) trans_to_ptr(fsptr, handle->dirty);
+    size_t pages = (fssize + DIRTY_PAGE - 1) / DIRTY_PAGE;
+
+    // count the runs first, then take the bits away word by word
+    // pages marked in between just make a run longer or end up
+    // left for the next call
+    int runs = 0;
+    int in_run = 0;
+    for(size_t page=0; page<pages; page++){
+        int bit = (int) ((__atomic_load_n(&dirty[page / 64], __ATOMIC_RELAXED) >> (page % 64)) & 1);
+        if(bit && !in_run)
+            runs++;
+        in_run = bit;
+    }
+    if(runs == 0)
+        return 0;
+    struct iovec* iov = calloc((size_t) runs, sizeof(struct iovec));
+    if(iov==NULL){
+        *errnoptr = ENOMEM;
         return -1;
     }
-    // if offset is zero, replace everything
-    if(offset == (off_t) 0){
-        char* begin_data_field = (char*) block + sizeof(mem_block);
-        char* replace = strndup(buf, size);
-        memcpy(begin_data_field, replace, size);
-        free(replace);
+
+    int n = 0;
+    in_run = 0;
+    for(size_t w=0; w<handle->dirty_words; w++){
+        uint64_t bits = __atomic_load_n(&dirty[w], __ATOMIC_RELAXED) == 0 ? 0 : __atomic_exchange_n(&dirty[w], 0, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&handle->dirty_pages, (size_t) __builtin_popcountll(bits), __ATOMIC_RELAXED);
+        for(size_t b=0; b<64; b++){
+            size_t page = w * 64 + b;
+            if(page >= pages)
+                break;
+            if(((bits >> b) & 1) == 0){
+                in_run = 0;
+                continue;
+            }
+            if(in_run){
+                iov[n-1].iov_len += DIRTY_PAGE;
+            }else if(n < runs){
+                iov[n].iov_base = (char*) fsptr + page * DIRTY_PAGE;
+                iov[n].iov_len = DIRTY_PAGE;
+                n++;
+                in_run = 1;
+            }else{
+                // more runs than counted, keep this page for next time
+                mark_dirty(fsptr, (char*) fsptr + page * DIRTY_PAGE, 1);
+            }
+        }
     }
-    // if offset is beyond end of file
-    if((off_type) offset > (off_type) (block + block->total_size)){
-        *errnoptr = EFBIG;
-        set_time(block, 0);
+    // the last page may be cut short by the end of the memory
+    if(n > 0 && (char*) iov[n-1].iov_base + iov[n-1].iov_len > (char*) fsptr + fssize)
+        iov[n-1].iov_len = (size_t) ((char*) fsptr + fssize - (char*) iov[n-1].iov_base);
+    if(n == 0){
+        free(iov);
         return 0;
-    }else{
-        // append data to the end of a file, beginning at offset
-        // for my implementations this means we will need to
-        // make bigger mem_block, move everything over, and then append
-        mem_block* new_block = get_block(fsptr, size+block->total_size, fssize);
-        if(block==NULL){
-            *errnoptr = EDQUOT;
-            return -1;
-        }
-        //char* new_write = malloc(size);
-        //memcpy(new_write+offset, buf, size);
-
-        char* old_file = malloc(*(int*) block->file_size);
-        char* new_file = strndup(old_file, offset);
-        size_t new_size = size+offset;
-        new_file = realloc(new_file, new_size);
-        memcpy(new_file+offset, buf, size);
-        // copy over to the new block
-        char* begin_write = (char*) new_block + sizeof(mem_block);
-        memcpy(begin_write, new_file, new_size);
-        new_block->type = FILE_TYPE;
-        free(new_file);
-        free_block(fsptr, block);
     }
-    set_time(block, 1);
-    return size;
+    *iovptr = iov;
+    return n;
 }
 
-/* Implements an emulation of the utimensat system call on the filesystem 
-   of size fssize pointed to by fsptr.
+/* Tells how many bytes of the filesystem of size fssize pointed to by
+   fsptr changed since they were last taken with
+   __myfs_dirty_ranges_implem, counting whole DIRTY_PAGE pages.
 
-   The call changes the access and modification times of the file
-   or directory indicated by path to the values in ts.
+   The count is kept as pages get marked, so asking is cheap, but it
+   may be a little off while other calls are marking pages.
 
-   On success, 0 is returned.
+*/
+size_t __myfs_dirty_bytes_implem(void *fsptr, size_t fssize) {
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL)
+        return 0;
+    return __atomic_load_n(&handle->dirty_pages, __ATOMIC_RELAXED) * DIRTY_PAGE;
+}
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+/* Marks len bytes at ptr inside the filesystem of size fssize pointed
+   to by fsptr as changed again, for a caller that took them with
+   __myfs_dirty_ranges_implem and could not write them back after all.
+*/
+void __myfs_mark_dirty_implem(void *fsptr, size_t fssize, void *ptr, size_t len) {
+    if(init_fs(fsptr, fssize) == NULL)
+        return;
+    mark_dirty(fsptr, ptr, len);
+}
 
-   The error codes are documented in man 2 utimensat.
+/* Tells if any of the len bytes at ptr inside the filesystem of size
+   fssize pointed to by fsptr changed since they were last taken with
+   __myfs_dirty_ranges_implem.
+
+   Returns 1 if so, 0 if not.
 
 */
-int __myfs_utimens_implem(void *fsptr, size_t fssize, int *errnoptr,
-                          const char *path, const struct timespec ts[2]) {
-    if(path==NULL){
-        *errnoptr = EBADF;
-        return -1;
+int __myfs_is_dirty_implem(void *fsptr, size_t fssize, const void *ptr, size_t len) {
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL || len == (size_t) 0)
+        return 0;
+    uint64_t* dirty = (uint64_t*) trans_to_ptr(fsptr, handle->dirty);
+    size_t off = (size_t) ((const char*) ptr - (const char*) fsptr);
+    for(size_t page = off / DIRTY_PAGE; page <= (off + len - 1) / DIRTY_PAGE; page++){
+        if((__atomic_load_n(&dirty[page / 64], __ATOMIC_RELAXED) >> (page % 64)) & 1)
+            return 1;
     }
+    return 0;
+}
+
+/* Tells where the journal of the filesystem of size fssize pointed to
+   by fsptr lies: *offptr is set to its offset in the memory, *sizeptr
+   to its size and *idptr to the id its transactions have to carry.
+
+   The call does not format the memory, so it can look for a journal
+   to replay before the filesystem gets mounted. Memory that holds no
+   filesystem yet, or one too small for a journal, has a journal of
+   size 0.
+
+   Returns 0.
+
+*/
+int __myfs_journal_area_implem(void *fsptr, size_t fssize, size_t *offptr,
+                               size_t *sizeptr, uint64_t *idptr) {
+    handle_header* handle = (handle_header*) fsptr;
+    *offptr = 0;
+    *sizeptr = 0;
+    *idptr = 0;
+    if(fssize < sizeof(handle_header) || handle->magic != MAGIC_NUM || check_fs(fsptr, fssize) != 0)
+        return 0;
+    if(handle->journal_size == (size_t) 0)
+        return 0;
+    *offptr = (size_t) handle->journal;
+    *sizeptr = handle->journal_size;
+    *idptr = handle->journal_id;
+    return 0;
+}
+
+/* Takes in more memory for the filesystem pointed to by fsptr: its
+   memory of size fssize was extended to newsize bytes, at the same or
+   at another address (the filesystem only refers to its own blocks by
+   offset, so it does not mind).
+
+   The caller has to keep every other call out meanwhile.
+
+   The bitmaps are sized for the memory they cover, so new ones for
+   newsize go at the start of the memory just added and the old ones
+   are given back as free memory. Nothing else moves. Memory added is
+   not assumed to be zero.
+
+   On success, 0 is returned. Taking in less memory than there is
+   already does nothing.
+
+   On failure, -1 is returned and *errnoptr is set appropriately, the
+   filesystem then stays at the size it had.
+
+*/
+int __myfs_grow_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr, size_t newsize) {
+    fs_locks* locks = (fs_locks*) lockptr;
     handle_header* handle = init_fs(fsptr, fssize);
     if(handle==NULL){
        *errnoptr = EFAULT;
         return -1;
     }
-    mem_block* block = follow_path(fsptr, path);
-    if(block==NULL){
-        *errnoptr = ENOENT;
+    size_t old_units = handle->num_units;
+    size_t num_units = newsize / ALLOC_UNIT;
+    if(num_units <= old_units)
+        return 0;
+
+    // same layout as init_fs has in front, but at the end of the old memory
+    size_t words = (num_units + UNIT_BITS - 1) / UNIT_BITS;
+    size_t leaves = 1;
+    while(leaves < words)
+        leaves *= 2;
+    size_t dirty_words = ((newsize + DIRTY_PAGE - 1) / DIRTY_PAGE + 63) / 64;
+    off_type bitmap = (off_type) (old_units * ALLOC_UNIT);
+    off_type summary = bitmap + (off_type) unit_size(words * sizeof(uint64_t));
+    off_type dirty = summary + (off_type) unit_size(leaves * sizeof(summary_node));
+    off_type meta_end = dirty + (off_type) unit_size(dirty_words * sizeof(uint64_t));
+    if(meta_end > (off_type) (num_units * ALLOC_UNIT)){
+        // too little added to even hold the bitmaps for it
+        *errnoptr = EINVAL;
         return -1;
     }
-
-    memcpy(block->acc, &ts[0], sizeof(struct timespec));
-    memcpy(block->mod, &ts[1], sizeof(struct timespec));
-
+    pthread_mutex_lock(&locks->alloc_lock);
+    memset(trans_to_ptr(fsptr, bitmap), 0, (size_t) (meta_end - bitmap));
+    memcpy(trans_to_ptr(fsptr, bitmap), unit_bitmap(handle), ((old_units + UNIT_BITS - 1) / UNIT_BITS) * sizeof(uint64_t));
+    memcpy(trans_to_ptr(fsptr, dirty), trans_to_ptr(fsptr, handle->dirty), handle->dirty_words * sizeof(uint64_t));
+    // what the old bitmaps took up, the padding up to a journal after them stays in use
+    off_type old_bitmap = handle->bitmap;
+    off_type old_end = handle->dirty + (off_type) unit_size(handle->dirty_words * sizeof(uint64_t));
+
+    handle->num_units = num_units;
+    handle->free_units += num_units - old_units;
+    handle->bitmap = bitmap;
+    handle->summary = summary;
+    handle->summary_leaves = leaves;
+    handle->dirty = dirty;
+    handle->dirty_words = dirty_words;
+    for(size_t i = leaves; i-- > (size_t) 1;)
+        update_node(handle, i);
+    mark_units(handle, (size_t) bitmap / ALLOC_UNIT, (size_t) (meta_end - bitmap) / ALLOC_UNIT, 1);
+    mark_units(handle, (size_t) old_bitmap / ALLOC_UNIT, (size_t) (old_end - old_bitmap) / ALLOC_UNIT, 0);
+    mark_dirty(fsptr, trans_to_ptr(fsptr, bitmap), (size_t) (meta_end - bitmap));
+    mark_dirty(fsptr, handle, sizeof(handle_header));
+    pthread_mutex_unlock(&locks->alloc_lock);
     return 0;
 }
 
-/* Implements an emulation of the statfs system call on the filesystem 
-   of size fssize pointed to by fsptr.
-
-   The call gets information of the filesystem usage and puts in 
-   into stbuf.
-
-   On success, 0 is returned.
+/* Runs one step of compacting the filesystem of size fssize pointed
+   to by fsptr, so that the free memory scattered between blocks merges
+   into long runs again.
 
-   On failure, -1 is returned and *errnoptr is set appropriately.
+   The caller has to keep every other call out while a step runs, as
+   blocks move and whoever refers to them gets updated, all the way up
+   to the offsets in the parent's child table.
 
-   The error codes are documented in man 2 statfs.
+   The namespace is walked depth first, going on from where the last
+   step stopped, down to the extent of a file it stopped at, and every
+   block met is moved to the lowest free memory that holds it or slid
+   down over free memory right before it. A step moves no more than
+   budget bytes, and looking at a block that stays put counts as a
+   few; a block bigger than budget bytes, such as a large extent, is
+   left where it is. With keep_inodes set, inodes stay where they are
+   and only what hangs off them moves, so that inode numbers handed out
+   by the _ino_ calls stay good.
 
-   Essentially, only the following fields of struct statvfs need to be
-   supported:
+   Returns 1 if there is more to do, 0 if the last whole pass over the
+   namespace had nothing to move.
 
-   f_bsize   fill with what you call a block (typically 1024 bytes)
-   f_blocks  fill with the total number of blocks in the filesystem
-   f_bfree   fill with the free number of blocks in the filesystem
-   f_bavail  fill with same value as f_bfree
-   f_namemax fill with your maximum file/directory name, if your
-             filesystem has such a maximum
+   On failure, -1 is returned and *errnoptr is set appropriately.
 
 */
-int __myfs_statfs_implem(void *fsptr, size_t fssize, int *errnoptr,
-                         struct statvfs* stbuf) {
+int __myfs_defrag_step_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr, size_t budget,
+                              int keep_inodes) {
     handle_header* handle = init_fs(fsptr, fssize);
     if(handle==NULL){
        *errnoptr = EFAULT;
         return -1;
     }
-    stbuf->f_bsize = handle->free_contig_mem_size;
-    stbuf->f_blocks = 1;
-    stbuf->f_bfree = handle->free_blocks;
-    stbuf->f_bavail = handle->free_blocks;
-    stbuf->f_namemax = MAX_NAME;
+    defrag_budget b = { budget, budget, 0, 0 };
+    size_t pos = 0;
 
-    return -1;
+    // a new pass starts with the root, which nobody's table refers to
+    if(handle->defrag_dir == (off_type) 0){
+        mem_block* root = trans_to_ptr(fsptr, handle->root_dir);
+        mem_block* new_root = keep_inodes ? root : move_inode(fsptr, lockptr, &b, root);
+        if(new_root != root){
+            handle->root_dir = trans_to_off(fsptr, new_root);
+            mark_dirty(fsptr, &handle->root_dir, sizeof(off_type));
+        }
+        move_contents(fsptr, lockptr, &b, new_root, &pos);
+        if(b.stopped)
+            return 1;
+        handle->defrag_dir = handle->root_dir;
+        handle->defrag_index = 0;
+        handle->defrag_file = (off_type) 0;
+        b.progress = 1;
+    }
+
+    while(b.left > (size_t) 0 || !b.progress){
+        defrag_charge(&b, ALLOC_UNIT);
+        mem_block* dir = trans_to_ptr(fsptr, handle->defrag_dir);
+        if(handle->defrag_index >= dir->num_children){
+            // done with this directory, go back up to the entry after it
+            if(dir->parent == (off_type) 0){
+                handle->defrag_dir = (off_type) 0;
+                if(handle->defrag_moved == (size_t) 0)
+                    return 0;
+                handle->defrag_moved = 0;
+                return 1;
+            }
+            mem_block* parent = trans_to_ptr(fsptr, dir->parent);
+            dir_entry* entries = dir_entries(fsptr, parent);
+            int i = 0;
+            while(i < parent->num_children && entries[i].block_off != handle->defrag_dir)
+                i++;
+            handle->defrag_dir = trans_to_off(fsptr, parent);
+            handle->defrag_index = i + 1;
+            b.progress = 1;
+            continue;
+        }
+
+        // an entry the last step ran out in goes on from where it was,
+        // unless the entry at that index is another inode by now
+        dir_entry* entry = &dir_entries(fsptr, dir)[handle->defrag_index];
+        pos = handle->defrag_file == entry->block_off ? handle->defrag_file_off : (size_t) 0;
+        mem_block* block = trans_to_ptr(fsptr, entry->block_off);
+        mem_block* moved = keep_inodes ? block : move_inode(fsptr, lockptr, &b, block);
+        if(b.stopped)
+            break;
+        if(moved != block){
+            entry->block_off = trans_to_off(fsptr, moved);
+            mark_dirty(fsptr, entry, sizeof(dir_entry));
+        }
+        move_contents(fsptr, lockptr, &b, moved, &pos);
+        if(b.stopped){
+            handle->defrag_file = entry->block_off;
+            handle->defrag_file_off = pos;
+            break;
+        }
+        handle->defrag_file = (off_type) 0;
+        handle->defrag_index++;
+        b.progress = 1;
+        if(moved->type == DIRECTORY_TYPE){
+            handle->defrag_dir = trans_to_off(fsptr, moved);
+            handle->defrag_index = 0;
+        }
+    }
+    return 1;
 }
 
+/* Returns how many bytes the caller has to set aside for the locks of
+   a mounted filesystem, handed to __myfs_mount_implem and every call
+   after it as lockptr. They must not live in the filesystem's memory.
+*/
+size_t __myfs_locks_size_implem() {
+    return sizeof(fs_locks);
+}
 
+/* Prepares the filesystem of size fssize pointed to by fsptr for use,
+   before any of the other functions are called. Runs once per mount.
 
+   A fresh memory region gets formatted, a region read back from the
+   backup-file keeps its contents. Either way the locks pointed to by
+   lockptr, __myfs_locks_size_implem bytes the caller keeps for as long
+   as the filesystem is mounted, are set up for it. Nothing in the image
+   needs fixing up, wherever it is mapped (see FORMAT_VERSION).
 
+   An image of a format version this code does not know, or one whose
+   bookkeeping does not fit in fssize bytes, is refused with EINVAL or
+   EUCLEAN respectively, and left as it is. One of an older version it
+   still knows is marked as being of the current one. One that covers
+   fewer than fssize bytes, as when the memory grew but the handle
+   saying so was never written back, is grown to fssize bytes.
 
+   atime says when reads and directory listings update access times:
+   every time (0), only once the access time is older than the last
+   modification or a day old (1, as with relatime), or never (2, as
+   with noatime). Updating them every time makes every read write to
+   the inode, and so to the backup-file.
 
+   On success, 0 is returned.
 
+   On failure, -1 is returned and *errnoptr is set appropriately.
 
+*/
+int __myfs_mount_implem(void *fsptr, size_t fssize, void *lockptr, int *errnoptr, int atime) {
+    fs_locks* locks = (fs_locks*) lockptr;
+    // everything is checked before anything is written, a refused image stays as it was
+    if(atime < ATIME_STRICT || atime > ATIME_NOATIME){
+        *errnoptr = EINVAL;
+        return -1;
+    }
+    int formatted = fssize >= sizeof(handle_header) && ((handle_header*) fsptr)->magic == MAGIC_NUM;
+    if(formatted){
+        int err = check_fs(fsptr, fssize);
+        if(err != 0){
+            *errnoptr = err;
+            return -1;
+        }
+    }
+    handle_header* handle = init_fs(fsptr, fssize);
+    if(handle==NULL){
+       *errnoptr = EFAULT;
+        return -1;
+    }
+    // an image read back from the backup-file is all on disk already,
+    // a fresh one is all dirty
+    if(formatted){
+        memset(trans_to_ptr(fsptr, handle->dirty), 0, handle->dirty_words * sizeof(uint64_t));
+        handle->dirty_pages = 0;
+    }
+    // an older image is a newer one that does not use what came since
+    if(handle->version < FORMAT_VERSION){
+        handle->version = FORMAT_VERSION;
+        mark_dirty(fsptr, &handle->version, sizeof(uint32_t));
+    }
+    handle->defrag_dir = (off_type) 0;
+    handle->defrag_moved = 0;
+    handle->defrag_file = (off_type) 0;
+    handle->atime_mode = atime;
+    if(pthread_mutex_init(&locks->alloc_lock, NULL) != 0){
+        *errnoptr = ENOMEM;
+        return -1;
+    }
+    for(int i=0; i<INODE_LOCKS; i++){
+        if(pthread_rwlock_init(&locks->inode_locks[i], NULL) != 0){
+            while(i-- > 0)
+                pthread_rwlock_destroy(&locks->inode_locks[i]);
+            pthread_mutex_destroy(&locks->alloc_lock);
+            *errnoptr = ENOMEM;
+            return -1;
+        }
+    }
+    // the memory outgrew the image: it grew, and the handle saying so
+    // never made it to the backup-file, so the growth is done again
+    // if too little was added to hold the bookkeeping for it, the image
+    // is served at the size it has, which is all it fails for
+    if(handle->num_units < fssize / ALLOC_UNIT){
+        int err;
+        __myfs_grow_implem(fsptr, handle->num_units * ALLOC_UNIT, lockptr, &err, fssize);
+    }
+    return 0;
+}
 
+/* Undoes __myfs_mount_implem once no more calls can come in.
+*/
+void __myfs_unmount_implem(void *fsptr, size_t fssize, void *lockptr) {
+    fs_locks* locks = (fs_locks*) lockptr;
+    handle_header* handle = (handle_header*) fsptr;
+    if(fssize < sizeof(handle_header) || handle->magic != MAGIC_NUM)
+        return;
+    for(int i=0; i<INODE_LOCKS; i++)
+        pthread_rwlock_destroy(&locks->inode_locks[i]);
+    pthread_mutex_destroy(&locks->alloc_lock);
+}
 
 
 
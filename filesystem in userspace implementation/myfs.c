@@ -37,8 +37,10 @@
 */
 
 #define FUSE_USE_VERSION 26
+#define _GNU_SOURCE
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
@@ -50,19 +52,48 @@
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdarg.h>
 
 
 struct __myfs_options_struct_t {
         const char *filename;
         const char *size;
+        const char *writeback;
+        const char *dirty_limit;
+        const char *max_size;
+        const char *attr_timeout;
+        const char *entry_timeout;
+        const char *negative_timeout;
+        int atime;
+        int lowlevel;
         int show_help;
 };
 
 #define OPTION(t, p)  { t, offsetof(struct __myfs_options_struct_t, p), 1 }
+#define OPTION_VALUE(t, p, v)  { t, offsetof(struct __myfs_options_struct_t, p), v }
+
+/* When reads update access times, see __myfs_mount_implem */
+#define MYFS_ATIME_STRICT    ((int) 0)
+#define MYFS_ATIME_RELATIME  ((int) 1)
+#define MYFS_ATIME_NOATIME   ((int) 2)
 
 static const struct fuse_opt __myfs_option_spec[] = {
         OPTION("--backupfile=%s", filename),
         OPTION("--size=%s", size),
+        OPTION("--writeback=%s", writeback),
+        OPTION("--dirty-limit=%s", dirty_limit),
+        OPTION("--max-size=%s", max_size),
+        OPTION("--attr-timeout=%s", attr_timeout),
+        OPTION("--entry-timeout=%s", entry_timeout),
+        OPTION("--negative-timeout=%s", negative_timeout),
+        OPTION_VALUE("--strictatime", atime, MYFS_ATIME_STRICT),
+        OPTION_VALUE("--relatime", atime, MYFS_ATIME_RELATIME),
+        OPTION_VALUE("--noatime", atime, MYFS_ATIME_NOATIME),
+        OPTION("--lowlevel", lowlevel),
         OPTION("-h", show_help),
         OPTION("--help", show_help),
         FUSE_OPT_END
@@ -74,19 +105,420 @@ struct __memory_block_struct_t {
 };
 typedef struct __memory_block_struct_t memory_block_t;
 
+/* The FUSE operations that get timed. Each one counts its calls,
+   failures, the nanoseconds spent in it and those spent waiting for
+   the namespace lock, and keeps a histogram of both: bucket i counts
+   calls that took from 2^i up to 2^(i+1) nanoseconds. Everything is
+   updated with relaxed atomics, so the numbers of an operation may be
+   a call apart from each other when read while calls run.
+*/
+enum __myfs_op_t {
+  __MYFS_OP_GETATTR,
+  __MYFS_OP_READDIR,
+  __MYFS_OP_MKNOD,
+  __MYFS_OP_UNLINK,
+  __MYFS_OP_MKDIR,
+  __MYFS_OP_RMDIR,
+  __MYFS_OP_RENAME,
+  __MYFS_OP_TRUNCATE,
+  __MYFS_OP_OPEN,
+  __MYFS_OP_READ,
+  __MYFS_OP_READ_BUF,
+  __MYFS_OP_WRITE,
+  __MYFS_OP_WRITE_BUF,
+  __MYFS_OP_STATFS,
+  __MYFS_OP_UTIMENS,
+  __MYFS_OP_FSYNC,
+  __MYFS_OP_LOOKUP,
+  __MYFS_OP_FORGET,
+  __MYFS_OP_SETATTR,
+  __MYFS_OP_RELEASE,
+  __MYFS_OP_OPENDIR,
+  __MYFS_OP_RELEASEDIR,
+  __MYFS_OP_FGETATTR,
+  __MYFS_OPS
+};
+
+static const char *__myfs_op_names[__MYFS_OPS] = {
+  "getattr", "readdir", "mknod", "unlink", "mkdir", "rmdir", "rename",
+  "truncate", "open", "read", "read_buf", "write", "write_buf",
+  "statfs", "utimens", "fsync", "lookup", "forget", "setattr",
+  "release", "opendir", "releasedir", "fgetattr"
+};
+
+#define MYFS_HISTOGRAM_BUCKETS  ((int) 40)    /* up to 2^40ns, about 18 minutes */
+
+/* How often the kernel looked up an inode number it has not forgotten */
+struct __myfs_lookup_struct_t {
+  uint64_t ino;      /* 0 for a free slot */
+  uint64_t count;
+};
+
+struct __myfs_op_stats_t {
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t total_ns;
+  uint64_t wait_ns;
+  uint64_t latency[MYFS_HISTOGRAM_BUCKETS];
+  uint64_t wait[MYFS_HISTOGRAM_BUCKETS];
+};
+
+/* The namespace lock is held shared by every operation and exclusively
+   by the ones that add, remove or move names (mknod, mkdir, unlink,
+   rmdir, rename). Operations on the contents of different files can
+   hence run in parallel on the threads of FUSE's multithreaded loop;
+   the implementation keeps per-file locks of its own for those.
+
+   The compactor thread takes the namespace lock exclusively for one
+   short step at a time, moving blocks of the filesystem towards the
+   start of the memory. It sleeps on compactor_cond in between and is
+   told to stop through compactor_stop.
+
+   With a backup-file, the memory is a private mapping of it, so that
+   no change reaches the file but through the journal (see
+   __myfs_write_back). One write-back runs at a time; commit_lock
+   guards the counters that let callers arriving meanwhile wait for
+   the next one and share it. commit_inflight is set from the moment
+   a write-back took its snapshot until its pages are all home, as
+   until then the file may be behind the memory even where no page is
+   marked dirty.
+
+   The flusher thread does write-backs on its own, every
+   writeback_interval seconds and whenever an operation finds more
+   than dirty_limit bytes waiting (0 turns either off), so that less
+   is left for fsync and unmount. Operations wake it through
+   flusher_cond, setting flusher_kicked.
+
+   The memory may grow, up to max_size, which moves it; memory and
+   size only stay put while the namespace lock is held.
+
+   op_stats holds the timings of the FUSE operations, which can be
+   read from the virtual file MYFS_STATS_PATH (see __myfs_stats_text).
+
+   The kernel may keep the attributes it got for attr_timeout seconds,
+   the names it looked up for entry_timeout seconds and the names it
+   found missing for negative_timeout seconds, without asking again.
+   Every change comes in through the kernel, which drops what it kept
+   about the inodes and names a change touches on its own, so nothing
+   gets stale but the timings file. The low-level operations tell the
+   kernel not to keep its attributes; the path API cannot say so for
+   a single file, so there only its size may lag behind, as it is read
+   with direct_io anyway.
+
+   With lowlevel set, FUSE's low-level API is served instead of the
+   path one, naming files by inode number (see the __myfs_ll_
+   operations). The kernel holds on to a number from the lookup that
+   hands it out until it forgets it. The path API hands out inode
+   numbers too, as the handles of open files and directories, which it
+   holds until they are released. lookups counts the holders per inode
+   number, under lookup_lock, which is taken inside the namespace lock.
+   A file removed while held keeps its inode until its last holder lets
+   go of it, and the compactor leaves inodes in place while any are
+   held.
+*/
 struct __myfs_environment_struct_t {
-  pthread_mutex_t env_lock;
+  pthread_rwlock_t ns_lock;
   uid_t           uid;
   gid_t           gid;
   void            *memory;
   size_t          size;
+  void            *locks;      /* the implementation's own locks, kept out of the memory */
   int             using_backup;
   int             backup_fd;
+  int             memory_fd;   /* file the memory is a mapping of, or -1 */
+  pthread_t       compactor;
+  pthread_mutex_t compactor_lock;
+  pthread_cond_t  compactor_cond;
+  int             compactor_running;
+  int             compactor_stop;
+  pthread_mutex_t commit_lock;
+  pthread_cond_t  commit_cond;
+  unsigned long   commit_started;
+  unsigned long   commit_done;
+  unsigned long   commit_failed;  /* last write-back that failed, 0 if none */
+  int             committing;
+  int             commit_inflight;
+  size_t          journal_off;
+  size_t          journal_size;
+  uint64_t        journal_id;
+  uint64_t        journal_seq;
+  time_t          writeback_interval;
+  size_t          dirty_limit;
+  pthread_t       flusher;
+  pthread_mutex_t flusher_lock;
+  pthread_cond_t  flusher_cond;
+  int             flusher_running;
+  int             flusher_stop;
+  int             flusher_kicked;
+  size_t          max_size;
+  struct __myfs_op_stats_t op_stats[__MYFS_OPS];
+  double          attr_timeout;
+  double          entry_timeout;
+  double          negative_timeout;
+  int             lowlevel;
+  pthread_mutex_t lookup_lock;
+  struct __myfs_lookup_struct_t *lookups;
+  size_t          lookups_cap;
+  size_t          lookups_used;
+};
+
+/* Timing of the operations */
+
+#define MYFS_STATS_PATH  "/.myfs-stats"
+#define MYFS_STATS_INO   ((fuse_ino_t) 2)    /* no inode of the implementation is at offset 2 */
+
+/* One operation being timed: when it started and the nanoseconds it
+   spent waiting for the namespace lock since. It lives on the stack of
+   the operation, which hands it to everything that takes the lock on
+   its behalf; work done on no operation's behalf hands NULL.
+*/
+struct __myfs_op_timer_t {
+  uint64_t start;
+  uint64_t wait;
 };
 
+static uint64_t __myfs_now() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec) * ((uint64_t) 1000000000) + ((uint64_t) ts.tv_nsec);
+}
+
+static void __myfs_ns_rdlock(struct __myfs_environment_struct_t *env, struct __myfs_op_timer_t *timer) {
+  uint64_t start;
+
+  if (timer == NULL) {
+    pthread_rwlock_rdlock(&(env->ns_lock));
+    return;
+  }
+  start = __myfs_now();
+  pthread_rwlock_rdlock(&(env->ns_lock));
+  timer->wait += __myfs_now() - start;
+}
+
+static void __myfs_ns_wrlock(struct __myfs_environment_struct_t *env, struct __myfs_op_timer_t *timer) {
+  uint64_t start;
+
+  if (timer == NULL) {
+    pthread_rwlock_wrlock(&(env->ns_lock));
+    return;
+  }
+  start = __myfs_now();
+  pthread_rwlock_wrlock(&(env->ns_lock));
+  timer->wait += __myfs_now() - start;
+}
+
+static int __myfs_histogram_bucket(uint64_t ns) {
+  int i;
+
+  if (ns == ((uint64_t) 0)) return 0;
+  i = 63 - __builtin_clzll(ns);
+  if (i >= MYFS_HISTOGRAM_BUCKETS) i = MYFS_HISTOGRAM_BUCKETS - 1;
+  return i;
+}
+
+static struct __myfs_op_timer_t __myfs_stats_begin() {
+  struct __myfs_op_timer_t timer;
+
+  timer.wait = (uint64_t) 0;
+  timer.start = __myfs_now();
+  return timer;
+}
+
+static void __myfs_stats_end(struct __myfs_environment_struct_t *env, enum __myfs_op_t op,
+                             const struct __myfs_op_timer_t *timer, int res) {
+  struct __myfs_op_stats_t *stats;
+  uint64_t ns;
+
+  if (env == NULL) return;
+  ns = __myfs_now() - timer->start;
+  stats = &(env->op_stats[op]);
+  __atomic_fetch_add(&(stats->calls), 1, __ATOMIC_RELAXED);
+  if (res < 0) __atomic_fetch_add(&(stats->errors), 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(stats->total_ns), ns, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(stats->wait_ns), timer->wait, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(stats->latency[__myfs_histogram_bucket(ns)]), 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(stats->wait[__myfs_histogram_bucket(timer->wait)]), 1, __ATOMIC_RELAXED);
+}
+
+static struct __myfs_environment_struct_t *__myfs_context_env() {
+  return (struct __myfs_environment_struct_t *) (fuse_get_context()->private_data);
+}
+
+static void __myfs_stats_reset(struct __myfs_environment_struct_t *env) {
+  uint64_t *p;
+  size_t i;
+
+  p = (uint64_t *) env->op_stats;
+  for (i=0;i<sizeof(env->op_stats)/(sizeof(uint64_t));i++) {
+    __atomic_store_n(&(p[i]), 0, __ATOMIC_RELAXED);
+  }
+}
+
+/* Upper end, in microseconds, of the bucket the p-th fraction of the
+   calls counted in the histogram falls into */
+static double __myfs_histogram_percentile(const uint64_t *histogram, uint64_t calls, double p) {
+  uint64_t seen, rank;
+  int i;
+
+  if (calls == ((uint64_t) 0)) return 0.0;
+  rank = (uint64_t) (p * ((double) calls));
+  if (rank >= calls) rank = calls - ((uint64_t) 1);
+  for (i=0,seen=0;i<MYFS_HISTOGRAM_BUCKETS-1;i++) {
+    seen += histogram[i];
+    if (seen > rank) break;
+  }
+  return ((double) (((uint64_t) 1) << (i + 1))) / 1000.0;
+}
+
+/* Bytes the timings can take as text: the header, a line per operation
+   and two lines of histogram buckets per operation, every number at
+   its widest
+*/
+#define MYFS_STATS_TEXT_SIZE  ((size_t) (256 + __MYFS_OPS * (512 + 2 * (32 + MYFS_HISTOGRAM_BUCKETS * 24))))
+
+/* Appends to the text of the timings, cutting off what does not fit
+   in its cap bytes, the terminating null byte included */
+static void __myfs_stats_printf(char *text, size_t cap, size_t *lenptr, const char *format, ...) {
+  va_list ap;
+  int res;
+
+  if (*lenptr + ((size_t) 1) >= cap) return;
+  va_start(ap, format);
+  res = vsnprintf(text + *lenptr, cap - *lenptr, format, ap);
+  va_end(ap);
+  if (res < 0) return;
+  *lenptr += (size_t) res;
+  if (*lenptr >= cap) *lenptr = cap - ((size_t) 1);
+}
+
+/* Renders the timings as text, into a buffer allocated with malloc.
+   One line per operation that was called gives its calls, failures,
+   average latency and lock wait, and the percentiles of both from
+   their histograms; the histograms themselves follow.
+*/
+static char *__myfs_stats_text(struct __myfs_environment_struct_t *env, size_t *lenptr) {
+  struct __myfs_op_stats_t stats;
+  char *text;
+  size_t cap, len;
+  int op, i;
+
+  cap = MYFS_STATS_TEXT_SIZE;
+  text = malloc(cap);
+  if (text == NULL) return NULL;
+  len = (size_t) 0;
+  __myfs_stats_printf(text, cap, &len,
+                      "%-10s %12s %8s %10s %10s %10s %10s %10s %10s %10s\n",
+                      "op", "calls", "errors", "avg(us)", "p50(us)", "p99(us)",
+                      "wait(us)", "wait50(us)", "wait99(us)", "total(s)");
+  for (op=0;op<__MYFS_OPS;op++) {
+    for (i=0;i<(int) (sizeof(stats)/sizeof(uint64_t));i++) {
+      ((uint64_t *) &stats)[i] = __atomic_load_n(&(((uint64_t *) &(env->op_stats[op]))[i]), __ATOMIC_RELAXED);
+    }
+    if (stats.calls == ((uint64_t) 0)) continue;
+    __myfs_stats_printf(text, cap, &len,
+                        "%-10s %12llu %8llu %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %10.3f\n",
+                        __myfs_op_names[op],
+                        (unsigned long long) stats.calls,
+                        (unsigned long long) stats.errors,
+                        ((double) stats.total_ns) / ((double) stats.calls) / 1000.0,
+                        __myfs_histogram_percentile(stats.latency, stats.calls, 0.5),
+                        __myfs_histogram_percentile(stats.latency, stats.calls, 0.99),
+                        ((double) stats.wait_ns) / ((double) stats.calls) / 1000.0,
+                        __myfs_histogram_percentile(stats.wait, stats.calls, 0.5),
+                        __myfs_histogram_percentile(stats.wait, stats.calls, 0.99),
+                        ((double) stats.total_ns) / 1e9);
+  }
+  __myfs_stats_printf(text, cap, &len,
+                      "\nhistograms: calls taking [2^i, 2^(i+1)) ns, as i:count\n");
+  for (op=0;op<__MYFS_OPS;op++) {
+    if (__atomic_load_n(&(env->op_stats[op].calls), __ATOMIC_RELAXED) == ((uint64_t) 0)) continue;
+    __myfs_stats_printf(text, cap, &len, "%s latency", __myfs_op_names[op]);
+    for (i=0;i<MYFS_HISTOGRAM_BUCKETS;i++) {
+      stats.latency[i] = __atomic_load_n(&(env->op_stats[op].latency[i]), __ATOMIC_RELAXED);
+      if (stats.latency[i] != ((uint64_t) 0))
+        __myfs_stats_printf(text, cap, &len, " %d:%llu", i, (unsigned long long) stats.latency[i]);
+    }
+    __myfs_stats_printf(text, cap, &len, "\n%s wait", __myfs_op_names[op]);
+    for (i=0;i<MYFS_HISTOGRAM_BUCKETS;i++) {
+      stats.wait[i] = __atomic_load_n(&(env->op_stats[op].wait[i]), __ATOMIC_RELAXED);
+      if (stats.wait[i] != ((uint64_t) 0))
+        __myfs_stats_printf(text, cap, &len, " %d:%llu", i, (unsigned long long) stats.wait[i]);
+    }
+    __myfs_stats_printf(text, cap, &len, "\n");
+  }
+  *lenptr = len;
+  return text;
+}
+
+/* Reads from the rendered timings like from a file */
+static int __myfs_stats_read(struct __myfs_environment_struct_t *env, char *buf, size_t size, off_t offset) {
+  char *text;
+  size_t len;
+
+  text = __myfs_stats_text(env, &len);
+  if (text == NULL) return -ENOMEM;
+  if ((offset < ((off_t) 0)) || (((size_t) offset) >= len)) {
+    size = (size_t) 0;
+  } else {
+    if (size > len - ((size_t) offset)) size = len - ((size_t) offset);
+    memcpy(buf, text + offset, size);
+  }
+  free(text);
+  return (int) size;
+}
+
+static int __myfs_is_stats(const char *path) {
+  return strcmp(path, MYFS_STATS_PATH) == 0;
+}
+
+/* What stat tells about the timings file. The size is only that of
+   the text right now; opening it sets direct_io so that reads are not
+   cut short by it.
+*/
+static int __myfs_stats_stat(struct __myfs_environment_struct_t *env, struct stat *st) {
+  char *text;
+  size_t len;
+
+  text = __myfs_stats_text(env, &len);
+  if (text == NULL) return -ENOMEM;
+  free(text);
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = (ino_t) MYFS_STATS_INO;
+  st->st_mode = S_IFREG | 0444;
+  st->st_nlink = 1;
+  st->st_uid = env->uid;
+  st->st_gid = env->gid;
+  st->st_size = (off_t) len;
+  clock_gettime(CLOCK_REALTIME, &(st->st_mtim));
+  st->st_atim = st->st_mtim;
+  st->st_ctim = st->st_mtim;
+  return 0;
+}
+
+size_t __myfs_locks_size_implem();
+int __myfs_mount_implem(void *, size_t, void *, int *, int);
+void __myfs_unmount_implem(void *, size_t, void *);
+int __myfs_journal_area_implem(void *, size_t, size_t *, size_t *, uint64_t *);
+int __myfs_dirty_ranges_implem(void *, size_t, int *, struct iovec **);
+void __myfs_mark_dirty_implem(void *, size_t, void *, size_t);
+int __myfs_is_dirty_implem(void *, size_t, const void *, size_t);
+size_t __myfs_dirty_bytes_implem(void *, size_t);
+
 #define MYFS_DEFAULT_SIZE  ((size_t) (128 << 20))   /* 128MB */
 #define MYFS_MIN_SIZE      ((size_t) (2048))        /* 2kB */
 
+#define MYFS_COMPACT_BUDGET  ((size_t) 256 << 10)    /* bytes moved per compaction step */
+#define MYFS_COMPACT_BUSY    ((long) 10000000)       /* 10ms between steps while blocks move */
+#define MYFS_COMPACT_IDLE    ((time_t) 5)            /* 5s once there is nothing to move */
+
+#define MYFS_WRITEBACK_INTERVAL  ((time_t) 5)             /* 5s */
+#define MYFS_WRITEBACK_DIRTY     ((size_t) (16 << 20))    /* 16MB */
+
+#define MYFS_ATTR_TIMEOUT      ((double) 5.0)    /* 5s */
+#define MYFS_ENTRY_TIMEOUT     ((double) 5.0)    /* 5s */
+#define MYFS_NEGATIVE_TIMEOUT  ((double) 5.0)    /* 5s */
+
 static int __myfs_parse_size(size_t *size, const char *str) {
   unsigned long long int tmp, t;
   size_t s;
@@ -102,6 +534,204 @@ static int __myfs_parse_size(size_t *size, const char *str) {
   return 1;
 }
 
+static int __myfs_parse_timeout(double *timeout, const char *str) {
+  double tmp;
+  char *end;
+
+  if (*str == '\0') return 0;
+  tmp = strtod(str, &end);
+  if (*end != '\0') return 0;
+  if (!((tmp >= 0.0) && (tmp <= ((double) INT_MAX)))) return 0;
+  *timeout = tmp;
+  return 1;
+}
+
+/* The journal is an area of the image the implementation sets aside
+   and never touches itself (see __myfs_journal_area_implem). A
+   transaction is laid out in it as a header page, then the offsets of
+   the pages it holds, padded to a whole page, then the images of these
+   pages. It is written and synced before its header is, and only once
+   the header is on disk too are the pages written to their home in
+   the file. A header still found at mount time, with the image's id
+   and a matching checksum, belongs to a transaction that may not be
+   all home yet, so it is written home again.
+
+   The pages are the ones the implementation marks dirty, so
+   MYFS_JOURNAL_PAGE has to match its DIRTY_PAGE.
+*/
+#define MYFS_JOURNAL_MAGIC  ((uint64_t) 0x4d7946534a726e6cULL)
+#define MYFS_JOURNAL_PAGE   ((size_t) 4096)
+
+struct __myfs_journal_header_struct_t {
+  uint64_t magic;
+  uint64_t id;        /* journal_id of the image */
+  uint64_t sequence;
+  uint64_t pages;
+  uint64_t checksum;  /* over the page offsets and the page images */
+};
+typedef struct __myfs_journal_header_struct_t journal_header_t;
+
+static uint64_t __myfs_checksum(uint64_t sum, const void *buf, size_t len) {
+  const unsigned char *p;
+  size_t i;
+
+  /* FNV-1a */
+  p = (const unsigned char *) buf;
+  for (i=0;i<len;i++) {
+    sum ^= (uint64_t) p[i];
+    sum *= (uint64_t) 1099511628211ULL;
+  }
+  return sum;
+}
+
+static int __myfs_pwrite_all(int fd, const void *buf, size_t len, off_t off) {
+  ssize_t res;
+
+  while (len > ((size_t) 0)) {
+    res = pwrite(fd, buf, len, off);
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf = ((const char *) buf) + res;
+    len -= (size_t) res;
+    off += (off_t) res;
+  }
+  return 0;
+}
+
+static int __myfs_pread_all(int fd, void *buf, size_t len, off_t off) {
+  ssize_t res;
+
+  while (len > ((size_t) 0)) {
+    res = pread(fd, buf, len, off);
+    if (res < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (res == 0) return -1;
+    buf = ((char *) buf) + res;
+    len -= (size_t) res;
+    off += (off_t) res;
+  }
+  return 0;
+}
+
+/* How many page images a transaction in a journal of the given size
+   can hold */
+static size_t __myfs_journal_capacity(size_t journal_size) {
+  size_t pages, offsets;
+
+  if (journal_size < 3 * MYFS_JOURNAL_PAGE) return 0;
+  pages = (journal_size - 2 * MYFS_JOURNAL_PAGE) / MYFS_JOURNAL_PAGE;
+  for (;;) {
+    offsets = (pages * sizeof(uint64_t) + MYFS_JOURNAL_PAGE - 1) / MYFS_JOURNAL_PAGE * MYFS_JOURNAL_PAGE;
+    if (MYFS_JOURNAL_PAGE + offsets + pages * MYFS_JOURNAL_PAGE <= journal_size) return pages;
+    pages--;
+  }
+}
+
+/* Writes pages home, the ones next to each other in one go. The last
+   page of the image may be cut short.
+*/
+static int __myfs_write_home(int fd, size_t size, const uint64_t *offs, const char *pages, size_t n) {
+  size_t i, j, len;
+
+  for (i=0;i<n;i=j) {
+    for (j=i+1;(j<n) && (offs[j] == offs[j-1] + MYFS_JOURNAL_PAGE);j++);
+    len = (size_t) (offs[j-1] - offs[i]) + MYFS_JOURNAL_PAGE;
+    if (offs[i] + len > size) len = size - offs[i];
+    if (__myfs_pwrite_all(fd, pages + i * MYFS_JOURNAL_PAGE, len, (off_t) offs[i]) != 0) return -1;
+  }
+  return 0;
+}
+
+/* Writes n pages through the journal, as one transaction */
+static int __myfs_journal_commit(int fd, size_t size, size_t journal_off, uint64_t id, uint64_t seq,
+                                 const uint64_t *offs, const char *pages, size_t n) {
+  journal_header_t header;
+  size_t offsets;
+
+  offsets = (n * sizeof(uint64_t) + MYFS_JOURNAL_PAGE - 1) / MYFS_JOURNAL_PAGE * MYFS_JOURNAL_PAGE;
+  if (__myfs_pwrite_all(fd, offs, n * sizeof(uint64_t), (off_t) (journal_off + MYFS_JOURNAL_PAGE)) != 0) return -1;
+  if (__myfs_pwrite_all(fd, pages, n * MYFS_JOURNAL_PAGE, (off_t) (journal_off + MYFS_JOURNAL_PAGE + offsets)) != 0) return -1;
+  if (fdatasync(fd) != 0) return -1;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = MYFS_JOURNAL_MAGIC;
+  header.id = id;
+  header.sequence = seq;
+  header.pages = (uint64_t) n;
+  header.checksum = __myfs_checksum(__myfs_checksum((uint64_t) 14695981039346656037ULL,
+                                                    offs, n * sizeof(uint64_t)),
+                                    pages, n * MYFS_JOURNAL_PAGE);
+  if (__myfs_pwrite_all(fd, &header, sizeof(header), (off_t) journal_off) != 0) return -1;
+  if (fdatasync(fd) != 0) return -1;
+
+  if (__myfs_write_home(fd, size, offs, pages, n) != 0) return -1;
+  if (fdatasync(fd) != 0) return -1;
+
+  /* Done with it. If the cleared header does not make it to disk,
+     the transaction is just written home once more at mount. */
+  memset(&header, 0, sizeof(header));
+  if (__myfs_pwrite_all(fd, &header, sizeof(header), (off_t) journal_off) != 0) return -1;
+  return 0;
+}
+
+/* Writes home the transaction left in the journal, if there is one.
+   Runs before the filesystem is mounted, with memory a private mapping
+   of the backup-file none of whose pages has been written to yet, so
+   the mapping sees what gets written to the file.
+*/
+static int __myfs_replay_journal(void *memory, size_t size, int fd) {
+  journal_header_t header;
+  size_t journal_off, journal_size, offsets, i;
+  uint64_t id, *offs, sum;
+  char *pages;
+
+  __myfs_journal_area_implem(memory, size, &journal_off, &journal_size, &id);
+  if (journal_size == ((size_t) 0)) return 0;
+  if (__myfs_pread_all(fd, &header, sizeof(header), (off_t) journal_off) != 0) return -1;
+  if ((header.magic != MYFS_JOURNAL_MAGIC) || (header.id != id) ||
+      (header.pages == ((uint64_t) 0)) || (header.pages > (uint64_t) __myfs_journal_capacity(journal_size))) {
+    return 0;
+  }
+  offsets = ((size_t) header.pages * sizeof(uint64_t) + MYFS_JOURNAL_PAGE - 1) / MYFS_JOURNAL_PAGE * MYFS_JOURNAL_PAGE;
+  offs = malloc((size_t) header.pages * sizeof(uint64_t));
+  pages = malloc((size_t) header.pages * MYFS_JOURNAL_PAGE);
+  if ((offs == NULL) || (pages == NULL)) {
+    free(offs);
+    free(pages);
+    return -1;
+  }
+  if ((__myfs_pread_all(fd, offs, (size_t) header.pages * sizeof(uint64_t), (off_t) (journal_off + MYFS_JOURNAL_PAGE)) != 0) ||
+      (__myfs_pread_all(fd, pages, (size_t) header.pages * MYFS_JOURNAL_PAGE, (off_t) (journal_off + MYFS_JOURNAL_PAGE + offsets)) != 0)) {
+    free(offs);
+    free(pages);
+    return -1;
+  }
+  sum = __myfs_checksum(__myfs_checksum((uint64_t) 14695981039346656037ULL,
+                                        offs, (size_t) header.pages * sizeof(uint64_t)),
+                        pages, (size_t) header.pages * MYFS_JOURNAL_PAGE);
+  for (i=0;i<(size_t) header.pages;i++) {
+    if ((offs[i] >= (uint64_t) size) || (offs[i] % MYFS_JOURNAL_PAGE != 0)) sum = ~(header.checksum);
+  }
+  if (sum == header.checksum) {
+    if ((__myfs_write_home(fd, size, offs, pages, (size_t) header.pages) != 0) ||
+        (fdatasync(fd) != 0)) {
+      free(offs);
+      free(pages);
+      return -1;
+    }
+  }
+  free(offs);
+  free(pages);
+  memset(&header, 0, sizeof(header));
+  if (__myfs_pwrite_all(fd, &header, sizeof(header), (off_t) journal_off) != 0) return -1;
+  if (fdatasync(fd) != 0) return -1;
+  return 0;
+}
+
 static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, struct __myfs_options_struct_t *opts) {
   int size_specified, using_backup;
   size_t size;
@@ -110,6 +740,10 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
   off_t off;
   size_t len;
   size_t orig_size;
+  pthread_rwlockattr_t rwlock_attr;
+  int __myfs_errno;
+  int memory_fd;
+  void *locks;
 
   /* Handle size */
   if (opts->size != NULL) {
@@ -131,11 +765,66 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     size = MYFS_MIN_SIZE;
   }
 
-  /* Setup lock for the threads */
-  if (pthread_mutex_init(&(env->env_lock), NULL) != 0) {
-    perror("Cannot setup mutex");
-    return 0;    
+  /* Handle growth limit, checked against the actual size below */
+  memset(env->op_stats, 0, sizeof(env->op_stats));
+  env->max_size = 0;
+  if (opts->max_size != NULL) {
+    if (!__myfs_parse_size(&(env->max_size), opts->max_size)) {
+      fprintf(stderr, "Cannot parse maximum size\n");
+      return 0;
+    }
+  }
+
+  /* Handle write-back settings */
+  env->writeback_interval = MYFS_WRITEBACK_INTERVAL;
+  if (opts->writeback != NULL) {
+    if (!__myfs_parse_size(&len, opts->writeback)) {
+      fprintf(stderr, "Cannot parse write-back interval\n");
+      return 0;
+    }
+    env->writeback_interval = (time_t) len;
+  }
+  env->dirty_limit = MYFS_WRITEBACK_DIRTY;
+  if (opts->dirty_limit != NULL) {
+    if (!__myfs_parse_size(&(env->dirty_limit), opts->dirty_limit)) {
+      fprintf(stderr, "Cannot parse dirty limit\n");
+      return 0;
+    }
+  }
+
+  /* Handle the kernel's caching */
+  env->attr_timeout = MYFS_ATTR_TIMEOUT;
+  if ((opts->attr_timeout != NULL) &&
+      (!__myfs_parse_timeout(&(env->attr_timeout), opts->attr_timeout))) {
+    fprintf(stderr, "Cannot parse attribute timeout\n");
+    return 0;
+  }
+  env->entry_timeout = MYFS_ENTRY_TIMEOUT;
+  if ((opts->entry_timeout != NULL) &&
+      (!__myfs_parse_timeout(&(env->entry_timeout), opts->entry_timeout))) {
+    fprintf(stderr, "Cannot parse entry timeout\n");
+    return 0;
+  }
+  env->negative_timeout = MYFS_NEGATIVE_TIMEOUT;
+  if ((opts->negative_timeout != NULL) &&
+      (!__myfs_parse_timeout(&(env->negative_timeout), opts->negative_timeout))) {
+    fprintf(stderr, "Cannot parse negative entry timeout\n");
+    return 0;
+  }
+
+  /* Setup lock for the threads, preferring writers so that a steady
+     stream of reads cannot hold off changes to the namespace forever */
+  if (pthread_rwlockattr_init(&rwlock_attr) != 0) {
+    perror("Cannot setup lock attributes");
+    return 0;
+  }
+  pthread_rwlockattr_setkind_np(&rwlock_attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  if (pthread_rwlock_init(&(env->ns_lock), &rwlock_attr) != 0) {
+    perror("Cannot setup lock");
+    pthread_rwlockattr_destroy(&rwlock_attr);
+    return 0;
   }
+  pthread_rwlockattr_destroy(&rwlock_attr);
   
   /* Handle backup file */
   if (opts->filename != NULL) {
@@ -143,16 +832,16 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     fd = open(opts->filename, O_CREAT | O_RDWR, 00644);
     if (fd < 0) {
       perror("Cannot open backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
     off = lseek(fd, 0, SEEK_END);
     if (off < ((off_t) 0)) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
@@ -161,8 +850,8 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     off = lseek(fd, 0, SEEK_SET);
     if (off < ((off_t) 0)) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
@@ -178,10 +867,27 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
         }
       } 
     }
+    /* If the original size is different from the current size, we
+       changed the filesystem and we need to wipe out the old filesystem
+       completely. Cutting the file down to nothing first does that
+       without writing a single page: all of it reads as zeros.
+    */
+    if ((orig_size != size) && (orig_size != ((size_t) 0))) {
+      if (ftruncate(fd, 0) != 0) {
+        perror("Cannot truncate backup-file");
+        if (close(fd) != 0) {
+          perror("Cannot close backup-file");
+        }
+        if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+          perror("Cannot destroy lock");
+        }
+        return 0;
+      }
+    }
     if (ftruncate(fd, size) != 0) {
       perror("Cannot seek in backup-file");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
@@ -190,59 +896,170 @@ static int __myfs_setup_environment(struct __myfs_environment_struct_t *env, str
     fd = -1;
     orig_size = 0;
   }
+  memory_fd = fd;
 
   /* Do the mmap */
   if (using_backup) {
-    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    /* Private, but without reserving swap for all of it up front: only
+       the pages written to ever need any */
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
     if (memory == MAP_FAILED) {
       perror("Cannot map backup-file into memory");
       if (close(fd) != 0) {
         perror("Cannot close backup-file");
       }
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
   } else {
-    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    /* Without a backup-file, the memory still comes from a (memory-only)
+       file if possible, so that reads can hand out ranges of that file
+       to FUSE instead of copying bytes out of the memory.
+    */
+    memory_fd = memfd_create("myfs", MFD_CLOEXEC);
+    if ((memory_fd >= 0) && (ftruncate(memory_fd, size) != 0)) {
+      if (close(memory_fd) != 0) {
+        perror("Cannot close memory file");
+      }
+      memory_fd = -1;
+    }
+    if (memory_fd >= 0) {
+      memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+    } else {
+      memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
     if (memory == MAP_FAILED) {
       perror("Cannot map in memory");
-      if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-        perror("Cannot destroy mutex");
+      if (memory_fd >= 0) {
+        if (close(memory_fd) != 0) {
+          perror("Cannot close memory file");
+        }
+      }
+      if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+        perror("Cannot destroy lock");
       }
       return 0;
     }
   }
 
-  /* If the original size is different from the current size, we
-     changed the filesystem and we need to wipe out the old filesystem
-     completely.
-  */
-  if (using_backup) {
-    if (orig_size != size) {
-      if (orig_size != ((size_t) 0)) {
-        memset(memory, 0, orig_size);
+  /* Finish the last write-back if it was cut short */
+  if (using_backup && (orig_size == size)) {
+    if (__myfs_replay_journal(memory, size, fd) != 0) {
+      perror("Cannot replay journal of backup-file");
+      if (munmap(memory, size) != 0) {
+        perror("Cannot unmap memory");
+      }
+      if (close(fd) != 0) {
+        perror("Cannot close backup-file");
       }
+      if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+        perror("Cannot destroy lock");
+      }
+      return 0;
     }
   }
-  
+
+  /* Format the filesystem if needed and set up its own locks */
+  __myfs_errno = EFAULT;
+  locks = malloc(__myfs_locks_size_implem());
+  if ((locks == NULL) ||
+      (__myfs_mount_implem(memory, size, locks, &__myfs_errno, opts->atime) != 0)) {
+    if (locks == NULL) __myfs_errno = ENOMEM;
+    fprintf(stderr, "Cannot mount filesystem: %s\n", strerror(__myfs_errno));
+    free(locks);
+    if (munmap(memory, size) != 0) {
+      perror("Cannot unmap memory");
+    }
+    if (memory_fd >= 0) {
+      if (close(memory_fd) != 0) {
+        perror("Cannot close backup-file");
+      }
+    }
+    if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+      perror("Cannot destroy lock");
+    }
+    return 0;
+  }
+
+  /* Setup write-back */
+  if (pthread_mutex_init(&(env->commit_lock), NULL) != 0) {
+    perror("Cannot setup lock");
+    __myfs_unmount_implem(memory, size, locks);
+    free(locks);
+    if (munmap(memory, size) != 0) {
+      perror("Cannot unmap memory");
+    }
+    if (memory_fd >= 0) {
+      if (close(memory_fd) != 0) {
+        perror("Cannot close backup-file");
+      }
+    }
+    if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+      perror("Cannot destroy lock");
+    }
+    return 0;
+  }
+  if (pthread_cond_init(&(env->commit_cond), NULL) != 0) {
+    perror("Cannot setup condition");
+    pthread_mutex_destroy(&(env->commit_lock));
+    __myfs_unmount_implem(memory, size, locks);
+    free(locks);
+    if (munmap(memory, size) != 0) {
+      perror("Cannot unmap memory");
+    }
+    if (memory_fd >= 0) {
+      if (close(memory_fd) != 0) {
+        perror("Cannot close backup-file");
+      }
+    }
+    if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+      perror("Cannot destroy lock");
+    }
+    return 0;
+  }
+  env->commit_started = 0;
+  env->commit_done = 0;
+  env->commit_failed = 0;
+  env->committing = 0;
+  env->commit_inflight = 0;
+  env->journal_seq = 0;
+  __myfs_journal_area_implem(memory, size, &(env->journal_off), &(env->journal_size), &(env->journal_id));
+
   /* Get uid and gid, write back and succeed */
   env->uid = getuid();
   env->gid = getgid();
   env->memory = memory;
   env->size = size;
+  env->locks = locks;
+  if (env->max_size < size) env->max_size = size;
   env->using_backup = using_backup;
   env->backup_fd = fd;
+  env->memory_fd = memory_fd;
+  env->compactor_running = 0;
+  env->compactor_stop = 0;
+  env->flusher_running = 0;
+  env->flusher_stop = 0;
+  env->flusher_kicked = 0;
+  env->lowlevel = opts->lowlevel;
+  pthread_mutex_init(&(env->lookup_lock), NULL);
+  env->lookups = NULL;
+  env->lookups_cap = 0;
+  env->lookups_used = 0;
   return 1;
 }
 
+static int __myfs_sync_environment(struct __myfs_environment_struct_t *env, struct __myfs_op_timer_t *timer);
+
 static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
   if (env->using_backup) {
-    if (msync(env->memory, env->size, MS_SYNC) != 0) {
+    if (__myfs_sync_environment(env, NULL) != 0) {
       perror("Cannot synchronize memory map with backup-file");
     }
   }
+  __myfs_unmount_implem(env->memory, env->size, env->locks);
+  free(env->locks);
   if (munmap(env->memory, env->size) != 0) {
     perror("Cannot unmap memory");
   }
@@ -250,405 +1067,2183 @@ static void __myfs_clear_environment(struct __myfs_environment_struct_t *env) {
     if (close(env->backup_fd) != 0) {
       perror("Cannot close backup-file");
     }
+  } else if (env->memory_fd >= 0) {
+    if (close(env->memory_fd) != 0) {
+      perror("Cannot close memory file");
+    }
+  }
+  pthread_cond_destroy(&(env->commit_cond));
+  pthread_mutex_destroy(&(env->commit_lock));
+  free(env->lookups);
+  pthread_mutex_destroy(&(env->lookup_lock));
+  if (pthread_rwlock_destroy(&(env->ns_lock)) != 0) {
+    perror("Cannot destroy lock");
+  }
+}
+
+/* Writes back to the backup-file the pages the implementation marked
+   as changed. They are copied out of the memory with every operation
+   kept out, so they make up a state the filesystem was in between two
+   operations, and then go through the journal in one transaction, so
+   that after a crash the backup-file holds either the state before or
+   the one after. Only if there are more changed pages than the journal
+   holds do they go in several transactions, one after the other, and
+   a crash in between leaves part of them written. Operations carry on
+   while the pages are written.
+*/
+static int __myfs_write_back(struct __myfs_environment_struct_t *env, struct __myfs_op_timer_t *timer) {
+  struct iovec *iov;
+  int __myfs_errno, res, i;
+  size_t n, k, off, len, capacity, done, chunk, size;
+  uint64_t *offs;
+  char *pages;
+
+  iov = NULL;
+  __myfs_errno = EIO;
+  __myfs_ns_wrlock(env, timer);
+  size = env->size;
+  res = __myfs_dirty_ranges_implem(env->memory, env->size, &__myfs_errno, &iov);
+  if (res <= 0) {
+    pthread_rwlock_unlock(&(env->ns_lock));
+    if (res == 0)
+      return 0;
+    return -1;
+  }
+  for (i=0,n=0;i<res;i++) n += (iov[i].iov_len + MYFS_JOURNAL_PAGE - 1) / MYFS_JOURNAL_PAGE;
+  offs = malloc(n * sizeof(uint64_t));
+  pages = malloc(n * MYFS_JOURNAL_PAGE);
+  if ((offs == NULL) || (pages == NULL)) {
+    for (i=0;i<res;i++) __myfs_mark_dirty_implem(env->memory, env->size, iov[i].iov_base, iov[i].iov_len);
+    pthread_rwlock_unlock(&(env->ns_lock));
+    free(offs);
+    free(pages);
+    free(iov);
+    return -1;
+  }
+  for (i=0,k=0;i<res;i++) {
+    for (off=0;off<iov[i].iov_len;off+=MYFS_JOURNAL_PAGE,k++) {
+      offs[k] = (uint64_t) (((char *) iov[i].iov_base - (char *) env->memory) + off);
+      len = iov[i].iov_len - off;
+      if (len > MYFS_JOURNAL_PAGE) len = MYFS_JOURNAL_PAGE;
+      memcpy(pages + k * MYFS_JOURNAL_PAGE, ((char *) iov[i].iov_base) + off, len);
+      memset(pages + k * MYFS_JOURNAL_PAGE + len, 0, MYFS_JOURNAL_PAGE - len);
+    }
   }
-  if (pthread_mutex_destroy(&(env->env_lock)) != 0) {
-    perror("Cannot destroy mutex");
+  __atomic_store_n(&(env->commit_inflight), 1, __ATOMIC_RELEASE);
+  pthread_rwlock_unlock(&(env->ns_lock));
+
+  res = 0;
+  capacity = __myfs_journal_capacity(env->journal_size);
+  if (capacity == ((size_t) 0)) {
+    /* No room for a journal: straight home */
+    if ((__myfs_write_home(env->backup_fd, size, offs, pages, n) != 0) ||
+        (fdatasync(env->backup_fd) != 0)) {
+      res = -1;
+    }
+    done = (res == 0) ? n : 0;
+  } else {
+    for (done=0;done<n;done+=chunk) {
+      chunk = n - done;
+      if (chunk > capacity) chunk = capacity;
+      if (__myfs_journal_commit(env->backup_fd, size, env->journal_off, env->journal_id,
+                                ++(env->journal_seq), offs + done, pages + done * MYFS_JOURNAL_PAGE, chunk) != 0) {
+        res = -1;
+        break;
+      }
+    }
   }
+
+  /* What did not make it stays dirty for the next time */
+  if (done < n) {
+    __myfs_ns_rdlock(env, timer);
+    for (k=done;k<n;k++) {
+      len = size - (size_t) offs[k];
+      if (len > MYFS_JOURNAL_PAGE) len = MYFS_JOURNAL_PAGE;
+      __myfs_mark_dirty_implem(env->memory, env->size, ((char *) env->memory) + offs[k], len);
+    }
+    pthread_rwlock_unlock(&(env->ns_lock));
+  }
+  __atomic_store_n(&(env->commit_inflight), 0, __ATOMIC_RELEASE);
+  free(offs);
+  free(pages);
+  free(iov);
+  return res;
 }
 
-static int __myfs_sync_environment(struct __myfs_environment_struct_t *env) {
+/* Makes sure every operation that completed before the call is in the
+   backup-file. A write-back that is running already may have taken its
+   snapshot too early for that, so the caller waits for the one after.
+   Callers that come in while one write-back runs all wait for the same
+   next one, which the first of them to get to it runs for all of them.
+*/
+static int __myfs_sync_environment(struct __myfs_environment_struct_t *env, struct __myfs_op_timer_t *timer) {
+  unsigned long target, mine;
+  int res;
+
   if (env == NULL) return -1;
   if (!(env->using_backup)) return 0;
-  if (msync(env->memory, env->size, MS_SYNC) != 0) return -1;
-  if (fsync(env->backup_fd) != 0) return -1;
-  return 0;
+  pthread_mutex_lock(&(env->commit_lock));
+  target = env->commit_started + 1;
+  while (env->commit_done < target) {
+    if (env->committing) {
+      pthread_cond_wait(&(env->commit_cond), &(env->commit_lock));
+      continue;
+    }
+    env->committing = 1;
+    mine = ++(env->commit_started);
+    pthread_mutex_unlock(&(env->commit_lock));
+    res = __myfs_write_back(env, timer);
+    pthread_mutex_lock(&(env->commit_lock));
+    env->committing = 0;
+    env->commit_done = mine;
+    if (res != 0) env->commit_failed = mine;
+    pthread_cond_broadcast(&(env->commit_cond));
+  }
+  res = (env->commit_failed >= target) ? -1 : 0;
+  pthread_mutex_unlock(&(env->commit_lock));
+  return res;
 }
 
 /* Declaration for the implementations of the operations */
 
-int __myfs_getattr_implem(void *, size_t, int *, uid_t, gid_t, const char *, struct stat *);
-int __myfs_readdir_implem(void *, size_t, int *, const char *, char ***);
-int __myfs_mknod_implem(void *, size_t, int *, const char *);
-int __myfs_unlink_implem(void *, size_t, int *, const char *);
-int __myfs_mkdir_implem(void *, size_t, int *, const char *);
-int __myfs_rmdir_implem(void *, size_t, int *, const char *);
-int __myfs_rename_implem(void *, size_t, int *, const char *, const char*);
-int __myfs_truncate_implem(void *, size_t, int *, const char *, off_t);
+int __myfs_getattr_implem(void *, size_t, void *, int *, uid_t, gid_t, const char *, struct stat *);
+int __myfs_readdir_implem(void *, size_t, void *, int *, const char *, void *, fuse_fill_dir_t, off_t, off_t);
+int __myfs_mknod_implem(void *, size_t, void *, int *, const char *);
+int __myfs_unlink_implem(void *, size_t, void *, int *, const char *);
+int __myfs_mkdir_implem(void *, size_t, void *, int *, const char *);
+int __myfs_rmdir_implem(void *, size_t, void *, int *, const char *);
+int __myfs_rename_implem(void *, size_t, void *, int *, const char *, const char*);
+int __myfs_truncate_implem(void *, size_t, void *, int *, const char *, off_t);
 int __myfs_open_implem(void *, size_t, int *, const char *);
-int __myfs_read_implem(void *, size_t, int *, const char *, char *, size_t, off_t);
-int __myfs_write_implem(void *, size_t, int *, const char *, const char *, size_t, off_t);
-int __myfs_statfs_implem(void *, size_t, int *, struct statvfs*);
-int __myfs_utimens_implem(void *, size_t, int *, const char *, const struct timespec [2]);
-
-/* End of declarations */
-
-/* FUSE operations part */
-
-static int __myfs_getattr(const char *path, struct stat *st) {
-  struct fuse_context *context;
-  struct __myfs_environment_struct_t *env;
-  int __myfs_errno, res;
+int __myfs_read_implem(void *, size_t, void *, int *, const char *, char *, size_t, off_t);
+int __myfs_write_implem(void *, size_t, void *, int *, const char *, const char *, size_t, off_t);
+int __myfs_statfs_implem(void *, size_t, void *, int *, struct statvfs*);
+int __myfs_utimens_implem(void *, size_t, void *, int *, const char *, const struct timespec [2]);
+int __myfs_defrag_step_implem(void *, size_t, void *, int *, size_t, int);
+int __myfs_lookup_ino_implem(void *, size_t, void *, int *, uid_t, gid_t, uint64_t, const char *, uint64_t *, struct stat *);
+int __myfs_forget_ino_implem(void *, size_t, void *, int *, uint64_t);
+int __myfs_getattr_ino_implem(void *, size_t, void *, int *, uid_t, gid_t, uint64_t, struct stat *);
+int __myfs_readdir_ino_implem(void *, size_t, void *, int *, uint64_t, void *, fuse_fill_dir_t, off_t, off_t);
+int __myfs_mknod_ino_implem(void *, size_t, void *, int *, uint64_t, const char *, int, uint64_t *);
+int __myfs_unlink_ino_implem(void *, size_t, void *, int *, uint64_t, const char *, int, int, uint64_t *);
+int __myfs_rename_ino_implem(void *, size_t, void *, int *, uint64_t, const char *, uint64_t, const char *);
+int __myfs_truncate_ino_implem(void *, size_t, void *, int *, uint64_t, off_t);
+int __myfs_utimens_ino_implem(void *, size_t, void *, int *, uint64_t, const struct timespec [2]);
+int __myfs_read_ino_implem(void *, size_t, void *, int *, uint64_t, char *, size_t, off_t);
+int __myfs_write_ino_implem(void *, size_t, void *, int *, uint64_t, const char *, size_t, off_t);
+int __myfs_read_begin_ino_implem(void *, size_t, void *, int *, uint64_t, struct iovec **, size_t, off_t);
+int __myfs_read_end_ino_implem(void *, size_t, void *, int *, uint64_t);
+int __myfs_write_begin_ino_implem(void *, size_t, void *, int *, uint64_t, struct iovec **, size_t, off_t, size_t *);
+int __myfs_write_end_ino_implem(void *, size_t, void *, int *, uint64_t, size_t, off_t, size_t, size_t);
+int __myfs_open_ino_implem(void *, size_t, int *, const char *, uint64_t *);
+int __myfs_grow_implem(void *, size_t, void *, int *, size_t);
+
+/* Holders of inode numbers */
+
+static size_t __myfs_lookup_hash(struct __myfs_environment_struct_t *env, uint64_t ino) {
+  /* Inode numbers are offsets of 64 byte units */
+  return ((size_t) (ino >> 6)) & (env->lookups_cap - ((size_t) 1));
+}
 
-  context = fuse_get_context();
-  env = (struct __myfs_environment_struct_t *) (context->private_data);
+/* Finds the slot of ino in the lookup counts, or the free slot it would
+   go into. Called with lookup_lock held, as are the two below.
+*/
+static struct __myfs_lookup_struct_t *__myfs_lookup_slot(struct __myfs_environment_struct_t *env, uint64_t ino) {
+  size_t i;
 
-  memset(st, 0, sizeof(struct stat));
-  
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_getattr_implem(env->memory,
-                              env->size,
-                              &__myfs_errno,
-                              env->uid,
-                              env->gid,
-                              path,
-                              st);
-  pthread_mutex_unlock(&(env->env_lock));  
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;
+  for (i=__myfs_lookup_hash(env, ino);
+       (env->lookups[i].ino != ino) && (env->lookups[i].ino != ((uint64_t) 0));
+       i=((i + ((size_t) 1)) & (env->lookups_cap - ((size_t) 1))));
+  return &(env->lookups[i]);
 }
 
-static int __myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                          off_t offset, struct fuse_file_info *fi) {
-  struct fuse_context *context;
-  struct __myfs_environment_struct_t *env;
-  int __myfs_errno, res, i;
-  char **names;
-  
-  (void) offset;
-  (void) fi;
-  
-  context = fuse_get_context();
-  env = (struct __myfs_environment_struct_t *) (context->private_data);
-
-  names = NULL;
-  __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_readdir_implem(env->memory,
-                              env->size,
-                              &__myfs_errno,
-                              path,
-                              &names);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0) {
-    if (res == 0) {
-      filler(buf, ".", NULL, 0);
-      filler(buf, "..", NULL, 0);
+/* Counts n more lookups of ino. Returns 0 if there is no memory to
+   count them in, 1 otherwise.
+*/
+static int __myfs_lookup_ref(struct __myfs_environment_struct_t *env, uint64_t ino, uint64_t n) {
+  struct __myfs_lookup_struct_t *old, *slot;
+  size_t old_cap, i;
+
+  /* Keep the table at most half full */
+  if (((env->lookups_used + ((size_t) 1)) << 1) > env->lookups_cap) {
+    old = env->lookups;
+    old_cap = env->lookups_cap;
+    env->lookups_cap = (old_cap == ((size_t) 0)) ? ((size_t) 64) : (old_cap << 1);
+    env->lookups = (struct __myfs_lookup_struct_t *) calloc(env->lookups_cap,
+                                                           sizeof(struct __myfs_lookup_struct_t));
+    if (env->lookups == NULL) {
+      env->lookups = old;
+      env->lookups_cap = old_cap;
       return 0;
-    } else {
-      if (names != NULL) {
-        filler(buf, ".", NULL, 0);
-        filler(buf, "..", NULL, 0);
-        for (i=0;i<res;i++) {
-          filler(buf, names[i], NULL, 0);
-          free(names[i]);
-        }
-        free(names);
-        return 0;
-      } else {
-        return -ENOENT;
-      }
     }
+    for (i=0;i<old_cap;i++) {
+      if (old[i].ino != ((uint64_t) 0)) *__myfs_lookup_slot(env, old[i].ino) = old[i];
+    }
+    free(old);
   }
-  return -__myfs_errno;
+  slot = __myfs_lookup_slot(env, ino);
+  if (slot->ino == ((uint64_t) 0)) {
+    slot->ino = ino;
+    slot->count = (uint64_t) 0;
+    env->lookups_used++;
+  }
+  slot->count += n;
+  return 1;
 }
 
-static int __myfs_mknod(const char* path, mode_t mode, dev_t dev) {
-  struct fuse_context *context;
-  struct __myfs_environment_struct_t *env;
+/* Counts n lookups of ino less. Returns 1 if the kernel does not hold
+   ino anymore now, 0 if it still does or did not before either.
+*/
+static int __myfs_lookup_unref(struct __myfs_environment_struct_t *env, uint64_t ino, uint64_t n) {
+  struct __myfs_lookup_struct_t *slot;
+  size_t i, j, k, mask;
+
+  if (env->lookups_cap == ((size_t) 0)) return 0;
+  slot = __myfs_lookup_slot(env, ino);
+  if (slot->ino == ((uint64_t) 0)) return 0;
+  if (slot->count > n) {
+    slot->count -= n;
+    return 0;
+  }
+
+  /* Free the slot and move up the ones after it that could not be
+     found from their hash anymore */
+  mask = env->lookups_cap - ((size_t) 1);
+  i = (size_t) (slot - env->lookups);
+  env->lookups[i].ino = (uint64_t) 0;
+  env->lookups_used--;
+  for (j=((i + ((size_t) 1)) & mask);
+       env->lookups[j].ino != ((uint64_t) 0);
+       j=((j + ((size_t) 1)) & mask)) {
+    k = __myfs_lookup_hash(env, env->lookups[j].ino);
+    if ((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j))) continue;
+    env->lookups[i] = env->lookups[j];
+    env->lookups[j].ino = (uint64_t) 0;
+    i = j;
+  }
+  return 1;
+}
+
+static int __myfs_lookup_held(struct __myfs_environment_struct_t *env, uint64_t ino) {
+  if (env->lookups_cap == ((size_t) 0)) return 0;
+  return __myfs_lookup_slot(env, ino)->ino == ino;
+}
+
+/* Counts one more holder of ino: a lookup of an entry about to be
+   handed to the kernel, or an open file handle. Called with the
+   namespace lock held, so that ino cannot be removed before it is
+   counted.
+*/
+static int __myfs_hold(struct __myfs_environment_struct_t *env, uint64_t ino) {
+  int res;
+
+  if (ino == ((uint64_t) FUSE_ROOT_ID)) return 0;
+  pthread_mutex_lock(&(env->lookup_lock));
+  res = __myfs_lookup_ref(env, ino, (uint64_t) 1);
+  pthread_mutex_unlock(&(env->lookup_lock));
+  if (!res) return -ENOMEM;
+  return 0;
+}
+
+/* Counts n holders of ino less, and once there are none left, frees
+   its inode if it was removed meanwhile. Called with the namespace
+   lock held.
+*/
+static void __myfs_let_go(struct __myfs_environment_struct_t *env, uint64_t ino, uint64_t n) {
+  int __myfs_errno;
+
+  pthread_mutex_lock(&(env->lookup_lock));
+  if (__myfs_lookup_unref(env, ino, n)) {
+    __myfs_errno = EINVAL;
+    __myfs_forget_ino_implem(env->memory,
+                             env->size,
+                             env->locks,
+                             &__myfs_errno,
+                             ino);
+  }
+  pthread_mutex_unlock(&(env->lookup_lock));
+}
+
+/* Removes name from the directory with inode number parent, keeping
+   its inode for as long as it has holders. Called with the namespace
+   lock held exclusively.
+*/
+static int __myfs_remove_ino(struct __myfs_environment_struct_t *env, int *errnoptr,
+                             uint64_t parent, const char *name, int dir) {
+  uint64_t ino;
+  int res;
+
+  res = __myfs_unlink_ino_implem(env->memory,
+                                 env->size,
+                                 env->locks,
+                                 errnoptr,
+                                 parent,
+                                 name,
+                                 dir,
+                                 1,
+                                 &ino);
+  if (res < 0) return res;
+  pthread_mutex_lock(&(env->lookup_lock));
+  if (!__myfs_lookup_held(env, ino)) {
+    __myfs_forget_ino_implem(env->memory,
+                             env->size,
+                             env->locks,
+                             errnoptr,
+                             ino);
+  }
+  pthread_mutex_unlock(&(env->lookup_lock));
+  return 0;
+}
+
+/* Inodes stay where they are while anyone holds their numbers */
+static int __myfs_inodes_held(struct __myfs_environment_struct_t *env) {
+  int held;
+
+  pthread_mutex_lock(&(env->lookup_lock));
+  held = (env->lookups_used > ((size_t) 0));
+  pthread_mutex_unlock(&(env->lookup_lock));
+  return held;
+}
+
+/* Doubles the memory, but not past max_size, extending the file it is
+   a mapping of first. Called with the namespace lock held exclusively.
+   Tells if there is more memory now.
+
+   The backup-file only learns that the filesystem grew at the next
+   write-back; if that never comes, the next mount finds a file larger
+   than the filesystem in it and finishes the growth itself.
+*/
+static int __myfs_grow_environment(struct __myfs_environment_struct_t *env) {
+  size_t size;
+  void *memory;
+  int fd, __myfs_errno;
+
+  if (env->size >= env->max_size) return 0;
+  size = env->size * 2;
+  if ((size < env->size) || (size > env->max_size)) size = env->max_size;
+  fd = env->using_backup ? env->backup_fd : env->memory_fd;
+  if (fd >= 0) {
+    if (ftruncate(fd, (off_t) size) != 0) {
+      perror("Cannot grow file system");
+      return 0;
+    }
+  }
+  memory = mremap(env->memory, env->size, size, MREMAP_MAYMOVE);
+  if (memory == MAP_FAILED) {
+    perror("Cannot grow file system");
+    if (fd >= 0) {
+      if (ftruncate(fd, (off_t) env->size) != 0) {
+        perror("Cannot shrink file back");
+      }
+    }
+    return 0;
+  }
+  env->memory = memory;
+  __myfs_errno = EFAULT;
+  if (__myfs_grow_implem(memory, env->size, env->locks, &__myfs_errno, size) != 0) {
+    fprintf(stderr, "Cannot grow file system: %s\n", strerror(__myfs_errno));
+    /* The filesystem stays at its size, and so do the memory and the file */
+    memory = mremap(env->memory, size, env->size, 0);
+    if (memory == MAP_FAILED) {
+      perror("Cannot shrink memory back");
+    } else {
+      env->memory = memory;
+    }
+    if (fd >= 0) {
+      if (ftruncate(fd, (off_t) env->size) != 0) {
+        perror("Cannot shrink file back");
+      }
+    }
+    return 0;
+  }
+  env->size = size;
+  return 1;
+}
+
+/* Called when an operation ran out of memory, as the free memory may
+   just be too scattered for it. Compacts the filesystem all the way,
+   keeping every other operation out meanwhile, or grows the memory if
+   there was nothing to compact, and tells if anything changed, in
+   which case the operation is worth another try.
+*/
+static int __myfs_make_room(struct __myfs_environment_struct_t *env, struct __myfs_op_timer_t *timer) {
+  int __myfs_errno, moved;
+
+  moved = 0;
+  __myfs_errno = EFAULT;
+  __myfs_ns_wrlock(env, timer);
+  while (__myfs_defrag_step_implem(env->memory,
+                                   env->size,
+                                   env->locks,
+                                   &__myfs_errno,
+                                   SIZE_MAX,
+                                   __myfs_inodes_held(env)) > 0) {
+    moved = 1;
+  }
+  if (!moved) moved = __myfs_grow_environment(env);
+  pthread_rwlock_unlock(&(env->ns_lock));
+  return moved;
+}
+
+/* The compactor thread: one step of compaction at a time, so that no
+   other operation waits on it for long, then a nap, a long one once
+   there is nothing left to move.
+*/
+static void *__myfs_compactor(void *arg) {
+  struct __myfs_environment_struct_t *env;
+  struct timespec deadline;
   int __myfs_errno, res;
 
-  (void) dev;
+  env = (struct __myfs_environment_struct_t *) arg;
+  pthread_mutex_lock(&(env->compactor_lock));
+  while (!(env->compactor_stop)) {
+    pthread_mutex_unlock(&(env->compactor_lock));
+    __myfs_errno = EFAULT;
+    __myfs_ns_wrlock(env, NULL);
+    res = __myfs_defrag_step_implem(env->memory,
+                                    env->size,
+                                    env->locks,
+                                    &__myfs_errno,
+                                    MYFS_COMPACT_BUDGET,
+                                    __myfs_inodes_held(env));
+    pthread_rwlock_unlock(&(env->ns_lock));
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (res > 0) {
+      deadline.tv_nsec += MYFS_COMPACT_BUSY;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+    } else {
+      deadline.tv_sec += MYFS_COMPACT_IDLE;
+    }
+    pthread_mutex_lock(&(env->compactor_lock));
+    if (!(env->compactor_stop)) {
+      pthread_cond_timedwait(&(env->compactor_cond), &(env->compactor_lock), &deadline);
+    }
+  }
+  pthread_mutex_unlock(&(env->compactor_lock));
+  return NULL;
+}
+
+/* The flusher thread: a write-back whenever the interval is up or an
+   operation kicked it, whichever comes first.
+*/
+static void *__myfs_flusher(void *arg) {
+  struct __myfs_environment_struct_t *env;
+  struct timespec deadline;
+  int res;
+
+  env = (struct __myfs_environment_struct_t *) arg;
+  pthread_mutex_lock(&(env->flusher_lock));
+  while (!(env->flusher_stop)) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += env->writeback_interval;
+    res = 0;
+    while ((!(env->flusher_stop)) && (!(env->flusher_kicked)) && (res == 0)) {
+      if (env->writeback_interval > ((time_t) 0)) {
+        res = pthread_cond_timedwait(&(env->flusher_cond), &(env->flusher_lock), &deadline);
+      } else {
+        res = pthread_cond_wait(&(env->flusher_cond), &(env->flusher_lock));
+      }
+    }
+    if (env->flusher_stop) break;
+    __atomic_store_n(&(env->flusher_kicked), 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&(env->flusher_lock));
+    if (__myfs_sync_environment(env, NULL) != 0) {
+      perror("Cannot write back to backup-file");
+    }
+    pthread_mutex_lock(&(env->flusher_lock));
+  }
+  pthread_mutex_unlock(&(env->flusher_lock));
+  return NULL;
+}
+
+/* Called after an operation that changed data: wakes the flusher once
+   more than dirty_limit bytes wait for it.
+*/
+static void __myfs_writeback_due(struct __myfs_environment_struct_t *env, struct __myfs_op_timer_t *timer) {
+  size_t dirty;
+
+  if (!(env->flusher_running) || (env->dirty_limit == ((size_t) 0))) return;
+  if (__atomic_load_n(&(env->flusher_kicked), __ATOMIC_RELAXED)) return;
+  __myfs_ns_rdlock(env, timer);
+  dirty = __myfs_dirty_bytes_implem(env->memory, env->size);
+  pthread_rwlock_unlock(&(env->ns_lock));
+  if (dirty < env->dirty_limit) return;
+  pthread_mutex_lock(&(env->flusher_lock));
+  __atomic_store_n(&(env->flusher_kicked), 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&(env->flusher_cond));
+  pthread_mutex_unlock(&(env->flusher_lock));
+}
+
+/* End of declarations */
+
+/* FUSE operations part */
+
+static int __myfs_getattr(const char *path, struct stat *st, struct __myfs_op_timer_t *timer) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
 
-  if (!S_ISREG(mode)) return -EPERM;
-  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  memset(st, 0, sizeof(struct stat));
+
+  if (__myfs_is_stats(path)) return __myfs_stats_stat(env, st);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_mknod_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_ns_rdlock(env, timer);
+  res = __myfs_getattr_implem(env->memory,
+                              env->size,
+                              env->locks,
+                              &__myfs_errno,
+                              env->uid,
+                              env->gid,
+                              path,
+                              st);
+  pthread_rwlock_unlock(&(env->ns_lock));  
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
-static int __myfs_unlink(const char* path) {
+/* Lists a directory in FUSE's offset mode: the names go from the
+   directory's child table straight into filler, and every one comes
+   with the offset a later call continues from once FUSE's buffer is
+   full. Offsets 1 and 2 are those after . and .., 3 the one after the
+   timings file in the root directory; the implementation numbers the
+   names of the directory from there on. The directory is the one
+   opened as fi->fh, whatever became of its path meanwhile.
+*/
+static int __myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi, struct __myfs_op_timer_t *timer) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+
+  (void) path;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
-  
+
+  if ((offset < ((off_t) 1)) && filler(buf, ".", NULL, (off_t) 1)) return 0;
+  if ((offset < ((off_t) 2)) && filler(buf, "..", NULL, (off_t) 2)) return 0;
+  if ((offset < ((off_t) 3)) && (fi->fh == ((uint64_t) FUSE_ROOT_ID)) &&
+      filler(buf, MYFS_STATS_PATH + 1, NULL, (off_t) 3)) return 0;
+
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_unlink_implem(env->memory,
-                             env->size,
-                             &__myfs_errno,
-                             path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_ns_rdlock(env, timer);
+  res = __myfs_readdir_ino_implem(env->memory,
+                                  env->size,
+                                  env->locks,
+                                  &__myfs_errno,
+                                  fi->fh,
+                                  buf,
+                                  filler,
+                                  (off_t) 3,
+                                  offset);
+  pthread_rwlock_unlock(&(env->ns_lock));
   if (res >= 0)
-    return res;
+    return 0;
   return -__myfs_errno;
 }
 
-static int __myfs_mkdir(const char* path, mode_t mode) {
+static int __myfs_mknod(const char* path, mode_t mode, dev_t dev, struct __myfs_op_timer_t *timer) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+
+  (void) dev;
+
+  if (!S_ISREG(mode)) return -EPERM;
+  if (__myfs_is_stats(path)) return -EEXIST;
   
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_mkdir_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path);
-  pthread_mutex_unlock(&(env->env_lock));
+  do {
+    __myfs_ns_wrlock(env, timer);
+    res = __myfs_mknod_implem(env->memory,
+                              env->size,
+                              env->locks,
+                              &__myfs_errno,
+                              path);
+    pthread_rwlock_unlock(&(env->ns_lock));
+  } while ((res < 0) && (__myfs_errno == EDQUOT) && __myfs_make_room(env, timer));
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
-static int __myfs_rmdir(const char* path) {
+/* Removes the file or directory at path, the way __myfs_ll_unlink and
+   __myfs_ll_rmdir do: by name in the directory the rest of the path
+   leads to, so that the inode stays until whoever has it open lets go
+   of it.
+*/
+static int __myfs_remove_path(const char *path, int dir, struct __myfs_op_timer_t *timer) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t parent;
+  char *copy, *name;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
-  
+
+  copy = strdup(path);
+  if (copy == NULL) return -ENOMEM;
+  name = strrchr(copy, '/');
+  if (name == NULL) {
+    free(copy);
+    return -ENOENT;
+  }
+  *name = '\0';
+  name++;
+
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_rmdir_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_ns_wrlock(env, timer);
+  res = __myfs_open_ino_implem(env->memory,
+                               env->size,
+                               &__myfs_errno,
+                               (copy[0] == '\0') ? "/" : copy,
+                               &parent);
+  if (res >= 0)
+    res = __myfs_remove_ino(env, &__myfs_errno, parent, name, dir);
+  pthread_rwlock_unlock(&(env->ns_lock));
+  free(copy);
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
-static int __myfs_rename(const char* from, const char* to) {
+static int __myfs_unlink(const char* path, struct __myfs_op_timer_t *timer) {
+  if (__myfs_is_stats(path)) return -EPERM;
+  return __myfs_remove_path(path, 0, timer);
+}
+
+static int __myfs_mkdir(const char* path, mode_t mode, struct __myfs_op_timer_t *timer) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
-
+  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  if (__myfs_is_stats(path)) return -EEXIST;
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_rename_implem(env->memory,
-                             env->size,
-                             &__myfs_errno,
-                             from,
-                             to);
-  pthread_mutex_unlock(&(env->env_lock));
+  do {
+    __myfs_ns_wrlock(env, timer);
+    res = __myfs_mkdir_implem(env->memory,
+                              env->size,
+                              env->locks,
+                              &__myfs_errno,
+                              path);
+    pthread_rwlock_unlock(&(env->ns_lock));
+  } while ((res < 0) && (__myfs_errno == EDQUOT) && __myfs_make_room(env, timer));
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
-static int __myfs_truncate(const char* path, off_t size) {
+static int __myfs_rmdir(const char* path, struct __myfs_op_timer_t *timer) {
+  if (__myfs_is_stats(path)) return -ENOTDIR;
+  return __myfs_remove_path(path, 1, timer);
+}
+
+static int __myfs_rename(const char* from, const char* to, struct __myfs_op_timer_t *timer) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  if (__myfs_is_stats(from) || __myfs_is_stats(to)) return -EPERM;
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_truncate_implem(env->memory,
+  do {
+    __myfs_ns_wrlock(env, timer);
+    res = __myfs_rename_implem(env->memory,
                                env->size,
+                               env->locks,
                                &__myfs_errno,
-                               path,
-                               size);
-  pthread_mutex_unlock(&(env->env_lock));
+                               from,
+                               to);
+    pthread_rwlock_unlock(&(env->ns_lock));
+  } while ((res < 0) && (__myfs_errno == EDQUOT) && __myfs_make_room(env, timer));
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
-static int __myfs_open(const char* path, struct fuse_file_info* fi) {
+static int __myfs_truncate(const char* path, off_t size, struct __myfs_op_timer_t *timer) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
 
-  if (!(((fi->flags & O_ACCMODE) == O_RDONLY) ||
-        ((fi->flags & O_ACCMODE) == O_WRONLY) ||
-        ((fi->flags & O_ACCMODE) == O_RDWR))) return -EINVAL;
-  if (fi->flags & O_TRUNC) return -EINVAL;
-  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  /* Truncating the timings to nothing is how they get reset */
+  if (__myfs_is_stats(path)) {
+    if (size != ((off_t) 0)) return -EPERM;
+    __myfs_stats_reset(env);
+    return 0;
+  }
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_open_implem(env->memory,
-                           env->size,
-                           &__myfs_errno,
-                           path);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
+  do {
+    __myfs_ns_rdlock(env, timer);
+    res = __myfs_truncate_implem(env->memory,
+                                 env->size,
+                                 env->locks,
+                                 &__myfs_errno,
+                                 path,
+                                 size);
+    pthread_rwlock_unlock(&(env->ns_lock));
+  } while ((res < 0) && (__myfs_errno == EDQUOT) && __myfs_make_room(env, timer));
+  if (res >= 0) {
+    __myfs_writeback_due(env, timer);
     return res;
+  }
   return -__myfs_errno;
 }
 
-static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+/* Opens path by handing out its inode number as the file handle, which
+   counts as a holder of the inode until the handle is released. All
+   operations on the open file go by the handle from then on; FUSE does
+   not even tell them the path (see flag_nopath).
+*/
+static int __myfs_open_handle(const char *path, struct fuse_file_info *fi, struct __myfs_op_timer_t *timer) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
+  uint64_t ino;
 
-  (void) fi;
-  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
-  
+
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_read_implem(env->memory,
-                           env->size,
-                           &__myfs_errno,
-                           path,
-                           buf,
-                           size,
-                           offset);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
+  __myfs_ns_rdlock(env, timer);
+  res = __myfs_open_ino_implem(env->memory,
+                               env->size,
+                               &__myfs_errno,
+                               path,
+                               &ino);
+  if (res >= 0) {
+    res = __myfs_hold(env, ino);
+    __myfs_errno = -res;
+  }
+  pthread_rwlock_unlock(&(env->ns_lock));
+  if (res >= 0) {
+    fi->fh = ino;
     return res;
+  }
   return -__myfs_errno;
 }
 
-static int __myfs_write(const char* path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+static int __myfs_open(const char* path, struct fuse_file_info* fi, struct __myfs_op_timer_t *timer) {
+  if (!(((fi->flags & O_ACCMODE) == O_RDONLY) ||
+        ((fi->flags & O_ACCMODE) == O_WRONLY) ||
+        ((fi->flags & O_ACCMODE) == O_RDWR))) return -EINVAL;
+  if (fi->flags & O_TRUNC) return -EINVAL;
+
+  if (__myfs_is_stats(path)) {
+    fi->fh = (uint64_t) MYFS_STATS_INO;
+    fi->direct_io = 1;
+    return 0;
+  }
+
+  return __myfs_open_handle(path, fi, timer);
+}
+
+static int __myfs_opendir(const char* path, struct fuse_file_info* fi, struct __myfs_op_timer_t *timer) {
+  if (__myfs_is_stats(path)) return -ENOTDIR;
+  return __myfs_open_handle(path, fi, timer);
+}
+
+/* Lets go of the inode held by the handle, which frees it if it was
+   removed while open. Serves releasedir too.
+*/
+static int __myfs_release(const char* path, struct fuse_file_info* fi, struct __myfs_op_timer_t *timer) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+
+  (void) path;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  if (fi->fh == ((uint64_t) MYFS_STATS_INO)) return 0;
+
+  __myfs_ns_rdlock(env, timer);
+  __myfs_let_go(env, fi->fh, (uint64_t) 1);
+  pthread_rwlock_unlock(&(env->ns_lock));
+  return 0;
+}
+
+static int __myfs_fgetattr(const char* path, struct stat *st, struct fuse_file_info* fi, struct __myfs_op_timer_t *timer) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
 
-  (void) fi;
-  
+  (void) path;
+
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
-  
+
+  memset(st, 0, sizeof(struct stat));
+
+  if (fi->fh == ((uint64_t) MYFS_STATS_INO)) return __myfs_stats_stat(env, st);
+
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_write_implem(env->memory,
-                            env->size,
-                            &__myfs_errno,
-                            path,
-                            buf,
-                            size,
-                            offset);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_ns_rdlock(env, timer);
+  res = __myfs_getattr_ino_implem(env->memory,
+                                  env->size,
+                                  env->locks,
+                                  &__myfs_errno,
+                                  env->uid,
+                                  env->gid,
+                                  fi->fh,
+                                  st);
+  pthread_rwlock_unlock(&(env->ns_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
-static int __myfs_statfs(const char* path, struct statvfs* stbuf) {
+static int __myfs_ftruncate(const char* path, off_t size, struct fuse_file_info* fi, struct __myfs_op_timer_t *timer) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
 
   (void) path;
-  
+
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
 
-  memset(stbuf, 0, sizeof(struct statvfs));
-  
+  if (fi->fh == ((uint64_t) MYFS_STATS_INO)) {
+    if (size != ((off_t) 0)) return -EPERM;
+    __myfs_stats_reset(env);
+    return 0;
+  }
+
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_statfs_implem(env->memory,
-                             env->size,
-                             &__myfs_errno,
-                             stbuf);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
+  do {
+    __myfs_ns_rdlock(env, timer);
+    res = __myfs_truncate_ino_implem(env->memory,
+                                     env->size,
+                                     env->locks,
+                                     &__myfs_errno,
+                                     fi->fh,
+                                     size);
+    pthread_rwlock_unlock(&(env->ns_lock));
+  } while ((res < 0) && (__myfs_errno == EDQUOT) && __myfs_make_room(env, timer));
+  if (res >= 0) {
+    __myfs_writeback_due(env, timer);
     return res;
+  }
   return -__myfs_errno;
 }
 
-static int __myfs_utimens(const char* path, const struct timespec ts[2]) {
+static int __myfs_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi, struct __myfs_op_timer_t *timer) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
   int __myfs_errno, res;
 
+  (void) path;
+  
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  if (fi->fh == ((uint64_t) MYFS_STATS_INO)) return __myfs_stats_read(env, buf, size, offset);
   
   __myfs_errno = ENOENT;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_utimens_implem(env->memory,
-                              env->size,
-                              &__myfs_errno,
-                              path,
-                              ts);
-  pthread_mutex_unlock(&(env->env_lock));
+  __myfs_ns_rdlock(env, timer);
+  res = __myfs_read_ino_implem(env->memory,
+                               env->size,
+                               env->locks,
+                               &__myfs_errno,
+                               fi->fh,
+                               buf,
+                               size,
+                               offset);
+  pthread_rwlock_unlock(&(env->ns_lock));
   if (res >= 0)
     return res;
   return -__myfs_errno;
 }
 
-static int __myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+/* Reads up to size bytes at offset out of the file numbered ino into
+   a buffer vector for FUSE, allocated with malloc into *bufp; the
+   caller holds the namespace lock shared.
+
+   If pin is set, the bytes are handed out as ranges of the file the
+   memory is a mapping of, which FUSE can splice to the kernel without
+   copying them. Those ranges are only the file's contents for as long
+   as the file stays locked, so then the read is left open, which
+   *pinnedptr tells: the caller must reply and only then end it with
+   __myfs_read_end_ino_implem, still under the namespace lock.
+   Otherwise, as when the memory is no mapping of a file, the range
+   touches a hole or the backup-file lags behind the memory there, the
+   bytes are copied into the buffer, with zeros for the holes, and the
+   read is over on return.
+
+   Returns 0 or a negative errno.
+*/
+static int __myfs_read_vec(struct __myfs_environment_struct_t *env, uint64_t ino, size_t size, off_t offset,
+                           int pin, struct fuse_bufvec **bufp, int *pinnedptr) {
+  struct fuse_bufvec *bufv;
+  struct iovec *iov;
+  int __myfs_errno, res, i, copy;
+  size_t total;
+  char *mem, *memory;
+
+  *pinnedptr = 0;
+  iov = NULL;
+  __myfs_errno = ENOENT;
+  res = __myfs_read_begin_ino_implem(env->memory,
+                                     env->size,
+                                     env->locks,
+                                     &__myfs_errno,
+                                     ino,
+                                     &iov,
+                                     size,
+                                     offset);
+  if (res < 0)
+    return -__myfs_errno;
+  memory = (char *) env->memory;
+  copy = (!pin) || (env->memory_fd < 0) || (res == 0);
+  /* Holes have no memory to point to */
+  for (i=0;(i<res) && (!copy);i++) {
+    copy = (iov[i].iov_base == NULL);
+  }
+  if ((!copy) && env->using_backup) {
+    /* The backup-file lags behind the memory on the pages not yet
+       written back */
+    copy = __atomic_load_n(&(env->commit_inflight), __ATOMIC_ACQUIRE);
+    for (i=0;(i<res) && (!copy);i++) {
+      copy = __myfs_is_dirty_implem(env->memory, env->size, iov[i].iov_base, iov[i].iov_len);
+    }
+  }
+
+  if (copy) {
+    for (i=0,total=0;i<res;i++) total += iov[i].iov_len;
+    mem = (total > ((size_t) 0)) ? malloc(total) : NULL;
+    bufv = malloc(sizeof(struct fuse_bufvec));
+    if ((bufv != NULL) && ((mem != NULL) || (total == ((size_t) 0)))) {
+      for (i=0,total=0;i<res;i++) {
+        if (iov[i].iov_base == NULL) {
+          memset(mem + total, 0, iov[i].iov_len);
+        } else {
+          memcpy(mem + total, iov[i].iov_base, iov[i].iov_len);
+        }
+        total += iov[i].iov_len;
+      }
+    }
+    if (res > 0) {
+      __myfs_read_end_ino_implem(env->memory, env->size, env->locks, &__myfs_errno, ino);
+    }
+    free(iov);
+    if ((bufv == NULL) || ((mem == NULL) && (total > ((size_t) 0)))) {
+      free(mem);
+      free(bufv);
+      return -ENOMEM;
+    }
+    *bufv = FUSE_BUFVEC_INIT(total);
+    bufv->buf[0].mem = mem;
+    *bufp = bufv;
+    return 0;
+  }
+
+  bufv = malloc(sizeof(struct fuse_bufvec) + (res - 1) * sizeof(struct fuse_buf));
+  if (bufv == NULL) {
+    __myfs_read_end_ino_implem(env->memory, env->size, env->locks, &__myfs_errno, ino);
+    free(iov);
+    return -ENOMEM;
+  }
+  *bufv = FUSE_BUFVEC_INIT(0);
+  for (i=0;i<res;i++) {
+    bufv->buf[i].size = iov[i].iov_len;
+    bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    bufv->buf[i].mem = NULL;
+    bufv->buf[i].fd = env->memory_fd;
+    bufv->buf[i].pos = (off_t) ((char *) iov[i].iov_base - memory);
+  }
+  bufv->count = (size_t) res;
+  free(iov);
+  *pinnedptr = 1;
+  *bufp = bufv;
+  return 0;
+}
+
+/* Same as __myfs_read, with the one copy going straight into the
+   buffer handed to FUSE. FUSE only replies once this has returned and
+   says nothing when it is done, so the ranges of the mapped file that
+   __myfs_ll_read hands out could be freed and reused by a truncate,
+   unlink or compaction before FUSE reads them; here the bytes are
+   always copied.
+*/
+static int __myfs_read_buf(const char* path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info* fi, struct __myfs_op_timer_t *timer) {
   struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
-  int __myfs_errno, res;
-  
+  struct fuse_bufvec *bufv;
+  int res, pinned;
+  char *mem;
+
   (void) path;
-  (void) datasync;
-  (void) fi;
 
   context = fuse_get_context();
   env = (struct __myfs_environment_struct_t *) (context->private_data);
-  
-  __myfs_errno = EIO;
-  pthread_mutex_lock(&(env->env_lock));
-  res = __myfs_sync_environment(env);
-  pthread_mutex_unlock(&(env->env_lock));
-  if (res >= 0)
-    return res;
-  return -__myfs_errno;  
+
+  if (fi->fh == ((uint64_t) MYFS_STATS_INO)) {
+    mem = malloc(size);
+    bufv = malloc(sizeof(struct fuse_bufvec));
+    res = ((mem == NULL) || (bufv == NULL)) ? -ENOMEM : __myfs_stats_read(env, mem, size, offset);
+    if (res < 0) {
+      free(mem);
+      free(bufv);
+      return res;
+    }
+    *bufv = FUSE_BUFVEC_INIT((size_t) res);
+    bufv->buf[0].mem = mem;
+    *bufp = bufv;
+    return 0;
+  }
+
+  __myfs_ns_rdlock(env, timer);
+  res = __myfs_read_vec(env, fi->fh, size, offset, 0, bufp, &pinned);
+  pthread_rwlock_unlock(&(env->ns_lock));
+  return res;
 }
 
-static void __myfs_destroy(void *private_data) {
+static int __myfs_write(const char* path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi, struct __myfs_op_timer_t *timer) {
+  struct fuse_context *context;
   struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  (void) path;
   
-  if (private_data == NULL) return;
-  env = (struct __myfs_environment_struct_t *) private_data;
-  __myfs_clear_environment(env);
-}
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
 
-static struct fuse_operations __myfs_operations = {
-  .getattr = __myfs_getattr,
-  .readdir = __myfs_readdir,
-  .mkdir = __myfs_mkdir,
-  .mknod = __myfs_mknod,
-  .unlink = __myfs_unlink,
-  .rmdir = __myfs_rmdir,
-  .rename = __myfs_rename,
-  .truncate = __myfs_truncate,
-  .open = __myfs_open,
-  .read = __myfs_read,
-  .write = __myfs_write,
-  .statfs = __myfs_statfs,
-  .utimens = __myfs_utimens,
-  .fsync = __myfs_fsync,
-  .destroy = __myfs_destroy
+  if (fi->fh == ((uint64_t) MYFS_STATS_INO)) return -EACCES;
+  
+  __myfs_errno = ENOENT;
+  do {
+    __myfs_ns_rdlock(env, timer);
+    res = __myfs_write_ino_implem(env->memory,
+                                  env->size,
+                                  env->locks,
+                                  &__myfs_errno,
+                                  fi->fh,
+                                  buf,
+                                  size,
+                                  offset);
+    pthread_rwlock_unlock(&(env->ns_lock));
+  } while ((res < 0) && (__myfs_errno == EDQUOT) && __myfs_make_room(env, timer));
+  if (res >= 0) {
+    __myfs_writeback_due(env, timer);
+    return res;
+  }
+  return -__myfs_errno;
+}
+
+/* Same as __myfs_write, but FUSE hands over the data as a buffer vector,
+   which may well be a pipe the kernel spliced the request into. The
+   implementation makes room for the data in the file and says where
+   that room is; fuse_buf_copy then moves the data there directly,
+   which is the one and only copy of it made in this process.
+*/
+static int __myfs_write_buf(const char* path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info* fi, struct __myfs_op_timer_t *timer) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  struct fuse_bufvec *dst;
+  struct iovec *iov;
+  int __myfs_errno, res, i;
+  size_t size, old_size;
+  ssize_t copied;
+
+  (void) path;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  if (fi->fh == ((uint64_t) MYFS_STATS_INO)) return -EACCES;
+
+  size = fuse_buf_size(buf);
+  iov = NULL;
+  __myfs_errno = ENOENT;
+  do {
+    __myfs_ns_rdlock(env, timer);
+    res = __myfs_write_begin_ino_implem(env->memory,
+                                        env->size,
+                                        env->locks,
+                                        &__myfs_errno,
+                                        fi->fh,
+                                        &iov,
+                                        size,
+                                        offset,
+                                        &old_size);
+    if (res <= 0)
+      pthread_rwlock_unlock(&(env->ns_lock));
+  } while ((res < 0) && (__myfs_errno == EDQUOT) && __myfs_make_room(env, timer));
+  if (res <= 0) {
+    if (res == 0)
+      return 0;
+    return -__myfs_errno;
+  }
+
+  dst = malloc(sizeof(struct fuse_bufvec) + (res - 1) * sizeof(struct fuse_buf));
+  if (dst == NULL) {
+    copied = -ENOMEM;
+  } else {
+    *dst = FUSE_BUFVEC_INIT(0);
+    dst->count = (size_t) res;
+    for (i=0;i<res;i++) {
+      dst->buf[i] = dst->buf[0];
+      dst->buf[i].size = iov[i].iov_len;
+      dst->buf[i].mem = iov[i].iov_base;
+    }
+    copied = fuse_buf_copy(dst, buf, 0);
+    free(dst);
+  }
+  free(iov);
+
+  res = __myfs_write_end_ino_implem(env->memory,
+                                    env->size,
+                                    env->locks,
+                                    &__myfs_errno,
+                                    fi->fh,
+                                    size,
+                                    offset,
+                                    old_size,
+                                    (copied > 0) ? ((size_t) copied) : ((size_t) 0));
+  pthread_rwlock_unlock(&(env->ns_lock));
+  if (copied < 0)
+    return (int) copied;
+  if (res >= 0) {
+    __myfs_writeback_due(env, timer);
+    return res;
+  }
+  return -__myfs_errno;
+}
+
+static int __myfs_statfs(const char* path, struct statvfs* stbuf, struct __myfs_op_timer_t *timer) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  (void) path;
+  
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  memset(stbuf, 0, sizeof(struct statvfs));
+  
+  __myfs_errno = ENOENT;
+  __myfs_ns_rdlock(env, timer);
+  res = __myfs_statfs_implem(env->memory,
+                             env->size,
+                             env->locks,
+                             &__myfs_errno,
+                             stbuf);
+  pthread_rwlock_unlock(&(env->ns_lock));
+  if (res >= 0)
+    return res;
+  return -__myfs_errno;
+}
+
+static int __myfs_utimens(const char* path, const struct timespec ts[2], struct __myfs_op_timer_t *timer) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+
+  if (__myfs_is_stats(path)) return 0;
+  
+  __myfs_errno = ENOENT;
+  __myfs_ns_rdlock(env, timer);
+  res = __myfs_utimens_implem(env->memory,
+                              env->size,
+                              env->locks,
+                              &__myfs_errno,
+                              path,
+                              ts);
+  pthread_rwlock_unlock(&(env->ns_lock));
+  if (res >= 0)
+    return res;
+  return -__myfs_errno;
+}
+
+static int __myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi, struct __myfs_op_timer_t *timer) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno, res;
+  
+  (void) path;
+  (void) datasync;
+  (void) fi;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  
+  __myfs_errno = EIO;
+  res = __myfs_sync_environment(env, timer);
+  if (res >= 0)
+    return res;
+  return -__myfs_errno;  
+}
+
+/* The operations as registered with FUSE: each one timed into
+   env->op_stats around the plain operation above
+*/
+static int __myfs_timed_getattr(const char *path, struct stat *st) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_getattr(path, st, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_GETATTR, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                                off_t offset, struct fuse_file_info *fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_readdir(path, buf, filler, offset, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_READDIR, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_mknod(const char* path, mode_t mode, dev_t dev) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_mknod(path, mode, dev, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_MKNOD, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_unlink(const char* path) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_unlink(path, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_UNLINK, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_mkdir(const char* path, mode_t mode) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_mkdir(path, mode, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_MKDIR, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_rmdir(const char* path) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_rmdir(path, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_RMDIR, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_rename(const char* from, const char* to) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_rename(from, to, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_RENAME, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_truncate(const char* path, off_t size) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_truncate(path, size, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_TRUNCATE, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_open(const char* path, struct fuse_file_info* fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_open(path, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_OPEN, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_opendir(const char* path, struct fuse_file_info* fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_opendir(path, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_OPENDIR, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_release(const char* path, struct fuse_file_info* fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_release(path, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_RELEASE, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_releasedir(const char* path, struct fuse_file_info* fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_release(path, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_RELEASEDIR, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_fgetattr(const char* path, struct stat *st, struct fuse_file_info* fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_fgetattr(path, st, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_FGETATTR, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_ftruncate(const char* path, off_t size, struct fuse_file_info* fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_ftruncate(path, size, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_TRUNCATE, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_read(const char* path, char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_read(path, buf, size, offset, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_READ, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_read_buf(const char* path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info* fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_read_buf(path, bufp, size, offset, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_READ_BUF, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_write(const char* path, const char *buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_write(path, buf, size, offset, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_WRITE, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_write_buf(const char* path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info* fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_write_buf(path, buf, offset, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_WRITE_BUF, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_statfs(const char* path, struct statvfs* stbuf) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_statfs(path, stbuf, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_STATFS, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_utimens(const char* path, const struct timespec ts[2]) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_utimens(path, ts, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_UTIMENS, &timer, res);
+  return res;
+}
+
+static int __myfs_timed_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+  struct __myfs_op_timer_t timer = __myfs_stats_begin();
+  int res = __myfs_fsync(path, datasync, fi, &timer);
+  __myfs_stats_end(__myfs_context_env(), __MYFS_OP_FSYNC, &timer, res);
+  return res;
+}
+
+/* Starts the background threads, once FUSE is done with forking */
+static void __myfs_start_threads(struct __myfs_environment_struct_t *env) {
+  /* Start compacting in the background, now that FUSE is done with
+     forking. Without the thread, memory only gets compacted when an
+     operation runs out of it.
+  */
+  if (env != NULL) {
+    if ((pthread_mutex_init(&(env->compactor_lock), NULL) == 0) &&
+        (pthread_cond_init(&(env->compactor_cond), NULL) == 0)) {
+      if (pthread_create(&(env->compactor), NULL, __myfs_compactor, env) == 0) {
+        env->compactor_running = 1;
+      } else {
+        perror("Cannot start compactor");
+        pthread_cond_destroy(&(env->compactor_cond));
+        pthread_mutex_destroy(&(env->compactor_lock));
+      }
+    }
+  }
+
+  /* Same for writing back to the backup-file. Without the thread,
+     changes only get there at fsync and unmount.
+  */
+  if ((env != NULL) && env->using_backup &&
+      ((env->writeback_interval > ((time_t) 0)) || (env->dirty_limit > ((size_t) 0)))) {
+    if ((pthread_mutex_init(&(env->flusher_lock), NULL) == 0) &&
+        (pthread_cond_init(&(env->flusher_cond), NULL) == 0)) {
+      if (pthread_create(&(env->flusher), NULL, __myfs_flusher, env) == 0) {
+        env->flusher_running = 1;
+      } else {
+        perror("Cannot start flusher");
+        pthread_cond_destroy(&(env->flusher_cond));
+        pthread_mutex_destroy(&(env->flusher_lock));
+      }
+    }
+  }
+}
+
+static void *__myfs_init(struct fuse_conn_info *conn) {
+  struct fuse_context *context;
+  struct __myfs_environment_struct_t *env;
+
+  /* Let the kernel side splice the data of writes into a pipe for
+     write_buf */
+  if (conn->capable & FUSE_CAP_SPLICE_READ) conn->want |= FUSE_CAP_SPLICE_READ;
+
+  context = fuse_get_context();
+  env = (struct __myfs_environment_struct_t *) (context->private_data);
+  __myfs_start_threads(env);
+  return env;
+}
+
+/* Lets go of the inodes that were removed while still held, by the
+   kernel or by handles never released, then tears everything down.
+   Serves the low-level API too.
+*/
+static void __myfs_destroy(void *private_data) {
+  struct __myfs_environment_struct_t *env;
+  int __myfs_errno;
+  size_t i;
+  
+  if (private_data == NULL) return;
+  env = (struct __myfs_environment_struct_t *) private_data;
+  __myfs_ns_wrlock(env, NULL);
+  for (i=0;i<env->lookups_cap;i++) {
+    if (env->lookups[i].ino != ((uint64_t) 0)) {
+      __myfs_errno = EINVAL;
+      __myfs_forget_ino_implem(env->memory, env->size, env->locks, &__myfs_errno, env->lookups[i].ino);
+    }
+  }
+  pthread_rwlock_unlock(&(env->ns_lock));
+  if (env->flusher_running) {
+    pthread_mutex_lock(&(env->flusher_lock));
+    env->flusher_stop = 1;
+    pthread_cond_signal(&(env->flusher_cond));
+    pthread_mutex_unlock(&(env->flusher_lock));
+    pthread_join(env->flusher, NULL);
+    pthread_cond_destroy(&(env->flusher_cond));
+    pthread_mutex_destroy(&(env->flusher_lock));
+    env->flusher_running = 0;
+  }
+  if (env->compactor_running) {
+    pthread_mutex_lock(&(env->compactor_lock));
+    env->compactor_stop = 1;
+    pthread_cond_signal(&(env->compactor_cond));
+    pthread_mutex_unlock(&(env->compactor_lock));
+    pthread_join(env->compactor, NULL);
+    pthread_cond_destroy(&(env->compactor_cond));
+    pthread_mutex_destroy(&(env->compactor_lock));
+    env->compactor_running = 0;
+  }
+  __myfs_clear_environment(env);
+}
+
+static struct fuse_operations __myfs_operations = {
+  .getattr = __myfs_timed_getattr,
+  .readdir = __myfs_timed_readdir,
+  .mkdir = __myfs_timed_mkdir,
+  .mknod = __myfs_timed_mknod,
+  .unlink = __myfs_timed_unlink,
+  .rmdir = __myfs_timed_rmdir,
+  .rename = __myfs_timed_rename,
+  .truncate = __myfs_timed_truncate,
+  .open = __myfs_timed_open,
+  .opendir = __myfs_timed_opendir,
+  .release = __myfs_timed_release,
+  .releasedir = __myfs_timed_releasedir,
+  .fgetattr = __myfs_timed_fgetattr,
+  .ftruncate = __myfs_timed_ftruncate,
+  .read = __myfs_timed_read,
+  .read_buf = __myfs_timed_read_buf,
+  .write = __myfs_timed_write,
+  .write_buf = __myfs_timed_write_buf,
+  .statfs = __myfs_timed_statfs,
+  .utimens = __myfs_timed_utimens,
+  .fsync = __myfs_timed_fsync,
+  .init = __myfs_init,
+  .destroy = __myfs_destroy,
+  .flag_nullpath_ok = 1,
+  .flag_nopath = 1,
+  .flag_utime_omit_ok = 1
 };
 
 /* End of FUSE operations part */
 
+/* Low-level FUSE operations part
+
+   With --lowlevel, the kernel names files and directories by the inode
+   numbers the implementation hands out instead of by paths, so an
+   operation goes straight to the inode, without following the path
+   from the root each time. The kernel holds on to a number from the
+   lookup (or mknod, mkdir) that hands it out until it forgets it;
+   env->lookups counts these, so that an inode removed from its
+   directory meanwhile stays around until then.
+
+   Reads are zero-copy here only: read replies with ranges of the file
+   the memory is mapped from and keeps the file locked until the reply
+   is sent, which read_buf above cannot do, so it copies. Writes are
+   copied here, unlike with write_buf above.
+*/
+
+/* How long the kernel may keep the attributes of ino */
+static double __myfs_ll_attr_timeout(struct __myfs_environment_struct_t *env, fuse_ino_t ino) {
+  if (ino == MYFS_STATS_INO) return 0.0;
+  return env->attr_timeout;
+}
+
+static void __myfs_ll_reply_entry(struct __myfs_environment_struct_t *env, fuse_req_t req,
+                                  struct fuse_entry_param *e, uint64_t ino, int res) {
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+    return;
+  }
+  e->ino = (fuse_ino_t) ino;
+  e->generation = (unsigned long) 0;
+  e->attr_timeout = __myfs_ll_attr_timeout(env, (fuse_ino_t) ino);
+  e->entry_timeout = env->entry_timeout;
+  fuse_reply_entry(req, e);
+}
+
+static int __myfs_ll_is_stats(fuse_ino_t parent, const char *name) {
+  return (parent == FUSE_ROOT_ID) && (strcmp(name, MYFS_STATS_PATH + 1) == 0);
+}
+
+static void __myfs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+  /* Let the kernel side splice the ranges handed out by read */
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE) conn->want |= FUSE_CAP_SPLICE_WRITE;
+  __myfs_start_threads((struct __myfs_environment_struct_t *) userdata);
+}
+
+static void __myfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  struct __myfs_environment_struct_t *env;
+  struct fuse_entry_param e;
+  struct __myfs_op_timer_t timer;
+  uint64_t ino;
+  int __myfs_errno, res;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+  memset(&e, 0, sizeof(struct fuse_entry_param));
+
+  ino = (uint64_t) 0;
+  if (__myfs_ll_is_stats(parent, name)) {
+    ino = (uint64_t) MYFS_STATS_INO;
+    res = __myfs_stats_stat(env, &(e.attr));
+  } else {
+    __myfs_errno = ENOENT;
+    __myfs_ns_rdlock(env, &timer);
+    res = __myfs_lookup_ino_implem(env->memory,
+                                   env->size,
+                                   env->locks,
+                                   &__myfs_errno,
+                                   env->uid,
+                                   env->gid,
+                                   (uint64_t) parent,
+                                   name,
+                                   &ino,
+                                   &(e.attr));
+    if (res >= 0) {
+      res = __myfs_hold(env, ino);
+    } else {
+      res = -__myfs_errno;
+    }
+    pthread_rwlock_unlock(&(env->ns_lock));
+  }
+
+  /* A missing name is replied with inode number 0 instead of ENOENT,
+     which lets the kernel keep that it is missing */
+  if ((res == -ENOENT) && (env->negative_timeout > 0.0)) {
+    e.ino = (fuse_ino_t) 0;
+    e.entry_timeout = env->negative_timeout;
+    fuse_reply_entry(req, &e);
+  } else {
+    __myfs_ll_reply_entry(env, req, &e, ino, res);
+  }
+  __myfs_stats_end(env, __MYFS_OP_LOOKUP, &timer, res);
+}
+
+static void __myfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_op_timer_t timer;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  if ((ino != FUSE_ROOT_ID) && (ino != MYFS_STATS_INO)) {
+    __myfs_ns_rdlock(env, &timer);
+    __myfs_let_go(env, (uint64_t) ino, (uint64_t) nlookup);
+    pthread_rwlock_unlock(&(env->ns_lock));
+  }
+  fuse_reply_none(req);
+  __myfs_stats_end(env, __MYFS_OP_FORGET, &timer, 0);
+}
+
+static int __myfs_ll_stat(struct __myfs_environment_struct_t *env, fuse_ino_t ino, struct stat *st, struct __myfs_op_timer_t *timer) {
+  int __myfs_errno, res;
+
+  if (ino == MYFS_STATS_INO) return __myfs_stats_stat(env, st);
+
+  __myfs_errno = ENOENT;
+  __myfs_ns_rdlock(env, timer);
+  res = __myfs_getattr_ino_implem(env->memory,
+                                  env->size,
+                                  env->locks,
+                                  &__myfs_errno,
+                                  env->uid,
+                                  env->gid,
+                                  (uint64_t) ino,
+                                  st);
+  pthread_rwlock_unlock(&(env->ns_lock));
+  if (res >= 0)
+    return res;
+  return -__myfs_errno;
+}
+
+static void __myfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct stat st;
+  struct __myfs_op_timer_t timer;
+  int res;
+
+  (void) fi;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  res = __myfs_ll_stat(env, ino, &st, &timer);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_attr(req, &st, __myfs_ll_attr_timeout(env, ino));
+  }
+  __myfs_stats_end(env, __MYFS_OP_GETATTR, &timer, res);
+}
+
+/* What truncate and utimens do for paths, for inode numbers. There are
+   no modes or owners to change.
+*/
+static void __myfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                              int to_set, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct timespec ts[2];
+  struct stat st;
+  struct __myfs_op_timer_t timer;
+  int __myfs_errno, res;
+
+  (void) fi;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  res = 0;
+  if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) res = -ENOSYS;
+
+  /* Truncating the timings to nothing is how they get reset */
+  if ((res == 0) && (ino == MYFS_STATS_INO) && (to_set & FUSE_SET_ATTR_SIZE)) {
+    if (attr->st_size != ((off_t) 0)) {
+      res = -EPERM;
+    } else {
+      __myfs_stats_reset(env);
+    }
+  } else if ((res == 0) && (to_set & FUSE_SET_ATTR_SIZE)) {
+    __myfs_errno = ENOENT;
+    do {
+      __myfs_ns_rdlock(env, &timer);
+      res = __myfs_truncate_ino_implem(env->memory,
+                                       env->size,
+                                       env->locks,
+                                       &__myfs_errno,
+                                       (uint64_t) ino,
+                                       attr->st_size);
+      pthread_rwlock_unlock(&(env->ns_lock));
+    } while ((res < 0) && (__myfs_errno == EDQUOT) && __myfs_make_room(env, &timer));
+    if (res < 0) {
+      res = -__myfs_errno;
+    } else {
+      res = 0;
+      __myfs_writeback_due(env, &timer);
+    }
+  }
+
+  /* A time that is not set stays as it is */
+  if ((res == 0) && (ino != MYFS_STATS_INO) &&
+      (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+    ts[0].tv_sec = (time_t) 0;
+    ts[0].tv_nsec = UTIME_OMIT;
+    ts[1] = ts[0];
+    if (to_set & FUSE_SET_ATTR_ATIME) ts[0] = attr->st_atim;
+    if (to_set & FUSE_SET_ATTR_MTIME) ts[1] = attr->st_mtim;
+    if (to_set & FUSE_SET_ATTR_ATIME_NOW) ts[0].tv_nsec = UTIME_NOW;
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW) ts[1].tv_nsec = UTIME_NOW;
+    __myfs_errno = ENOENT;
+    __myfs_ns_rdlock(env, &timer);
+    res = __myfs_utimens_ino_implem(env->memory,
+                                    env->size,
+                                    env->locks,
+                                    &__myfs_errno,
+                                    (uint64_t) ino,
+                                    ts);
+    pthread_rwlock_unlock(&(env->ns_lock));
+    if (res < 0) res = -__myfs_errno;
+  }
+
+  if (res == 0) res = __myfs_ll_stat(env, ino, &st, &timer);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_attr(req, &st, __myfs_ll_attr_timeout(env, ino));
+  }
+  __myfs_stats_end(env, __MYFS_OP_SETATTR, &timer, res);
+}
+
+/* Collects directory entries into the reply buffer of a readdir */
+struct __myfs_ll_dirbuf_struct_t {
+  fuse_req_t req;
+  char       *buf;
+  size_t     size;
+  size_t     used;
+};
+
+static int __myfs_ll_fill(void *arg, const char *name, const struct stat *st, off_t off) {
+  struct __myfs_ll_dirbuf_struct_t *dirbuf;
+  size_t len;
+
+  dirbuf = (struct __myfs_ll_dirbuf_struct_t *) arg;
+  len = fuse_add_direntry(dirbuf->req, dirbuf->buf + dirbuf->used, dirbuf->size - dirbuf->used,
+                          name, st, off);
+  if (len > dirbuf->size - dirbuf->used) return 1;
+  dirbuf->used += len;
+  return 0;
+}
+
+/* Same offsets as __myfs_readdir */
+static void __myfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                              off_t offset, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_ll_dirbuf_struct_t dirbuf;
+  struct stat st;
+  struct __myfs_op_timer_t timer;
+  int __myfs_errno, res, full;
+
+  (void) fi;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  dirbuf.req = req;
+  dirbuf.size = size;
+  dirbuf.used = (size_t) 0;
+  dirbuf.buf = (char *) malloc(size);
+  if (dirbuf.buf == NULL) {
+    res = -ENOMEM;
+  } else if (ino == MYFS_STATS_INO) {
+    res = -ENOTDIR;
+  } else {
+    res = 0;
+    memset(&st, 0, sizeof(struct stat));
+    st.st_ino = ino;
+    st.st_mode = S_IFDIR;
+    full = 0;
+    if (offset < ((off_t) 1)) full = __myfs_ll_fill(&dirbuf, ".", &st, (off_t) 1);
+    if ((!full) && (offset < ((off_t) 2))) full = __myfs_ll_fill(&dirbuf, "..", &st, (off_t) 2);
+    if ((!full) && (offset < ((off_t) 3)) && (ino == FUSE_ROOT_ID)) {
+      st.st_ino = MYFS_STATS_INO;
+      st.st_mode = S_IFREG;
+      full = __myfs_ll_fill(&dirbuf, MYFS_STATS_PATH + 1, &st, (off_t) 3);
+    }
+    if (!full) {
+      __myfs_errno = ENOENT;
+      __myfs_ns_rdlock(env, &timer);
+      res = __myfs_readdir_ino_implem(env->memory,
+                                      env->size,
+                                      env->locks,
+                                      &__myfs_errno,
+                                      (uint64_t) ino,
+                                      &dirbuf,
+                                      __myfs_ll_fill,
+                                      (off_t) 3,
+                                      offset);
+      pthread_rwlock_unlock(&(env->ns_lock));
+      if (res < 0) {
+        res = -__myfs_errno;
+      } else {
+        res = 0;
+      }
+    }
+  }
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_buf(req, dirbuf.buf, dirbuf.used);
+  }
+  free(dirbuf.buf);
+  __myfs_stats_end(env, __MYFS_OP_READDIR, &timer, res);
+}
+
+/* mknod and mkdir */
+static void __myfs_ll_make(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           int dir, enum __myfs_op_t op) {
+  struct __myfs_environment_struct_t *env;
+  struct fuse_entry_param e;
+  struct __myfs_op_timer_t timer;
+  uint64_t ino;
+  int __myfs_errno, res;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+  memset(&e, 0, sizeof(struct fuse_entry_param));
+
+  ino = (uint64_t) 0;
+  if (__myfs_ll_is_stats(parent, name)) {
+    res = -EEXIST;
+  } else {
+    __myfs_errno = ENOENT;
+    do {
+      __myfs_ns_wrlock(env, &timer);
+      res = __myfs_mknod_ino_implem(env->memory,
+                                    env->size,
+                                    env->locks,
+                                    &__myfs_errno,
+                                    (uint64_t) parent,
+                                    name,
+                                    dir,
+                                    &ino);
+      if (res >= 0) {
+        res = __myfs_getattr_ino_implem(env->memory,
+                                        env->size,
+                                        env->locks,
+                                        &__myfs_errno,
+                                        env->uid,
+                                        env->gid,
+                                        ino,
+                                        &(e.attr));
+      }
+      /* Counted before the lock drops, or the compactor could move the
+         inode away from the number handed to the kernel */
+      if ((res >= 0) && (__myfs_hold(env, ino) < 0)) {
+        __myfs_errno = ENOMEM;
+        res = -1;
+      }
+      pthread_rwlock_unlock(&(env->ns_lock));
+    } while ((res < 0) && (__myfs_errno == EDQUOT) && __myfs_make_room(env, &timer));
+    if (res < 0) res = -__myfs_errno;
+  }
+  __myfs_ll_reply_entry(env, req, &e, ino, res);
+  __myfs_stats_end(env, op, &timer, res);
+}
+
+static void __myfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                            mode_t mode, dev_t rdev) {
+  (void) rdev;
+
+  if (!S_ISREG(mode)) {
+    fuse_reply_err(req, EPERM);
+    return;
+  }
+  __myfs_ll_make(req, parent, name, 0, __MYFS_OP_MKNOD);
+}
+
+static void __myfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+  (void) mode;
+
+  __myfs_ll_make(req, parent, name, 1, __MYFS_OP_MKDIR);
+}
+
+/* unlink and rmdir: an inode the kernel still holds is kept until it
+   forgets it, so that open files stay usable (see __myfs_remove_ino)
+*/
+static void __myfs_ll_remove(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             int dir, enum __myfs_op_t op) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_op_timer_t timer;
+  int __myfs_errno, res;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  if (__myfs_ll_is_stats(parent, name)) {
+    res = dir ? -ENOTDIR : -EPERM;
+  } else {
+    __myfs_errno = ENOENT;
+    __myfs_ns_wrlock(env, &timer);
+    res = __myfs_remove_ino(env, &__myfs_errno, (uint64_t) parent, name, dir);
+    pthread_rwlock_unlock(&(env->ns_lock));
+    if (res < 0) res = -__myfs_errno;
+  }
+  fuse_reply_err(req, -res);
+  __myfs_stats_end(env, op, &timer, res);
+}
+
+static void __myfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  __myfs_ll_remove(req, parent, name, 0, __MYFS_OP_UNLINK);
+}
+
+static void __myfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  __myfs_ll_remove(req, parent, name, 1, __MYFS_OP_RMDIR);
+}
+
+static void __myfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                             fuse_ino_t newparent, const char *newname) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_op_timer_t timer;
+  int __myfs_errno, res;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  if (__myfs_ll_is_stats(parent, name) || __myfs_ll_is_stats(newparent, newname)) {
+    res = -EPERM;
+  } else {
+    __myfs_errno = ENOENT;
+    do {
+      __myfs_ns_wrlock(env, &timer);
+      res = __myfs_rename_ino_implem(env->memory,
+                                     env->size,
+                                     env->locks,
+                                     &__myfs_errno,
+                                     (uint64_t) parent,
+                                     name,
+                                     (uint64_t) newparent,
+                                     newname);
+      pthread_rwlock_unlock(&(env->ns_lock));
+    } while ((res < 0) && (__myfs_errno == EDQUOT) && __myfs_make_room(env, &timer));
+    if (res < 0) res = -__myfs_errno;
+  }
+  fuse_reply_err(req, -res);
+  __myfs_stats_end(env, __MYFS_OP_RENAME, &timer, res);
+}
+
+static void __myfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct stat st;
+  struct __myfs_op_timer_t timer;
+  int res;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  res = 0;
+  if (!(((fi->flags & O_ACCMODE) == O_RDONLY) ||
+        ((fi->flags & O_ACCMODE) == O_WRONLY) ||
+        ((fi->flags & O_ACCMODE) == O_RDWR))) res = -EINVAL;
+  if (fi->flags & O_TRUNC) res = -EINVAL;
+
+  if (res == 0) res = __myfs_ll_stat(env, ino, &st, &timer);
+  if ((res == 0) && S_ISDIR(st.st_mode)) res = -EISDIR;
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    if (ino == MYFS_STATS_INO) fi->direct_io = 1;
+    fuse_reply_open(req, fi);
+  }
+  __myfs_stats_end(env, __MYFS_OP_OPEN, &timer, res);
+}
+
+/* Replies with ranges of the file the memory is mapped from where it
+   can (see __myfs_read_vec), while the file is still locked: FUSE is
+   done with them once the reply is sent, and only then does the read
+   end and let the file change.
+*/
+static void __myfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t offset, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_op_timer_t timer;
+  struct fuse_bufvec *bufv;
+  char *buf;
+  int __myfs_errno, res, pinned;
+
+  (void) fi;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  if (ino == MYFS_STATS_INO) {
+    buf = (char *) malloc(size);
+    res = (buf == NULL) ? -ENOMEM : __myfs_stats_read(env, buf, size, offset);
+    if (res < 0) {
+      fuse_reply_err(req, -res);
+    } else {
+      fuse_reply_buf(req, buf, (size_t) res);
+    }
+    free(buf);
+    __myfs_stats_end(env, __MYFS_OP_READ, &timer, res);
+    return;
+  }
+
+  __myfs_ns_rdlock(env, &timer);
+  res = __myfs_read_vec(env, (uint64_t) ino, size, offset, 1, &bufv, &pinned);
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_data(req, bufv, 0);
+    res = (int) fuse_buf_size(bufv);
+    if (pinned) {
+      __myfs_read_end_ino_implem(env->memory, env->size, env->locks, &__myfs_errno, (uint64_t) ino);
+    }
+  }
+  pthread_rwlock_unlock(&(env->ns_lock));
+  if (res >= 0) {
+    free(bufv->buf[0].mem);
+    free(bufv);
+  }
+  __myfs_stats_end(env, __MYFS_OP_READ, &timer, res);
+}
+
+static void __myfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                            size_t size, off_t offset, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_op_timer_t timer;
+  int __myfs_errno, res;
+
+  (void) fi;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  if (ino == MYFS_STATS_INO) {
+    res = -EACCES;
+  } else {
+    __myfs_errno = ENOENT;
+    do {
+      __myfs_ns_rdlock(env, &timer);
+      res = __myfs_write_ino_implem(env->memory,
+                                    env->size,
+                                    env->locks,
+                                    &__myfs_errno,
+                                    (uint64_t) ino,
+                                    buf,
+                                    size,
+                                    offset);
+      pthread_rwlock_unlock(&(env->ns_lock));
+    } while ((res < 0) && (__myfs_errno == EDQUOT) && __myfs_make_room(env, &timer));
+    if (res < 0) {
+      res = -__myfs_errno;
+    } else {
+      __myfs_writeback_due(env, &timer);
+    }
+  }
+  if (res < 0) {
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_write(req, (size_t) res);
+  }
+  __myfs_stats_end(env, __MYFS_OP_WRITE, &timer, res);
+}
+
+static void __myfs_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+  struct __myfs_environment_struct_t *env;
+  struct statvfs stbuf;
+  struct __myfs_op_timer_t timer;
+  int __myfs_errno, res;
+
+  (void) ino;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  memset(&stbuf, 0, sizeof(struct statvfs));
+  __myfs_errno = ENOENT;
+  __myfs_ns_rdlock(env, &timer);
+  res = __myfs_statfs_implem(env->memory,
+                             env->size,
+                             env->locks,
+                             &__myfs_errno,
+                             &stbuf);
+  pthread_rwlock_unlock(&(env->ns_lock));
+  if (res < 0) {
+    res = -__myfs_errno;
+    fuse_reply_err(req, -res);
+  } else {
+    fuse_reply_statfs(req, &stbuf);
+  }
+  __myfs_stats_end(env, __MYFS_OP_STATFS, &timer, res);
+}
+
+static void __myfs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+  struct __myfs_environment_struct_t *env;
+  struct __myfs_op_timer_t timer;
+  int res;
+
+  (void) ino;
+  (void) datasync;
+  (void) fi;
+
+  timer = __myfs_stats_begin();
+  env = (struct __myfs_environment_struct_t *) fuse_req_userdata(req);
+
+  res = 0;
+  if (__myfs_sync_environment(env, &timer) < 0) res = -EIO;
+  fuse_reply_err(req, -res);
+  __myfs_stats_end(env, __MYFS_OP_FSYNC, &timer, res);
+}
+
+static struct fuse_lowlevel_ops __myfs_ll_operations = {
+  .init = __myfs_ll_init,
+  .destroy = __myfs_destroy,
+  .lookup = __myfs_ll_lookup,
+  .forget = __myfs_ll_forget,
+  .getattr = __myfs_ll_getattr,
+  .setattr = __myfs_ll_setattr,
+  .readdir = __myfs_ll_readdir,
+  .mknod = __myfs_ll_mknod,
+  .mkdir = __myfs_ll_mkdir,
+  .unlink = __myfs_ll_unlink,
+  .rmdir = __myfs_ll_rmdir,
+  .rename = __myfs_ll_rename,
+  .open = __myfs_ll_open,
+  .read = __myfs_ll_read,
+  .write = __myfs_ll_write,
+  .statfs = __myfs_ll_statfs,
+  .fsync = __myfs_ll_fsync
+};
+
+/* Mounts and serves the low-level operations, as fuse_main does for
+   the path ones
+*/
+static int __myfs_main_lowlevel(struct fuse_args *args, struct __myfs_environment_struct_t *env) {
+  struct fuse_chan *ch;
+  struct fuse_session *se;
+  char *mountpoint;
+  int multithreaded, foreground, err;
+
+  if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+    return 1;
+  if (mountpoint == NULL) {
+    fprintf(stderr, "Missing mountpoint\n");
+    return 1;
+  }
+
+  err = -1;
+  ch = fuse_mount(mountpoint, args);
+  if (ch != NULL) {
+    se = fuse_lowlevel_new(args, &__myfs_ll_operations, sizeof(__myfs_ll_operations), env);
+    if (se != NULL) {
+      if (fuse_set_signal_handlers(se) != -1) {
+        fuse_session_add_chan(se, ch);
+        if (fuse_daemonize(foreground) != -1) {
+          err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        }
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+  free(mountpoint);
+  fuse_opt_free_args(args);
+  return err ? 1 : 0;
+}
+
+/* End of low-level FUSE operations part */
+
 static void __myfs_show_help(const char *name) {
         printf("usage: %s [options] <mountpoint>\n\n", name);
         printf("File-system specific options:\n"
@@ -662,6 +3257,29 @@ static void __myfs_show_help(const char *name) {
                "                            backup-file and the size specified.\n"
                "                            The minimum size of a filesystem is 2kB. If a\n"
                "                            lesser size is used, it is increased to 2kB.\n"
+               "    --max-size=<s>          Size the file system may grow to when it is full\n"
+               "                            Default: none, it stays at its size.\n"
+               "    --writeback=<s>         Seconds between write-backs to the backup-file\n"
+               "                            Default: 5. 0 writes back only at fsync, unmount\n"
+               "                            and when the dirty limit is reached.\n"
+               "    --dirty-limit=<s>       Bytes of changes that start a write-back early\n"
+               "                            Default: 16MB. 0 turns this off.\n"
+               "    --attr-timeout=<s>      Seconds the kernel may keep attributes\n"
+               "                            Default: 5.\n"
+               "    --entry-timeout=<s>     Seconds the kernel may keep names it looked up\n"
+               "                            Default: 5.\n"
+               "    --negative-timeout=<s>  Seconds the kernel may keep names it found missing\n"
+               "                            Default: 5. 0 turns this off.\n"
+               "    --strictatime           Update access times on every read\n"
+               "    --relatime              Update access times on a read only once they are\n"
+               "                            older than the last change or a day old\n"
+               "                            This is the default.\n"
+               "    --noatime               Never update access times on a read\n"
+               "    --lowlevel              Serve FUSE's low-level API, naming files by inode\n"
+               "                            number instead of by path\n"
+               "\n"
+               "Timings of the operations can be read from " MYFS_STATS_PATH " in the\n"
+               "file system; truncating it to size 0 resets them.\n"
                "\n");
 }
 
@@ -670,10 +3288,19 @@ int main(int argc, char *argv[]) {
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
   struct __myfs_environment_struct_t __myfs_environment;
   struct __myfs_environment_struct_t *env_ptr = NULL;
+  char timeouts[128];
   
   /* Initialize defaults */
   __myfs_options.filename = NULL;
   __myfs_options.size = NULL;
+  __myfs_options.writeback = NULL;
+  __myfs_options.dirty_limit = NULL;
+  __myfs_options.max_size = NULL;
+  __myfs_options.attr_timeout = NULL;
+  __myfs_options.entry_timeout = NULL;
+  __myfs_options.negative_timeout = NULL;
+  __myfs_options.atime = MYFS_ATIME_RELATIME;
+  __myfs_options.lowlevel = 0;
   __myfs_options.show_help = 0;
         
   /* Parse options */
@@ -693,6 +3320,21 @@ int main(int argc, char *argv[]) {
     assert(fuse_opt_add_arg(&args, "--help") == 0);
     args.argv[0] = (char*) "";
   }
-  
+
+  if ((env_ptr != NULL) && env_ptr->lowlevel)
+    return __myfs_main_lowlevel(&args, env_ptr);
+
+  /* The path API takes the timeouts as mount options. They go first,
+     so that any given with -o still win. hard_remove has FUSE remove
+     open files right away instead of renaming them out of the way;
+     their handles keep them (see __myfs_remove_ino).
+  */
+  if (env_ptr != NULL) {
+    snprintf(timeouts, sizeof(timeouts),
+             "-ohard_remove,attr_timeout=%g,entry_timeout=%g,negative_timeout=%g",
+             env_ptr->attr_timeout, env_ptr->entry_timeout, env_ptr->negative_timeout);
+    if (fuse_opt_insert_arg(&args, 1, timeouts) != 0)
+      return 1;
+  }
   return fuse_main(args.argc, args.argv, &__myfs_operations, env_ptr);
 }